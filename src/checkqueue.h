@@ -6,10 +6,14 @@
 #ifndef ANONCOIN_CHECKQUEUE_H
 #define ANONCOIN_CHECKQUEUE_H
 
+#include "util.h"
+
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -17,6 +21,36 @@
 template <typename T>
 class CCheckQueueControl;
 
+/** What one worker of a CCheckQueue did since it started */
+struct CCheckQueueWorkerStats
+{
+    uint64_t nChecks;
+    uint64_t nBatches;
+    //! Times it ran out of work and took half of another worker's
+    uint64_t nSteals;
+    //! Microseconds spent waiting for work
+    int64_t nIdleMicros;
+
+    CCheckQueueWorkerStats() : nChecks(0), nBatches(0), nSteals(0), nIdleMicros(0) {}
+};
+
+/** Counters of a CCheckQueue. A round is the work added between two returns of Wait, normally a block. */
+struct CCheckQueueStats
+{
+    uint64_t nRounds;
+    uint64_t nTotalChecks;
+    //! Checks in the last round
+    uint64_t nLastChecks;
+    //! Microseconds from the first Add of the last round to the return of its Wait
+    int64_t nLastMicros;
+    //! Microseconds the master spent in the last round waiting for workers to finish
+    int64_t nLastWaitMicros;
+    //! The master first, then the worker threads
+    std::vector<CCheckQueueWorkerStats> vWorkers;
+
+    CCheckQueueStats() : nRounds(0), nTotalChecks(0), nLastChecks(0), nLastMicros(0), nLastWaitMicros(0) {}
+};
+
 /**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
@@ -26,11 +60,28 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Each worker has a deque of its own which Add deals the verifications
+  * out to, so workers take their batches without contending for one lock.
+  * A worker that runs dry steals the older half of the next non-empty
+  * deque. The shared mutex is only held to settle a finished batch and to
+  * sleep when there is nothing left anywhere.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    /** A worker's own verifications, and what it did */
+    struct CWorker
+    {
+        //! Protects deque only
+        boost::mutex cs;
+        //! Taken from the back by its owner, stolen from the front by others
+        std::deque<T> deque;
+        //! Protected by the queue's mutex
+        CCheckQueueWorkerStats stats;
+    };
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -40,9 +91,18 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Room for the master, in slot 0, and the worker threads
+    boost::scoped_array<CWorker> workers;
+    unsigned int nMaxWorkers;
+
+    //! Slots taken, the master's included. Only grows.
+    unsigned int nWorkers;
+
+    //! Slot the next Add starts dealing verifications to
+    unsigned int nNextWorker;
+
+    //! Bumped whenever verifications are added to or moved between deques, so sleepers know to look again
+    uint64_t nGeneration;
 
     //! The number of workers (including the master) that are idle.
     int nIdle;
@@ -66,59 +126,149 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Counters, and when the current round started and how long the master waited in it
+    CCheckQueueStats stats;
+    int64_t nRoundStart;
+    int64_t nRoundWaitMicros;
+
+    /**
+     * Move a batch from the back of worker's deque into vChecks. Batches
+     * shrink as the deque drains and as more workers are idle, so there is
+     * something left to steal and all workers finish at about the same time.
+     */
+    unsigned int TakeBatch(CWorker& worker, std::vector<T>& vChecks, int nIdleNow)
+    {
+        boost::lock_guard<boost::mutex> lock(worker.cs);
+        unsigned int nSize = worker.deque.size();
+        if (nSize == 0)
+            return 0;
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, nSize / (nIdleNow + 2)));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            vChecks[i].swap(worker.deque.back());
+            worker.deque.pop_back();
+        }
+        return nNow;
+    }
+
+    /** Move the front half of the first non-empty deque after nSelf's into nSelf's own, returns the number moved */
+    unsigned int Steal(unsigned int nSelf, unsigned int nWorkersNow)
+    {
+        std::vector<T> vStolen;
+        for (unsigned int i = 1; i < nWorkersNow && vStolen.empty(); i++) {
+            CWorker& victim = workers[(nSelf + i) % nWorkersNow];
+            boost::lock_guard<boost::mutex> lock(victim.cs);
+            unsigned int nSteal = (victim.deque.size() + 1) / 2;
+            vStolen.resize(nSteal);
+            for (unsigned int j = 0; j < nSteal; j++) {
+                vStolen[j].swap(victim.deque.front());
+                victim.deque.pop_front();
+            }
+        }
+        if (vStolen.empty())
+            return 0;
+        CWorker& self = workers[nSelf];
+        boost::lock_guard<boost::mutex> lock(self.cs);
+        BOOST_FOREACH (T& check, vStolen) {
+            self.deque.push_back(T());
+            check.swap(self.deque.back());
+        }
+        return vStolen.size();
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        unsigned int nSelf = 0;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fMaster) {
+                assert(nWorkers < nMaxWorkers);
+                nSelf = nWorkers++;
+            }
+            nTotal++;
+        }
+        CWorker& self = workers[nSelf];
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
         unsigned int nNow = 0;
+        unsigned int nStolen = 0;
         bool fOk = true;
         do {
+            uint64_t nSeen;
+            int nIdleNow;
+            unsigned int nWorkersNow;
             {
                 boost::unique_lock<boost::mutex> lock(mutex);
                 // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
                 if (nNow) {
                     fAllOk &= fOk;
                     nTodo -= nNow;
+                    self.stats.nChecks += nNow;
+                    self.stats.nBatches++;
                     if (nTodo == 0 && !fMaster)
                         // We processed the last element; inform the master it can exit and return the result
                         condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
                 }
-                // logically, the do loop starts here
-                while (queue.empty()) {
+                if (nStolen) {
+                    self.stats.nSteals++;
+                    // Let sleeping workers steal from what we took, too
+                    if (nStolen > 1 && nIdle > 0) {
+                        nGeneration++;
+                        condWorker.notify_all();
+                        condMaster.notify_one();
+                    }
+                }
+                // Check whether we need to do work at all
+                fOk = fAllOk;
+                nSeen = nGeneration;
+                nIdleNow = nIdle;
+                nWorkersNow = nWorkers;
+            }
+
+            nStolen = 0;
+            nNow = TakeBatch(self, vChecks, nIdleNow);
+            if (nNow == 0) {
+                nStolen = Steal(nSelf, nWorkersNow);
+                if (nStolen)
+                    nNow = TakeBatch(self, vChecks, nIdleNow);
+            }
+
+            if (nNow && !fOk) {
+                // fOk may be left from a failed round that ended since; holding
+                // checks of the current one, fAllOk is for that one
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fOk = fAllOk;
+            }
+
+            if (nNow == 0) {
+                // Nothing anywhere: sleep until something is added, unless all is done
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nGeneration == nSeen) {
                     if ((fMaster || fQuit) && nTodo == 0) {
                         nTotal--;
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
+                        if (fMaster) {
                             fAllOk = true;
+                            EndRound();
+                        }
                         // return the current status
                         return fRet;
                     }
                     nIdle++;
+                    int64_t nWaitStart = GetTimeMicros();
                     cond.wait(lock); // wait
+                    int64_t nWaited = GetTimeMicros() - nWaitStart;
+                    self.stats.nIdleMicros += nWaited;
+                    if (fMaster)
+                        nRoundWaitMicros += nWaited;
                     nIdle--;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
+
             // execute work
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
@@ -127,9 +277,29 @@ private:
         } while (true);
     }
 
+    /** Close the round the master waited for. Requires mutex. */
+    void EndRound()
+    {
+        uint64_t nChecks = 0;
+        for (unsigned int i = 0; i < nWorkers; i++)
+            nChecks += workers[i].stats.nChecks;
+        if (nRoundStart != 0) {
+            stats.nRounds++;
+            stats.nLastChecks = nChecks - stats.nTotalChecks;
+            stats.nLastMicros = GetTimeMicros() - nRoundStart;
+            stats.nLastWaitMicros = nRoundWaitMicros;
+        }
+        stats.nTotalChecks = nChecks;
+        nRoundStart = 0;
+        nRoundWaitMicros = 0;
+    }
+
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with room for nMaxWorkersIn worker threads besides the master
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkersIn = 64) :
+        workers(new CWorker[nMaxWorkersIn + 1]), nMaxWorkers(nMaxWorkersIn + 1), nWorkers(1), nNextWorker(0),
+        nGeneration(0), nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn),
+        nRoundStart(0), nRoundWaitMicros(0) {}
 
     //! Worker thread
     void Thread()
@@ -143,18 +313,29 @@ public:
         return Loop(true);
     }
 
-    //! Add a batch of checks to the queue
+    //! Add a batch of checks to the queue, dealt out over the workers' deques in runs
     void Add(std::vector<T>& vChecks)
     {
+        if (vChecks.empty())
+            return;
         boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (nRoundStart == 0)
+            nRoundStart = GetTimeMicros();
+        unsigned int nRun = std::max<size_t>(1, vChecks.size() / nWorkers);
+        for (unsigned int i = 0; i < vChecks.size(); i += nRun) {
+            CWorker& worker = workers[nNextWorker];
+            nNextWorker = (nNextWorker + 1) % nWorkers;
+            boost::lock_guard<boost::mutex> lockWorker(worker.cs);
+            for (unsigned int j = i; j < std::min<size_t>(i + nRun, vChecks.size()); j++) {
+                worker.deque.push_back(T());
+                vChecks[j].swap(worker.deque.back());
+            }
         }
         nTodo += vChecks.size();
+        nGeneration++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -162,10 +343,21 @@ public:
     {
     }
 
+    //! Whether nothing is queued or being verified. Workers may still be looking for work.
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
+    }
+
+    //! Counters of the queue and of each worker
+    CCheckQueueStats GetStats()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCheckQueueStats ret = stats;
+        for (unsigned int i = 0; i < nWorkers; i++)
+            ret.vWorkers.push_back(workers[i].stats);
+        return ret;
     }
 
 };
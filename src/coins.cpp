@@ -5,7 +5,11 @@
 
 #include "coins.h"
 
+#include "clientversion.h"
+#include "hash.h"
 #include "random.h"
+#include "streams.h"
+#include "version.h"
 
 #include <assert.h>
 
@@ -214,6 +218,24 @@ unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
 
+void CCoinsViewCache::GetStatsDelta(CCoinsStatsDelta &delta) const {
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoins coinsOld;
+        if (!(it->second.flags & CCoinsCacheEntry::FRESH))
+            base->GetCoins(it->first, coinsOld);
+        delta.Update(it->first, coinsOld, it->second.coins);
+    }
+}
+
+void CCoinsViewCache::GetDirtyCoins(CCoinsLayer &layer) const {
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            layer[it->first] = it->second.coins;
+    }
+}
+
 const CTxOut &CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
     const CCoins* coins = AccessCoins(input.prevout.hash);
@@ -264,6 +286,70 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
+uint256 GetCoinsOutputHash(const uint256 &txid, unsigned int nPos, const CCoins &coins)
+{
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << txid;
+    ss << VARINT(nPos);
+    ss << VARINT(coins.nHeight * 2 + (coins.fCoinBase ? 1 : 0));
+    ss << coins.vout[nPos];
+    return Hash(ss.begin(), ss.end());
+}
+
+void CCoinsStatsDelta::Update(const uint256 &txid, const CCoins &coinsOld, const CCoins &coinsNew)
+{
+    bool fOld = !coinsOld.IsPruned();
+    bool fNew = !coinsNew.IsPruned();
+    // Same accounting as CCoinsViewDB::GetStats(): the txid plus the serialized record
+    if (fOld) {
+        nTransactions--;
+        nSerializedSize -= 32 + coinsOld.GetSerializeSize(SER_DISK, CLIENT_VERSION);
+    }
+    if (fNew) {
+        nTransactions++;
+        nSerializedSize += 32 + coinsNew.GetSerializeSize(SER_DISK, CLIENT_VERSION);
+    }
+    // Only outputs whose presence or content changed need hashing, spending one
+    // output of a large transaction stays cheap.
+    bool fSameTx = fOld && fNew && coinsOld.nHeight == coinsNew.nHeight && coinsOld.fCoinBase == coinsNew.fCoinBase;
+    unsigned int nSize = std::max(coinsOld.vout.size(), coinsNew.vout.size());
+    for (unsigned int i = 0; i < nSize; i++) {
+        bool fHadOut = coinsOld.IsAvailable(i);
+        bool fHasOut = coinsNew.IsAvailable(i);
+        if (fHadOut && fHasOut && fSameTx && coinsOld.vout[i] == coinsNew.vout[i])
+            continue;
+        if (fHadOut) {
+            nTransactionOutputs--;
+            nTotalAmount -= coinsOld.vout[i].nValue;
+            hashChecksum -= GetCoinsOutputHash(txid, i, coinsOld);
+        }
+        if (fHasOut) {
+            nTransactionOutputs++;
+            nTotalAmount += coinsNew.vout[i].nValue;
+            hashChecksum += GetCoinsOutputHash(txid, i, coinsNew);
+        }
+    }
+}
+
+void CCoinsStatsDelta::ApplyTo(CCoinsStats &stats) const
+{
+    stats.nTransactions += nTransactions;
+    stats.nTransactionOutputs += nTransactionOutputs;
+    stats.nSerializedSize += nSerializedSize;
+    stats.nTotalAmount += nTotalAmount;
+    stats.hashChecksum += hashChecksum;
+}
+
+CCoinsStatsDelta& CCoinsStatsDelta::operator+=(const CCoinsStatsDelta &other)
+{
+    nTransactions += other.nTransactions;
+    nTransactionOutputs += other.nTransactionOutputs;
+    nSerializedSize += other.nSerializedSize;
+    nTotalAmount += other.nTotalAmount;
+    hashChecksum += other.hashChecksum;
+    return *this;
+}
+
 CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
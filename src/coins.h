@@ -12,6 +12,7 @@
 #include "undo.h"
 
 #include <assert.h>
+#include <map>
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
@@ -298,12 +299,42 @@ struct CCoinsStats
     uint64_t nTransactions;
     uint64_t nTransactionOutputs;
     uint64_t nSerializedSize;
-    uint256 hashSerialized;
+    //! Order independent checksum of the set: the sum of GetCoinsOutputHash() over all unspent outputs, modulo 2^256.
+    //! It catches corruption, but is not collision resistant and must not be used to commit to the set.
+    uint256 hashChecksum;
     CAmount nTotalAmount;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashChecksum(0), nTotalAmount(0) {}
 };
 
+/** Hash of one unspent output, the building block of CCoinsStats::hashChecksum */
+uint256 GetCoinsOutputHash(const uint256 &txid, unsigned int nPos, const CCoins &coins);
+
+/**
+ * Difference in CCoinsStats between two states of the UTXO set. As the set
+ * checksum is a sum, outputs can be added and removed in any order.
+ */
+struct CCoinsStatsDelta
+{
+    int64_t nTransactions;
+    int64_t nTransactionOutputs;
+    int64_t nSerializedSize;
+    CAmount nTotalAmount;
+    uint256 hashChecksum;
+
+    CCoinsStatsDelta() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0), hashChecksum(0) {}
+
+    //! Account for txid going from coinsOld to coinsNew (either may be pruned)
+    void Update(const uint256 &txid, const CCoins &coinsOld, const CCoins &coinsNew);
+
+    void ApplyTo(CCoinsStats &stats) const;
+
+    CCoinsStatsDelta& operator+=(const CCoinsStatsDelta &other);
+};
+
+
+/** Coins changed by one or more blocks, pruned entries mark spent transactions */
+typedef std::map<uint256, CCoins> CCoinsLayer;
 
 /** Abstract view on the open txout dataset. */
 class CCoinsView
@@ -418,6 +449,15 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    /**
+     * Calculate the effect Flush() will have on the statistics of the base view.
+     * Must be called before Flush(), while the base still holds the old state.
+     */
+    void GetStatsDelta(CCoinsStatsDelta &delta) const;
+
+    //! Copy out the entries Flush() would write to the base view, pruned ones included
+    void GetDirtyCoins(CCoinsLayer &layer) const;
+
     /**
      * Amount of anoncoins coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -0,0 +1,110 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinstats.h"
+
+#include "leveldbwrapper.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+CCoinsStatsEngine coinsStatsEngine;
+
+CCoinsStatsEngine::CCoinsStatsEngine() : pcoinsview(NULL), fValid(false), fRecomputing(false), pindexPending(NULL) {}
+
+void CCoinsStatsEngine::SetBackend(CCoinsViewDB* pcoinsviewIn)
+{
+    LOCK(cs);
+    pcoinsview = pcoinsviewIn;
+    fValid = false;
+}
+
+bool CCoinsStatsEngine::IsTracking() const
+{
+    LOCK(cs);
+    return fValid || fRecomputing;
+}
+
+void CCoinsStatsEngine::Update(const CCoinsStatsDelta& delta, const CBlockIndex* pindexNew)
+{
+    LOCK(cs);
+    if (fRecomputing) {
+        deltaPending += delta;
+        pindexPending = pindexNew;
+    } else if (fValid) {
+        delta.ApplyTo(stats);
+        stats.nHeight = pindexNew ? pindexNew->nHeight : -1;
+        stats.hashBlock = pindexNew ? pindexNew->GetBlockHash() : uint256(0);
+    }
+}
+
+bool CCoinsStatsEngine::Recompute()
+{
+    LOCK(cs_recompute);
+    boost::scoped_ptr<CLevelDBSnapshot> psnapshot;
+    CCoinsStats statsNew;
+    {
+        // Bring the database in line with the tip, then pin it. From here on
+        // blocks are applied to deltaPending instead of the cached stats.
+        LOCK2(cs_main, cs);
+        if (!pcoinsview)
+            return false;
+        FlushStateToDisk();
+        psnapshot.reset(pcoinsview->GetSnapshot());
+        statsNew.nHeight = chainActive.Height();
+        fValid = false;
+        fRecomputing = true;
+        deltaPending = CCoinsStatsDelta();
+        pindexPending = NULL;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int nThreads = std::min((int)boost::thread::hardware_concurrency(), MAX_COINSTATS_THREADS);
+    bool fOk = false;
+    try {
+        fOk = CCoinsViewDB::GetSnapshotStats(*psnapshot, statsNew, nThreads);
+    } catch (...) {
+        LOCK(cs);
+        fRecomputing = false;
+        throw;
+    }
+    LogPrint("coindb", "%s : walked %u transactions with %d threads in %dms\n", __func__, statsNew.nTransactions, nThreads, GetTimeMillis() - nStart);
+
+    {
+        LOCK(cs);
+        fRecomputing = false;
+        if (!fOk)
+            return false;
+        deltaPending.ApplyTo(statsNew);
+        if (pindexPending) {
+            statsNew.nHeight = pindexPending->nHeight;
+            statsNew.hashBlock = pindexPending->GetBlockHash();
+        }
+        stats = statsNew;
+        fValid = true;
+    }
+    return true;
+}
+
+bool CCoinsStatsEngine::GetStats(CCoinsStats& statsOut, bool fRecompute)
+{
+    {
+        LOCK(cs);
+        if (fValid && !fRecompute) {
+            statsOut = stats;
+            return true;
+        }
+    }
+    if (!Recompute())
+        return false;
+    LOCK(cs);
+    statsOut = stats;
+    return true;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ANONCOIN_COINSTATS_H
+#define ANONCOIN_COINSTATS_H
+
+#include "coins.h"
+#include "sync.h"
+
+class CBlockIndex;
+class CCoinsViewDB;
+
+/**
+ * Keeps the UTXO set statistics served by gettxoutsetinfo up to date.
+ *
+ * The first request walks a snapshot of the coin database in parallel, without
+ * holding cs_main. From then on every connected or disconnected block applies
+ * its CCoinsStatsDelta, so later requests are answered from the cache.
+ */
+class CCoinsStatsEngine
+{
+private:
+    mutable CCriticalSection cs;
+    //! Serializes full walks of the coin database
+    CCriticalSection cs_recompute;
+    CCoinsViewDB* pcoinsview;
+    //! stats matches the chain tip
+    bool fValid;
+    //! A full walk is running, block deltas are collected in deltaPending
+    bool fRecomputing;
+    CCoinsStats stats;
+    CCoinsStatsDelta deltaPending;
+    const CBlockIndex* pindexPending;
+
+public:
+    CCoinsStatsEngine();
+
+    //! Set the coin database to walk, NULL disables the engine
+    void SetBackend(CCoinsViewDB* pcoinsviewIn);
+
+    //! Whether block deltas are wanted, cheap to call from the validation code
+    bool IsTracking() const;
+
+    //! Apply the delta of a block that moved the tip to pindexNew, cs_main must be held
+    void Update(const CCoinsStatsDelta& delta, const CBlockIndex* pindexNew);
+
+    //! Walk the whole coin database again, cs_main must NOT be held
+    bool Recompute();
+
+    //! Return the cached statistics, computing them first when needed or asked for
+    bool GetStats(CCoinsStats& statsOut, bool fRecompute = false);
+};
+
+extern CCoinsStatsEngine coinsStatsEngine;
+
+#endif // ANONCOIN_COINSTATS_H
@@ -228,7 +228,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL), fInBatch(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -284,6 +284,12 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
             bitdb.mapDb[strFile] = pdb;
         }
+
+        map<string, pair<boost::thread::id, DbTxn*> >::const_iterator it = bitdb.mapBatchTxn.find(strFile);
+        if (it != bitdb.mapBatchTxn.end() && it->second.first == boost::this_thread::get_id()) {
+            activeTxn = it->second.second;
+            fInBatch = true;
+        }
     }
 }
 
@@ -304,12 +310,13 @@ void CDB::Close()
 {
     if (!pdb)
         return;
-    if (activeTxn)
+    if (activeTxn && !fInBatch)
         activeTxn->abort();
     activeTxn = NULL;
     pdb = NULL;
 
-    if (fFlushOnClose)
+    // The batch flushes once it is committed
+    if (fFlushOnClose && !fInBatch)
         Flush();
 
     {
@@ -318,6 +325,40 @@ void CDB::Close()
     }
 }
 
+CDBBatch::CDBBatch(const std::string& strFilename) : CDB(strFilename, "r+"), fOwner(false), fAbort(false)
+{
+    if (fInBatch || !TxnBegin())
+        return;
+
+    LOCK(bitdb.cs_db);
+    bitdb.mapBatchTxn[strFile] = make_pair(boost::this_thread::get_id(), activeTxn);
+    fOwner = true;
+}
+
+CDBBatch::~CDBBatch()
+{
+    if (!fOwner)
+        return;
+
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.mapBatchTxn.erase(strFile);
+    }
+    if (fAbort) {
+        if (!TxnAbort())
+            LogPrintf("%s : aborting the batch of writes to %s failed\n", __func__, strFile);
+    } else if (!TxnCommit())
+        LogPrintf("%s : committing the batch of writes to %s failed\n", __func__, strFile);
+}
+
+bool CDBBatch::Abort()
+{
+    if (!fOwner)
+        return false;
+    fAbort = true;
+    return true;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -18,6 +18,7 @@
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <db_cxx.h>
 
@@ -39,6 +40,8 @@ public:
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    //! The open CDBBatch of each file, and the thread it belongs to
+    std::map<std::string, std::pair<boost::thread::id, DbTxn*> > mapBatchTxn;
 
     CDBEnv();
     ~CDBEnv();
@@ -97,6 +100,8 @@ protected:
     DbTxn* activeTxn;
     bool fReadOnly;
     bool fFlushOnClose;
+    //! activeTxn belongs to a CDBBatch this joined, which commits it and flushes
+    bool fInBatch;
 
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+", bool fFlushOnCloseIn=true);
     ~CDB() { Close(); }
@@ -220,7 +225,7 @@ protected:
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(activeTxn, &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -264,9 +269,10 @@ protected:
     }
 
 public:
+    //! A CDB that joined a CDBBatch refuses these, the transaction is the batch's
     bool TxnBegin()
     {
-        if (!pdb || activeTxn)
+        if (!pdb || activeTxn || fInBatch)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
         if (!ptxn)
@@ -277,7 +283,7 @@ public:
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fInBatch)
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
@@ -286,7 +292,7 @@ public:
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || !activeTxn || fInBatch)
             return false;
         int ret = activeTxn->abort();
         activeTxn = NULL;
@@ -307,4 +313,31 @@ public:
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
 };
 
+/**
+ * Makes the writes to a database file that this thread does while the batch
+ * is open, through any CDB on the file, one transaction. It is committed,
+ * and the log flushed to disk, once when the batch goes out of scope rather
+ * than after each write. A batch opened inside another on the same file
+ * joins it.
+ *
+ * The pages written stay locked until the commit, so a CDB on the file that
+ * was opened before the batch must not write while it is open. Hold the
+ * lock that guards the file's contents, cs_wallet for the wallet, for the
+ * whole batch. A CDB that joined the batch cannot begin, commit or abort a
+ * transaction of its own; only the batch that opened it can abort it.
+ */
+class CDBBatch : public CDB
+{
+private:
+    bool fOwner;
+    bool fAbort;
+
+public:
+    explicit CDBBatch(const std::string& strFilename);
+    ~CDBBatch();
+
+    //! Discard everything written in the batch when it ends, false if this batch only joined another
+    bool Abort();
+};
+
 #endif // ANONCOIN_DB_H
@@ -0,0 +1,979 @@
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "ecverify.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/thread/once.hpp>
+
+namespace {
+
+/** Window of the wNAF of the public key scalars, 2^(5-2) = 8 precomputed points */
+static const int WINDOW_A = 5;
+/** Window of the wNAF of the generator scalars, 2^(12-2) = 1024 precomputed points */
+static const int WINDOW_G = 12;
+/** Longest wNAF: 128 bit halves of split scalars, or full 256 bit scalars with a final carry */
+static const int WNAF_BITS = 257;
+
+//! Field prime p = 2^256 - 2^32 - 977
+static const uint32_t FIELD_P[8] = {0xFFFFFC2F, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+//! p - 2, the exponent of a field inversion
+static const uint32_t FIELD_P_MINUS_2[8] = {0xFFFFFC2D, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+//! (p + 1) / 4, the exponent of a field square root
+static const uint32_t FIELD_SQRT_EXP[8] = {0xBFFFFF0C, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x3FFFFFFF};
+//! Group order n
+static const uint32_t ORDER_N[8] = {0xD0364141, 0xBFD25E8C, 0xAF48A03B, 0xBAAEDCE6, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+//! n - 2, the exponent of a scalar inversion
+static const uint32_t ORDER_N_MINUS_2[8] = {0xD036413F, 0xBFD25E8C, 0xAF48A03B, 0xBAAEDCE6, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+//! n / 2, rounded down
+static const uint32_t ORDER_HALF_N[8] = {0x681B20A0, 0xDFE92F46, 0x57A4501D, 0x5D576E73, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x7FFFFFFF};
+//! 2^256 - n, five limbs
+static const uint32_t ORDER_COMPLEMENT[5] = {0x2FC9BEBF, 0x402DA173, 0x50B75FC4, 0x45512319, 0x00000001};
+//! p - n; x coordinates below it have two candidate r values
+static const uint32_t FIELD_P_MINUS_N[8] = {0x2FC9BAEE, 0x402DA172, 0x50B75FC4, 0x45512319, 0x00000001, 0x00000000, 0x00000000, 0x00000000};
+
+//! Generator
+static const uint32_t GENERATOR_X[8] = {0x16F81798, 0x59F2815B, 0x2DCE28D9, 0x029BFCDB, 0xCE870B07, 0x55A06295, 0xF9DCBBAC, 0x79BE667E};
+static const uint32_t GENERATOR_Y[8] = {0xFB10D4B8, 0x9C47D08F, 0xA6855419, 0xFD17B448, 0x0E1108A8, 0x5DA4FBFC, 0x26A3C465, 0x483ADA77};
+
+/**
+ * The endomorphism (x, y) -> (beta*x, y) multiplies points by lambda. A
+ * scalar k splits into k1 + k2*lambda with k1 and k2 of about 128 bits, using
+ * the lattice basis constants below (as in libsecp256k1).
+ */
+static const uint32_t ENDO_BETA[8] = {0x719501EE, 0xC1396C28, 0x12F58995, 0x9CF04975, 0xAC3434E9, 0x6E64479E, 0x657C0710, 0x7AE96A2B};
+static const uint32_t ENDO_MINUS_LAMBDA[8] = {0xB51283CF, 0xE0CFC810, 0x8EC739C2, 0xA880B9FC, 0x77ED9BA4, 0x5AD9E3FD, 0x3FA3CF1F, 0xAC9C52B3};
+static const uint32_t ENDO_MINUS_B1[8] = {0x0ABFE4C3, 0x6F547FA9, 0x010E8828, 0xE4437ED6, 0x00000000, 0x00000000, 0x00000000, 0x00000000};
+static const uint32_t ENDO_MINUS_B2[8] = {0x3DB1562C, 0xD765CDA8, 0x0774346D, 0x8A280AC5, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+static const uint32_t ENDO_G1[8] = {0x45DBB031, 0xE893209A, 0x71E8CA7F, 0x3DAA8A14, 0x9284EB15, 0xE86C90E4, 0xA7D46BCD, 0x3086D221};
+static const uint32_t ENDO_G2[8] = {0x8AC47F71, 0x1571B4AE, 0x9DF506C6, 0x221208AC, 0x0ABFE4C4, 0x6F547FA9, 0x010E8828, 0xE4437ED6};
+
+// 256 bit numbers as 8 little endian 32 bit limbs
+
+int Cmp256(const uint32_t* a, const uint32_t* b)
+{
+    for (int i = 7; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+bool IsZero256(const uint32_t* a)
+{
+    uint32_t nOr = 0;
+    for (int i = 0; i < 8; i++)
+        nOr |= a[i];
+    return nOr == 0;
+}
+
+uint32_t Add256(uint32_t* r, const uint32_t* a, const uint32_t* b)
+{
+    uint64_t c = 0;
+    for (int i = 0; i < 8; i++) {
+        c += (uint64_t)a[i] + b[i];
+        r[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    return (uint32_t)c;
+}
+
+uint32_t Sub256(uint32_t* r, const uint32_t* a, const uint32_t* b)
+{
+    uint32_t nBorrow = 0;
+    for (int i = 0; i < 8; i++) {
+        uint64_t d = (uint64_t)a[i] - b[i] - nBorrow;
+        r[i] = (uint32_t)d;
+        nBorrow = (uint32_t)(d >> 63);
+    }
+    return nBorrow;
+}
+
+/** w = a * b, 16 limbs */
+void Mul256(uint32_t* w, const uint32_t* a, const uint32_t* b)
+{
+    memset(w, 0, 16 * sizeof(uint32_t));
+    for (int i = 0; i < 8; i++) {
+        uint64_t c = 0;
+        for (int j = 0; j < 8; j++) {
+            c += (uint64_t)a[i] * b[j] + w[i + j];
+            w[i + j] = (uint32_t)c;
+            c >>= 32;
+        }
+        w[i + 8] = (uint32_t)c;
+    }
+}
+
+void SetBytes256(uint32_t* r, const unsigned char* pch)
+{
+    for (int i = 0; i < 8; i++) {
+        const unsigned char* p = pch + 28 - 4 * i;
+        r[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+}
+
+void GetBytes256(unsigned char* pch, const uint32_t* a)
+{
+    for (int i = 0; i < 8; i++) {
+        unsigned char* p = pch + 28 - 4 * i;
+        p[0] = a[i] >> 24;
+        p[1] = a[i] >> 16;
+        p[2] = a[i] >> 8;
+        p[3] = a[i];
+    }
+}
+
+// Field elements modulo p, always fully reduced
+
+struct Fe
+{
+    uint32_t n[8];
+};
+
+void FeSetInt(Fe& r, uint32_t v)
+{
+    memset(r.n, 0, sizeof(r.n));
+    r.n[0] = v;
+}
+
+bool FeIsZero(const Fe& a) { return IsZero256(a.n); }
+bool FeEqual(const Fe& a, const Fe& b) { return Cmp256(a.n, b.n) == 0; }
+bool FeIsOdd(const Fe& a) { return a.n[0] & 1; }
+
+void FeAdd(Fe& r, const Fe& a, const Fe& b)
+{
+    if (Add256(r.n, a.n, b.n) || Cmp256(r.n, FIELD_P) >= 0)
+        Sub256(r.n, r.n, FIELD_P);
+}
+
+void FeSub(Fe& r, const Fe& a, const Fe& b)
+{
+    if (Sub256(r.n, a.n, b.n))
+        Add256(r.n, r.n, FIELD_P);
+}
+
+void FeNeg(Fe& r, const Fe& a)
+{
+    if (FeIsZero(a))
+        r = a;
+    else
+        Sub256(r.n, FIELD_P, a.n);
+}
+
+/** Reduce a 512 bit product: 2^256 = 2^32 + 977 (mod p) */
+void FeReduce(Fe& r, const uint32_t* w)
+{
+    // Fold the high half in: lo + hi*977 + hi*2^32
+    uint32_t t[10];
+    uint64_t c = 0;
+    for (int i = 0; i < 8; i++) {
+        c += (uint64_t)w[i] + (uint64_t)w[8 + i] * 977;
+        if (i > 0)
+            c += w[7 + i];
+        t[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    c += w[15];
+    t[8] = (uint32_t)c;
+    t[9] = (uint32_t)(c >> 32);
+
+    // Fold the at most 64 bits left above 2^256 the same way
+    uint64_t h0 = t[8], h1 = t[9];
+    c = (uint64_t)t[0] + h0 * 977;
+    r.n[0] = (uint32_t)c;
+    c >>= 32;
+    c += (uint64_t)t[1] + h1 * 977 + h0;
+    r.n[1] = (uint32_t)c;
+    c >>= 32;
+    c += (uint64_t)t[2] + h1;
+    r.n[2] = (uint32_t)c;
+    c >>= 32;
+    for (int i = 3; i < 8; i++) {
+        c += t[i];
+        r.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+
+    // A last carry leaves a small number, to which 2^32 + 977 is added without overflow
+    if (c) {
+        c = (uint64_t)r.n[0] + 977;
+        r.n[0] = (uint32_t)c;
+        c >>= 32;
+        c += (uint64_t)r.n[1] + 1;
+        r.n[1] = (uint32_t)c;
+        c >>= 32;
+        for (int i = 2; i < 8 && c; i++) {
+            c += r.n[i];
+            r.n[i] = (uint32_t)c;
+            c >>= 32;
+        }
+    }
+    if (Cmp256(r.n, FIELD_P) >= 0)
+        Sub256(r.n, r.n, FIELD_P);
+}
+
+void FeMul(Fe& r, const Fe& a, const Fe& b)
+{
+    uint32_t w[16];
+    Mul256(w, a.n, b.n);
+    FeReduce(r, w);
+}
+
+void FeSqr(Fe& r, const Fe& a)
+{
+    FeMul(r, a, a);
+}
+
+void FePow(Fe& r, const Fe& a, const uint32_t* e)
+{
+    Fe x;
+    FeSetInt(x, 1);
+    for (int i = 255; i >= 0; i--) {
+        FeSqr(x, x);
+        if ((e[i / 32] >> (i % 32)) & 1)
+            FeMul(x, x, a);
+    }
+    r = x;
+}
+
+void FeInv(Fe& r, const Fe& a)
+{
+    FePow(r, a, FIELD_P_MINUS_2);
+}
+
+/** Square root of a, if there is one */
+bool FeSqrt(Fe& r, const Fe& a)
+{
+    Fe s, s2;
+    FePow(s, a, FIELD_SQRT_EXP);
+    FeSqr(s2, s);
+    if (!FeEqual(s2, a))
+        return false;
+    r = s;
+    return true;
+}
+
+/** x^3 + 7 */
+void FeCurveRhs(Fe& r, const Fe& x)
+{
+    Fe x3, seven;
+    FeSqr(x3, x);
+    FeMul(x3, x3, x);
+    FeSetInt(seven, 7);
+    FeAdd(r, x3, seven);
+}
+
+// Scalars modulo n, always fully reduced
+
+struct Scalar
+{
+    uint32_t n[8];
+};
+
+bool ScIsZero(const Scalar& a) { return IsZero256(a.n); }
+bool ScIsHigh(const Scalar& a) { return Cmp256(a.n, ORDER_HALF_N) > 0; }
+
+/** Set from 32 big endian bytes reduced modulo n, returns whether the number was n or more */
+bool ScSetBytes(Scalar& r, const unsigned char* pch)
+{
+    SetBytes256(r.n, pch);
+    if (Cmp256(r.n, ORDER_N) < 0)
+        return false;
+    Sub256(r.n, r.n, ORDER_N);
+    return true;
+}
+
+void ScAdd(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    if (Add256(r.n, a.n, b.n) || Cmp256(r.n, ORDER_N) >= 0)
+        Sub256(r.n, r.n, ORDER_N);
+}
+
+void ScNeg(Scalar& r, const Scalar& a)
+{
+    if (ScIsZero(a))
+        r = a;
+    else
+        Sub256(r.n, ORDER_N, a.n);
+}
+
+/** Reduce a 512 bit product: 2^256 = 2^256 - n (mod n), folded until it fits */
+void ScReduce(Scalar& r, const uint32_t* w)
+{
+    uint32_t t[18];
+    memcpy(t, w, 16 * sizeof(uint32_t));
+    int nLen = 16;
+    while (nLen > 8) {
+        uint32_t u[18];
+        memset(u, 0, sizeof(u));
+        memcpy(u, t, 8 * sizeof(uint32_t));
+        for (int i = 0; i < nLen - 8; i++) {
+            uint64_t c = 0;
+            for (int j = 0; j < 5; j++) {
+                c += (uint64_t)t[8 + i] * ORDER_COMPLEMENT[j] + u[i + j];
+                u[i + j] = (uint32_t)c;
+                c >>= 32;
+            }
+            for (int k = i + 5; c; k++) {
+                c += u[k];
+                u[k] = (uint32_t)c;
+                c >>= 32;
+            }
+        }
+        nLen = 18;
+        while (nLen > 0 && u[nLen - 1] == 0)
+            nLen--;
+        memcpy(t, u, sizeof(u));
+    }
+    memcpy(r.n, t, 8 * sizeof(uint32_t));
+    while (Cmp256(r.n, ORDER_N) >= 0)
+        Sub256(r.n, r.n, ORDER_N);
+}
+
+void ScMul(Scalar& r, const Scalar& a, const Scalar& b)
+{
+    uint32_t w[16];
+    Mul256(w, a.n, b.n);
+    ScReduce(r, w);
+}
+
+void ScInv(Scalar& r, const Scalar& a)
+{
+    Scalar x;
+    memset(x.n, 0, sizeof(x.n));
+    x.n[0] = 1;
+    for (int i = 255; i >= 0; i--) {
+        ScMul(x, x, x);
+        if ((ORDER_N_MINUS_2[i / 32] >> (i % 32)) & 1)
+            ScMul(x, x, a);
+    }
+    r = x;
+}
+
+/** round(a * b / 2^384), for b < 2^256 */
+void ScMulShift384(Scalar& r, const Scalar& a, const uint32_t* b)
+{
+    uint32_t w[16];
+    Mul256(w, a.n, b);
+    memset(r.n, 0, sizeof(r.n));
+    uint64_t c = w[11] >> 31;
+    for (int i = 0; i < 4; i++) {
+        c += w[12 + i];
+        r.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    r.n[4] = (uint32_t)c;
+}
+
+/** Split k into k1 + k2*lambda, with k1 and k2 (or their negations) below 2^128 */
+void ScSplitLambda(Scalar& k1, Scalar& k2, const Scalar& k)
+{
+    Scalar c1, c2, b;
+    ScMulShift384(c1, k, ENDO_G1);
+    ScMulShift384(c2, k, ENDO_G2);
+    memcpy(b.n, ENDO_MINUS_B1, sizeof(b.n));
+    ScMul(c1, c1, b);
+    memcpy(b.n, ENDO_MINUS_B2, sizeof(b.n));
+    ScMul(c2, c2, b);
+    ScAdd(k2, c1, c2);
+    memcpy(b.n, ENDO_MINUS_LAMBDA, sizeof(b.n));
+    ScMul(k1, k2, b);
+    ScAdd(k1, k1, k);
+}
+
+// Points on y^2 = x^3 + 7
+
+struct Ge
+{
+    Fe x, y;
+    bool fInfinity;
+};
+
+/** Jacobian coordinates: (x / z^2, y / z^3) */
+struct Gej
+{
+    Fe x, y, z;
+    bool fInfinity;
+};
+
+void GejSetGe(Gej& r, const Ge& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = a.fInfinity;
+}
+
+void GeSetGej(Ge& r, const Gej& a)
+{
+    r.fInfinity = a.fInfinity;
+    if (a.fInfinity)
+        return;
+    Fe zi, zi2, zi3;
+    FeInv(zi, a.z);
+    FeSqr(zi2, zi);
+    FeMul(zi3, zi2, zi);
+    FeMul(r.x, a.x, zi2);
+    FeMul(r.y, a.y, zi3);
+}
+
+void GejDouble(Gej& r, const Gej& a)
+{
+    if (a.fInfinity || FeIsZero(a.y)) {
+        r.fInfinity = true;
+        return;
+    }
+    // dbl-2009-l
+    Fe A, B, C, D, E, F, t;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeAdd(D, t, t);
+    FeAdd(E, A, A);
+    FeAdd(E, E, A);
+    FeSqr(F, E);
+    Fe z3;
+    FeMul(z3, a.y, a.z);
+    FeAdd(r.z, z3, z3);
+    FeAdd(t, D, D);
+    FeSub(r.x, F, t);
+    FeSub(t, D, r.x);
+    FeMul(t, E, t);
+    Fe c8;
+    FeAdd(c8, C, C);
+    FeAdd(c8, c8, c8);
+    FeAdd(c8, c8, c8);
+    FeSub(r.y, t, c8);
+    r.fInfinity = false;
+}
+
+/** r = a + b with b in affine coordinates */
+void GejAddGe(Gej& r, const Gej& a, const Ge& b)
+{
+    if (b.fInfinity) {
+        r = a;
+        return;
+    }
+    if (a.fInfinity) {
+        GejSetGe(r, b);
+        return;
+    }
+    Fe z1z1, u2, s2, h, rr;
+    FeSqr(z1z1, a.z);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeSub(h, u2, a.x);
+    FeSub(rr, s2, a.y);
+    if (FeIsZero(h)) {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    Fe hh, hhh, v, t;
+    FeSqr(hh, h);
+    FeMul(hhh, hh, h);
+    FeMul(v, a.x, hh);
+    FeMul(r.z, a.z, h);
+    FeSqr(t, rr);
+    FeSub(t, t, hhh);
+    FeSub(t, t, v);
+    FeSub(t, t, v);
+    Fe y1hhh;
+    FeMul(y1hhh, a.y, hhh);
+    r.x = t;
+    FeSub(t, v, t);
+    FeMul(t, rr, t);
+    FeSub(r.y, t, y1hhh);
+    r.fInfinity = false;
+}
+
+/** r = a + b */
+void GejAdd(Gej& r, const Gej& a, const Gej& b)
+{
+    if (b.fInfinity) {
+        r = a;
+        return;
+    }
+    if (a.fInfinity) {
+        r = b;
+        return;
+    }
+    Fe z1z1, z2z2, u1, u2, s1, s2, h, rr;
+    FeSqr(z1z1, a.z);
+    FeSqr(z2z2, b.z);
+    FeMul(u1, a.x, z2z2);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s1, a.y, b.z);
+    FeMul(s1, s1, z2z2);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeSub(h, u2, u1);
+    FeSub(rr, s2, s1);
+    if (FeIsZero(h)) {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    Fe hh, hhh, v, t, z;
+    FeSqr(hh, h);
+    FeMul(hhh, hh, h);
+    FeMul(v, u1, hh);
+    FeMul(z, a.z, b.z);
+    FeMul(r.z, z, h);
+    FeSqr(t, rr);
+    FeSub(t, t, hhh);
+    FeSub(t, t, v);
+    FeSub(t, t, v);
+    Fe s1hhh;
+    FeMul(s1hhh, s1, hhh);
+    r.x = t;
+    FeSub(t, v, t);
+    FeMul(t, rr, t);
+    FeSub(r.y, t, s1hhh);
+    r.fInfinity = false;
+}
+
+void GeMulLambda(Ge& r, const Ge& a)
+{
+    Fe beta;
+    memcpy(beta.n, ENDO_BETA, sizeof(beta.n));
+    r = a;
+    FeMul(r.x, a.x, beta);
+}
+
+void GejMulLambda(Gej& r, const Gej& a)
+{
+    Fe beta;
+    memcpy(beta.n, ENDO_BETA, sizeof(beta.n));
+    r = a;
+    FeMul(r.x, a.x, beta);
+}
+
+/** Odd multiples a, 3a, 5a, ... of a in pre[0..n-1] */
+void GejOddMultiples(Gej* pre, int n, const Gej& a)
+{
+    Gej a2;
+    GejDouble(a2, a);
+    pre[0] = a;
+    for (int i = 1; i < n; i++)
+        GejAdd(pre[i], pre[i - 1], a2);
+}
+
+/**
+ * Width w non adjacent form of s: odd digits below 2^(w-1) in absolute value
+ * with at least w-1 zeros between them. Returns the number of digits used.
+ */
+int ScWnaf(int* wnaf, const Scalar& s, int w)
+{
+    memset(wnaf, 0, WNAF_BITS * sizeof(int));
+    int nLast = -1;
+    int nCarry = 0;
+    int nBit = 0;
+    while (nBit < 256) {
+        if ((int)((s.n[nBit / 32] >> (nBit % 32)) & 1) == nCarry) {
+            nBit++;
+            continue;
+        }
+        int nNow = w;
+        if (nNow > 256 - nBit)
+            nNow = 256 - nBit;
+        // Gather nNow bits from nBit onwards
+        uint64_t nBits = s.n[nBit / 32] >> (nBit % 32);
+        if (nBit / 32 + 1 < 8)
+            nBits |= (uint64_t)s.n[nBit / 32 + 1] << (32 - nBit % 32);
+        int nWord = (int)(nBits & ((1U << nNow) - 1)) + nCarry;
+        nCarry = (nWord >> (w - 1)) & 1;
+        nWord -= nCarry << w;
+        wnaf[nBit] = nWord;
+        nLast = nBit;
+        nBit += nNow;
+    }
+    if (nCarry) {
+        wnaf[256] = 1;
+        nLast = 256;
+    }
+    return nLast + 1;
+}
+
+/** Odd multiples of the generator and of lambda times the generator, affine */
+struct CGeneratorTables
+{
+    std::vector<Ge> vG;
+    std::vector<Ge> vGLambda;
+};
+
+static CGeneratorTables* pGeneratorTables = NULL;
+static boost::once_flag generatorTablesOnce = BOOST_ONCE_INIT;
+
+void BuildGeneratorTables()
+{
+    const int nTable = 1 << (WINDOW_G - 2);
+    Ge g;
+    memcpy(g.x.n, GENERATOR_X, sizeof(g.x.n));
+    memcpy(g.y.n, GENERATOR_Y, sizeof(g.y.n));
+    g.fInfinity = false;
+    Gej gj;
+    GejSetGe(gj, g);
+    std::vector<Gej> vPre(nTable);
+    GejOddMultiples(&vPre[0], nTable, gj);
+
+    // Convert all to affine with one inversion: invert the product of the z
+    // coordinates, then peel the inverses off one at a time
+    std::vector<Fe> vProd(nTable);
+    vProd[0] = vPre[0].z;
+    for (int i = 1; i < nTable; i++)
+        FeMul(vProd[i], vProd[i - 1], vPre[i].z);
+    Fe inv;
+    FeInv(inv, vProd[nTable - 1]);
+
+    CGeneratorTables* pTables = new CGeneratorTables();
+    pTables->vG.resize(nTable);
+    pTables->vGLambda.resize(nTable);
+    for (int i = nTable - 1; i >= 0; i--) {
+        Fe zi, zi2, zi3;
+        if (i > 0) {
+            FeMul(zi, inv, vProd[i - 1]);
+            FeMul(inv, inv, vPre[i].z);
+        } else {
+            zi = inv;
+        }
+        FeSqr(zi2, zi);
+        FeMul(zi3, zi2, zi);
+        Ge& ge = pTables->vG[i];
+        FeMul(ge.x, vPre[i].x, zi2);
+        FeMul(ge.y, vPre[i].y, zi3);
+        ge.fInfinity = false;
+        GeMulLambda(pTables->vGLambda[i], ge);
+    }
+    pGeneratorTables = pTables;
+}
+
+const CGeneratorTables& GetGeneratorTables()
+{
+    boost::call_once(BuildGeneratorTables, generatorTablesOnce);
+    return *pGeneratorTables;
+}
+
+/** Add digit d of a wNAF over the odd multiples in pre, negated if fNeg */
+template<typename T>
+void AddWnafDigit(Gej& r, int d, const T* pre, bool fNeg);
+
+template<>
+void AddWnafDigit<Gej>(Gej& r, int d, const Gej* pre, bool fNeg)
+{
+    Gej p = pre[(d < 0 ? -d : d) / 2];
+    if ((d < 0) != fNeg)
+        FeNeg(p.y, p.y);
+    GejAdd(r, r, p);
+}
+
+template<>
+void AddWnafDigit<Ge>(Gej& r, int d, const Ge* pre, bool fNeg)
+{
+    Ge p = pre[(d < 0 ? -d : d) / 2];
+    if ((d < 0) != fNeg)
+        FeNeg(p.y, p.y);
+    GejAddGe(r, r, p);
+}
+
+/** r = na*a + ng*G */
+void ECMult(Gej& r, const Gej& a, const Scalar& na, const Scalar& ng)
+{
+    const CGeneratorTables& tables = GetGeneratorTables();
+
+    // Split both scalars, keeping each half short by negating it if needed
+    Scalar vScalars[4];
+    bool vfNeg[4];
+    ScSplitLambda(vScalars[0], vScalars[1], na);
+    ScSplitLambda(vScalars[2], vScalars[3], ng);
+    int vWnaf[4][WNAF_BITS];
+    int nBits = 0;
+    for (int i = 0; i < 4; i++) {
+        vfNeg[i] = ScIsHigh(vScalars[i]);
+        if (vfNeg[i])
+            ScNeg(vScalars[i], vScalars[i]);
+        int nLen = ScWnaf(vWnaf[i], vScalars[i], i < 2 ? WINDOW_A : WINDOW_G);
+        if (nLen > nBits)
+            nBits = nLen;
+    }
+
+    Gej vPreA[1 << (WINDOW_A - 2)], vPreALambda[1 << (WINDOW_A - 2)];
+    if (!a.fInfinity) {
+        GejOddMultiples(vPreA, 1 << (WINDOW_A - 2), a);
+        for (int i = 0; i < (1 << (WINDOW_A - 2)); i++)
+            GejMulLambda(vPreALambda[i], vPreA[i]);
+    }
+
+    r.fInfinity = true;
+    for (int i = nBits - 1; i >= 0; i--) {
+        GejDouble(r, r);
+        if (!a.fInfinity) {
+            if (vWnaf[0][i])
+                AddWnafDigit(r, vWnaf[0][i], vPreA, vfNeg[0]);
+            if (vWnaf[1][i])
+                AddWnafDigit(r, vWnaf[1][i], vPreALambda, vfNeg[1]);
+        }
+        if (vWnaf[2][i])
+            AddWnafDigit(r, vWnaf[2][i], &tables.vG[0], vfNeg[2]);
+        if (vWnaf[3][i])
+            AddWnafDigit(r, vWnaf[3][i], &tables.vGLambda[0], vfNeg[3]);
+    }
+}
+
+/** The point with x coordinate x and the given y parity, if there is one */
+bool GeSetXO(Ge& r, const Fe& x, bool fOdd)
+{
+    Fe rhs;
+    FeCurveRhs(rhs, x);
+    if (!FeSqrt(r.y, rhs))
+        return false;
+    if (FeIsOdd(r.y) != fOdd)
+        FeNeg(r.y, r.y);
+    r.x = x;
+    r.fInfinity = false;
+    return true;
+}
+
+/**
+ * Read a BER length at pch[nPos], in short or long form, as a value that
+ * fits the remaining input. Leading zero bytes of a long form are skipped.
+ */
+bool ParseBERLength(const unsigned char* pch, size_t nSize, size_t& nPos, size_t& nLen)
+{
+    if (nPos == nSize)
+        return false;
+    size_t nLenBytes = pch[nPos++];
+    if (!(nLenBytes & 0x80)) {
+        nLen = nLenBytes;
+        return true;
+    }
+    nLenBytes -= 0x80;
+    if (nLenBytes > nSize - nPos)
+        return false;
+    while (nLenBytes > 0 && pch[nPos] == 0) {
+        nPos++;
+        nLenBytes--;
+    }
+    if (nLenBytes >= sizeof(size_t))
+        return false;
+    nLen = 0;
+    while (nLenBytes > 0) {
+        nLen = (nLen << 8) + pch[nPos++];
+        nLenBytes--;
+    }
+    return true;
+}
+
+/**
+ * Parse an integer at pch[nPos] into 32 big endian bytes. Its bytes are read
+ * as an unsigned number with any leading zeros dropped, whatever the sign bit
+ * says. fOverflow is set if it does not fit in 32 bytes.
+ */
+bool ParseLaxInteger(const unsigned char* pch, size_t nSize, size_t& nPos, unsigned char* pchOut, bool& fOverflow)
+{
+    if (nPos == nSize || pch[nPos] != 0x02)
+        return false;
+    nPos++;
+    size_t nLen;
+    if (!ParseBERLength(pch, nSize, nPos, nLen) || nLen > nSize - nPos)
+        return false;
+    const unsigned char* p = pch + nPos;
+    nPos += nLen;
+    while (nLen > 0 && p[0] == 0) {
+        p++;
+        nLen--;
+    }
+    memset(pchOut, 0, 32);
+    if (nLen > 32)
+        fOverflow = true;
+    else
+        memcpy(pchOut + 32 - nLen, p, nLen);
+    return true;
+}
+
+/**
+ * Parse a signature as leniently as the OpenSSL versions this chain was
+ * validated with, following libsecp256k1's ecdsa_signature_parse_der_lax:
+ * BER lengths, padded or negative integers and trailing bytes after the
+ * sequence are all let through. Strict encoding is a script rule, enforced by
+ * IsValidSignatureEncoding under SCRIPT_VERIFY_DERSIG and STRICTENC, not here.
+ * Values that do not fit 32 bytes give r = s = 0, which never verifies.
+ */
+bool ParseLaxDERSignature(const unsigned char* pch, size_t nSize, unsigned char* pchR, unsigned char* pchS)
+{
+    size_t nPos = 0;
+    if (nPos == nSize || pch[nPos] != 0x30)
+        return false;
+    nPos++;
+    // The sequence length is skipped, not checked
+    if (nPos == nSize)
+        return false;
+    size_t nLenBytes = pch[nPos++];
+    if (nLenBytes & 0x80) {
+        nLenBytes -= 0x80;
+        if (nLenBytes > nSize - nPos)
+            return false;
+        nPos += nLenBytes;
+    }
+    bool fOverflow = false;
+    if (!ParseLaxInteger(pch, nSize, nPos, pchR, fOverflow))
+        return false;
+    if (!ParseLaxInteger(pch, nSize, nPos, pchS, fOverflow))
+        return false;
+    if (fOverflow) {
+        memset(pchR, 0, 32);
+        memset(pchS, 0, 32);
+    }
+    return true;
+}
+
+void GeToPoint(CECPoint& point, const Ge& ge)
+{
+    memcpy(point.x, ge.x.n, sizeof(point.x));
+    memcpy(point.y, ge.y.n, sizeof(point.y));
+}
+
+void PointToGe(Ge& ge, const CECPoint& point)
+{
+    memcpy(ge.x.n, point.x, sizeof(point.x));
+    memcpy(ge.y.n, point.y, sizeof(point.y));
+    ge.fInfinity = false;
+}
+
+} // anon namespace
+
+void ECVerifyStart()
+{
+    GetGeneratorTables();
+}
+
+bool ECParsePubKey(const unsigned char* pch, size_t nSize, CECPoint& point)
+{
+    Ge ge;
+    if (nSize == 33 && (pch[0] == 0x02 || pch[0] == 0x03)) {
+        SetBytes256(ge.x.n, pch + 1);
+        if (Cmp256(ge.x.n, FIELD_P) >= 0)
+            return false;
+        if (!GeSetXO(ge, ge.x, pch[0] == 0x03))
+            return false;
+    } else if (nSize == 65 && (pch[0] == 0x04 || pch[0] == 0x06 || pch[0] == 0x07)) {
+        SetBytes256(ge.x.n, pch + 1);
+        SetBytes256(ge.y.n, pch + 33);
+        if (Cmp256(ge.x.n, FIELD_P) >= 0 || Cmp256(ge.y.n, FIELD_P) >= 0)
+            return false;
+        // Hybrid keys repeat the parity of y in their header
+        if (pch[0] != 0x04 && FeIsOdd(ge.y) != (pch[0] == 0x07))
+            return false;
+        Fe y2, rhs;
+        FeSqr(y2, ge.y);
+        FeCurveRhs(rhs, ge.x);
+        if (!FeEqual(y2, rhs))
+            return false;
+    } else {
+        return false;
+    }
+    GeToPoint(point, ge);
+    return true;
+}
+
+size_t ECSerializePubKey(const CECPoint& point, bool fCompressed, unsigned char* pchOut)
+{
+    GetBytes256(pchOut + 1, point.x);
+    if (fCompressed) {
+        pchOut[0] = (point.y[0] & 1) ? 0x03 : 0x02;
+        return 33;
+    }
+    pchOut[0] = 0x04;
+    GetBytes256(pchOut + 33, point.y);
+    return 65;
+}
+
+bool ECVerify(const CECPoint& pubkey, const unsigned char* hash, const unsigned char* pchSig, size_t nSigLen)
+{
+    unsigned char vchR[32], vchS[32];
+    if (pchSig == NULL || !ParseLaxDERSignature(pchSig, nSigLen, vchR, vchS))
+        return false;
+    Scalar r, s, e;
+    if (ScSetBytes(r, vchR) || ScIsZero(r) || ScSetBytes(s, vchS) || ScIsZero(s))
+        return false;
+    ScSetBytes(e, hash);
+
+    // R = (e/s)*G + (r/s)*Q
+    Scalar sinv, u1, u2;
+    ScInv(sinv, s);
+    ScMul(u1, e, sinv);
+    ScMul(u2, r, sinv);
+    Ge q;
+    PointToGe(q, pubkey);
+    Gej qj, rj;
+    GejSetGe(qj, q);
+    ECMult(rj, qj, u2, u1);
+    if (rj.fInfinity)
+        return false;
+
+    // Compare x(R) mod n with r without leaving Jacobian coordinates: x(R) is
+    // r or, if that is still below p, r + n
+    Fe fr, zz, xr;
+    memcpy(fr.n, r.n, sizeof(fr.n));
+    FeSqr(zz, rj.z);
+    FeMul(xr, fr, zz);
+    if (FeEqual(xr, rj.x))
+        return true;
+    if (Cmp256(r.n, FIELD_P_MINUS_N) >= 0)
+        return false;
+    Add256(fr.n, fr.n, ORDER_N);
+    FeMul(xr, fr, zz);
+    return FeEqual(xr, rj.x);
+}
+
+bool ECRecover(const unsigned char* hash, const unsigned char* p64, int recid, CECPoint& pubkey)
+{
+    if (recid < 0 || recid > 3)
+        return false;
+
+    // The x coordinate of R is r, or r + n for recid 2 and 3
+    Fe x;
+    SetBytes256(x.n, p64);
+    if (recid / 2 && Add256(x.n, x.n, ORDER_N))
+        return false;
+    if (Cmp256(x.n, FIELD_P) >= 0)
+        return false;
+    Ge rp;
+    if (!GeSetXO(rp, x, recid % 2))
+        return false;
+
+    Scalar r, s, e;
+    ScSetBytes(r, p64);
+    ScSetBytes(s, p64 + 32);
+    ScSetBytes(e, hash);
+    if (ScIsZero(r))
+        return false;
+
+    // Q = (s/r)*R - (e/r)*G
+    Scalar rinv, u1, u2;
+    ScInv(rinv, r);
+    ScMul(u1, s, rinv);
+    ScMul(u2, e, rinv);
+    ScNeg(u2, u2);
+    Gej rj, qj;
+    GejSetGe(rj, rp);
+    ECMult(qj, rj, u1, u2);
+    if (qj.fInfinity)
+        return false;
+    Ge q;
+    GeSetGej(q, qj);
+    GeToPoint(pubkey, q);
+    return true;
+}
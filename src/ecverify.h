@@ -0,0 +1,54 @@
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ANONCOIN_ECVERIFY_H
+#define ANONCOIN_ECVERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Signature verification and public key recovery on secp256k1, without
+ * OpenSSL. Only public data goes through these functions, so they are not
+ * constant time; signing stays with OpenSSL in key.cpp.
+ *
+ * Verification computes u1*G + u2*Q with the GLV endomorphism splitting both
+ * scalars in halves, and Strauss' method over their wNAF forms, using a table
+ * of generator multiples built once.
+ */
+
+/** A point on secp256k1 in affine coordinates, each as 8 little endian 32 bit limbs, fully reduced */
+struct CECPoint
+{
+    uint32_t x[8];
+    uint32_t y[8];
+};
+
+/** Build the generator tables. Done on first use otherwise; calling it at startup keeps that out of the first verification. */
+void ECVerifyStart();
+
+/**
+ * Parse a serialized public key: compressed (33 bytes), uncompressed or
+ * hybrid (65 bytes). Fails if it is not a point on the curve.
+ */
+bool ECParsePubKey(const unsigned char* pch, size_t nSize, CECPoint& point);
+
+/** Serialize point into pchOut (room for 65 bytes), returns the size written (33 or 65) */
+size_t ECSerializePubKey(const CECPoint& point, bool fCompressed, unsigned char* pchOut);
+
+/**
+ * Verify a DER encoded signature (without hash type) of the 32 byte big
+ * endian number hash by pubkey. The encoding is parsed as laxly as OpenSSL
+ * did before 1.0.1k, so that every signature in the chain still verifies;
+ * r and s must be in [1, n-1].
+ */
+bool ECVerify(const CECPoint& pubkey, const unsigned char* hash, const unsigned char* pchSig, size_t nSigLen);
+
+/**
+ * Recover the public key that made the 64 byte compact signature (r, s) of
+ * hash, with recid (0..3) selecting among the candidates.
+ */
+bool ECRecover(const unsigned char* hash, const unsigned char* p64, int recid, CECPoint& pubkey);
+
+#endif // ANONCOIN_ECVERIFY_H
@@ -15,7 +15,9 @@
 #include "amount.h"
 #include "consensus.h"
 #include "checkpoints.h"
+#include "coinstats.h"
 #include "compat/sanity.h"
+#include "ecverify.h"
 //#include "coins.h"
 #include "key.h"
 #include "main.h"
@@ -25,6 +27,7 @@
 //#include "random.h"
 #include "rpcserver.h"
 #include "scrypt.h"
+#include "sigcache.h"
 #include "txdb.h"
 #include "ui_interface.h"                                   // Include this if you want language translation capability in your source files
 #include "util.h"
@@ -60,6 +63,8 @@ using namespace std;
 CWallet* pwalletMain = NULL;
 #endif
 bool fFeeEstimatesInitialized = false;
+//! Set once the saved memory pool has been loaded, so a partial pool never overwrites it
+static bool fDumpMempoolLater = false;
 
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
@@ -145,7 +150,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 
 void Shutdown()
@@ -171,6 +175,9 @@ void Shutdown()
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (fDumpMempoolLater)
+        DumpMempool();
+
     if (fFeeEstimatesInitialized)
     {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
@@ -195,6 +202,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        coinsStatsEngine.SetBackend(NULL);
+        ResetChainStateSnapshot();
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -273,6 +282,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
+    strUsage += "  -assumevalid=<hex>     " + _("If this block is in the chain assume that it and its ancestors are valid and skip their script verification (0 to verify all, default: 0)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by the real block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 980) + "\n";
     strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3) + "\n";
@@ -287,6 +297,11 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxorphansize=<n>     " + strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_SIZE) + "\n";
+    strUsage += "  -maxorphanpeersize=<n> " + strprintf(_("Keep at most <n> kilobytes of unconnectable transactions from one peer (default: %u)"), DEFAULT_MAX_ORPHAN_PEER_SIZE) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "anoncoind.pid") + "\n";
@@ -330,6 +345,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "\n" + _("Wallet options:") + "\n";
     strUsage += "  -disablewallet         " + _("Do not load the wallet and disable wallet RPC calls") + "\n";
     strUsage += "  -keypool=<n>           " + strprintf(_("Set key pool size to <n> (default: %u)"), 100) + "\n";
+    strUsage += "  -keypoolthread         " + strprintf(_("Keep the key pool topped up from a background thread (default: %u)"), 1) + "\n";
     if (GetBoolArg("-help-debug", false))
         strUsage += "  -mintxfee=<amt>        " + strprintf(_("Fees (in ANC/Kb) smaller than this are considered zero fee for transaction creation (default: %s)"), FormatMoney(w_minTxFeeRate.GetFeePerK())) + "\n";    strUsage += "  -paytxfee=<amt>        " + _("Fee per kB to add to transactions you send") + "\n";
     strUsage += "  -paytxfee=<amt>        " + strprintf(_("Fee (in ANC/kB) to add to transactions you send (default: %s)"), FormatMoney(payTxFee.GetFeePerK())) + "\n";
@@ -349,6 +365,10 @@ std::string HelpMessage(HelpMessageMode hmm)
     if (GetBoolArg("-help-debug", false))
     {
         strUsage += "  -checkpoints           " + strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1) + "\n";
+        strUsage += "  -<db>blockcache=<n>    " + _("Override the LevelDB block cache size of <db> in megabytes, <db> is coindb or blockdb (default: half of its -dbcache share)") + "\n";
+        strUsage += "  -<db>writebuffer=<n>   " + _("Override the LevelDB write buffer size of <db> in megabytes (default: a quarter of its -dbcache share)") + "\n";
+        strUsage += "  -<db>bloombits=<n>     " + strprintf(_("Bits per key of the LevelDB bloom filter of <db>, 0 disables it (0 to 64, default: %u)"), 10) + "\n";
+        strUsage += "  -<db>maxopenfiles=<n>  " + strprintf(_("Maximum number of table files LevelDB keeps open for <db> (default: %u)"), 64) + "\n";
         strUsage += "  -dblogsize=<n>         " + strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100) + "\n";
         strUsage += "  -disablesafemode       " + strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0) + "\n";
         strUsage += "  -testsafemode          " + strprintf(_("Force safe mode (default: %u)"), 0) + "\n";
@@ -373,9 +393,13 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -logtimestamps         " + strprintf(_("Prepend debug output with timestamp (default: %u)"), 1) + "\n";
     if (GetBoolArg("-help-debug", false))
     {
+        strUsage += "  -limitancestorcount=<n>  " + strprintf(_("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+        strUsage += "  -limitancestorsize=<n>   " + strprintf(_("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+        strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+        strUsage += "  -limitdescendantsize=<n>  " + strprintf(_("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
         strUsage += "  -limitfreerelay=<n>    " + strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15) + "\n";
         strUsage += "  -relaypriority         " + strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1) + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000) + "\n";
+        strUsage += "  -sigcachemb=<n>        " + strprintf(_("Limit size of signature cache to <n> megabytes (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     }
     strUsage += "  -minrelaytxfee=<amt>   " + strprintf(_("Fees (in ANC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())) + "\n";
     strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
@@ -518,6 +542,11 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         }
     }
 
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        fDumpMempoolLater = !ShutdownRequested();
+    }
+
     if (GetBoolArg("-stopafterblockimport", false)) {
         LogPrintf("Stopping after block import\n");
         StartShutdown();
@@ -712,6 +741,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", RegTest());
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
+    hashAssumeValid = uint256(GetArg("-assumevalid", "0"));
+    if (hashAssumeValid != 0)
+        LogPrintf("Assuming ancestors of block %s have valid signatures.\n", hashAssumeValid.GetHex());
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
@@ -754,6 +786,10 @@ bool AppInit2(boost::thread_group& threadGroup)
         tx_nMinRelayTxFee = n;       // Critical global value, allows many v9 routines to run properly until v10 upgrade is done (esp QT)
     }
 
+    orphanpool.SetLimits(std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS)),
+                         std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_SIZE)) * 1000,
+                         std::max((int64_t)0, GetArg("-maxorphanpeersize", DEFAULT_MAX_ORPHAN_PEER_SIZE)) * 1000);
+
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-mintxfee"))
     {
@@ -849,10 +885,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     scrypt_detect_sse2();
 #endif
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    InitSignatureCache();
+    ECVerifyStart();
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadTxScriptCheck);
+        }
     }
+    threadGroup.create_thread(&ThreadUndoWriter);
 
     /**
      * Start the RPC server already.  It will be started in "warmup" mode
@@ -1396,6 +1437,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         do {
             try {
                 UnloadBlockIndex();
+                coinsStatsEngine.SetBackend(NULL);
+                ResetChainStateSnapshot();
                 delete pcoinsTip;
                 delete pcoinsdbview;
                 delete pcoinscatcher;
@@ -1405,6 +1448,7 @@ bool AppInit2(boost::thread_group& threadGroup)
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                coinsStatsEngine.SetBackend(pcoinsdbview);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -1615,10 +1659,13 @@ bool AppInit2(boost::thread_group& threadGroup)
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            bool fRescanComplete = pwalletMain->ScanForWalletTransactions(pindexRescan, true) >= 0;
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
-            pwalletMain->SetBestChain(chainActive.GetLocator());
-            nWalletDBUpdated++;
+            // An interrupted rescan leaves the old best block, so the next start scans the rest
+            if (fRescanComplete) {
+                pwalletMain->SetBestChain(chainActive.GetLocator());
+                nWalletDBUpdated++;
+            }
 
             // Restore wallet transaction metadata after -zapwallettxes=1
             if (GetBoolArg("-zapwallettxes", false) && GetArg("-zapwallettxes", "1") != "2")
@@ -1691,6 +1738,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    // Keep the block template up to date with the memory pool
+    RegisterValidationInterface(&blockTemplateCache);
+
     StartNode(threadGroup);
 
 #ifdef ENABLE_WALLET
@@ -1713,6 +1763,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Run a thread to keep the keypool topped up, so that new addresses do not wait for key generation
+        if (GetBoolArg("-keypoolthread", true))
+            threadGroup.create_thread(boost::bind(&CWallet::ThreadTopUpKeyPool, pwalletMain));
     }
 #endif
 
@@ -6,6 +6,9 @@
 #include "key.h"
 
 #include "crypto/hmac_sha512.h"
+#include "crypto/sha256.h"
+#include "ecverify.h"
+#include "random.h"
 // #include "crypto/rfc6979_hmac_sha256.h"
 
 #include <openssl/bn.h>
@@ -13,6 +16,10 @@
 #include <openssl/obj_mac.h>
 #include <openssl/rand.h>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
 // anonymous namespace with local implementation code (OpenSSL interaction)
 namespace {
 
@@ -230,13 +237,6 @@ public:
         return true;
     }
 
-    bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
-        // -1 = error, 0 = bad sig, 1 = good
-        if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
-            return false;
-        return true;
-    }
-
     bool SignCompact(const uint256 &hash, unsigned char *p64, int &rec) {
         bool fOk = false;
         ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
@@ -268,22 +268,6 @@ public:
         return fOk;
     }
 
-    // reconstruct public key from a compact signature
-    // This is only slightly more CPU intensive than just verifying it.
-    // If this function succeeds, the recovered public key is guaranteed to be valid
-    // (the signature is a valid signature of the given data for that key)
-    bool Recover(const uint256 &hash, const unsigned char *p64, int rec)
-    {
-        if (rec<0 || rec>=3)
-            return false;
-        ECDSA_SIG *sig = ECDSA_SIG_new();
-        BN_bin2bn(&p64[0],  32, sig->r);
-        BN_bin2bn(&p64[32], 32, sig->s);
-        bool ret = ECDSA_SIG_recover_key_GFp(pkey, sig, (unsigned char*)&hash, sizeof(hash), rec, 0) == 1;
-        ECDSA_SIG_free(sig);
-        return ret;
-    }
-
     static bool TweakSecret(unsigned char vchSecretOut[32], const unsigned char vchSecretIn[32], const unsigned char vchTweak[32])
     {
         bool ret = true;
@@ -337,6 +321,91 @@ public:
     }
 };
 
+/** Number of separately locked shards of the public key cache */
+static const unsigned int PUBKEY_CACHE_SHARDS = 16;
+/** Entries in each shard of the public key cache */
+static const unsigned int PUBKEY_CACHE_SHARD_SIZE = 1024;
+
+/**
+ * Decompressed points of recently verified compressed public keys, as the
+ * same keys (pool payouts, busy wallets) sign input after input, and
+ * decompressing one costs a field square root. Uncompressed keys only need
+ * the curve equation checked, which is cheaper than a lookup, so they are
+ * not cached.
+ *
+ * Entries are found by a salted digest of the serialized key, direct mapped
+ * into shards with a lock of their own for the script check threads.
+ */
+class CPubKeyCache
+{
+private:
+    struct CEntry
+    {
+        uint256 digest;
+        CECPoint point;
+    };
+
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<CEntry> vEntries;
+    };
+
+    uint256 nonce;
+    CShard shards[PUBKEY_CACHE_SHARDS];
+
+public:
+    CPubKeyCache()
+    {
+        GetRandBytes(nonce.begin(), nonce.size());
+        for (unsigned int i = 0; i < PUBKEY_CACHE_SHARDS; i++)
+            shards[i].vEntries.resize(PUBKEY_CACHE_SHARD_SIZE);
+    }
+
+    bool Parse(const CPubKey& pubkey, CECPoint& point)
+    {
+        if (!pubkey.IsCompressed())
+            return ECParsePubKey(pubkey.begin(), pubkey.size(), point);
+
+        uint256 digest;
+        CSHA256().Write(nonce.begin(), nonce.size()).Write(pubkey.begin(), pubkey.size()).Finalize(digest.begin());
+        uint64_t nWord;
+        memcpy(&nWord, digest.begin(), sizeof(nWord));
+        CShard& shard = shards[nWord % PUBKEY_CACHE_SHARDS];
+        CEntry& entry = shard.vEntries[(nWord / PUBKEY_CACHE_SHARDS) % PUBKEY_CACHE_SHARD_SIZE];
+        {
+            boost::lock_guard<boost::mutex> lock(shard.cs);
+            if (entry.digest == digest) {
+                point = entry.point;
+                return true;
+            }
+        }
+
+        if (!ECParsePubKey(pubkey.begin(), pubkey.size(), point))
+            return false;
+
+        boost::lock_guard<boost::mutex> lock(shard.cs);
+        entry.digest = digest;
+        entry.point = point;
+        return true;
+    }
+};
+
+static CPubKeyCache* pPubKeyCache = NULL;
+static boost::once_flag pubKeyCacheOnce = BOOST_ONCE_INIT;
+
+void CreatePubKeyCache()
+{
+    pPubKeyCache = new CPubKeyCache();
+}
+
+/** Parse pubkey into point through the cache shared by all verifying threads */
+bool ParsePubKeyCached(const CPubKey& pubkey, CECPoint& point)
+{
+    boost::call_once(CreatePubKeyCache, pubKeyCacheOnce);
+    return pPubKeyCache->Parse(pubkey, point);
+}
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -448,23 +517,31 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
-    if (!IsValid())
-        return false;
-    CECKey key;
-    if (!key.SetPubKey(*this))
+    if (!IsValid() || vchSig.empty())
         return false;
-    if (!key.Verify(hash, vchSig))
+    CECPoint point;
+    if (!ParsePubKeyCached(*this, point))
         return false;
-    return true;
+    // The hash is taken as a big endian number from its bytes, as OpenSSL did
+    return ECVerify(point, hash.begin(), &vchSig[0], vchSig.size());
 }
 
+// reconstruct public key from a compact signature
+// This is only slightly more CPU intensive than just verifying it.
+// If this function succeeds, the recovered public key is guaranteed to be valid
+// (the signature is a valid signature of the given data for that key)
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
-    CECKey key;
-    if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
+    int rec = (vchSig[0] - 27) & ~4;
+    if (rec < 0 || rec >= 3)
+        return false;
+    CECPoint point;
+    if (!ECRecover(hash.begin(), &vchSig[1], rec, point))
         return false;
-    key.GetPubKey(*this, (vchSig[0] - 27) & 4);
+    unsigned char pub[65];
+    size_t nSize = ECSerializePubKey(point, (vchSig[0] - 27) & 4, pub);
+    Set(pub, pub + nSize);
     return true;
 }
 
@@ -473,12 +550,15 @@ bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char
         return false;
     if (vchSig.size() != 65)
         return false;
-    CECKey key;
-    if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
+    int rec = (vchSig[0] - 27) & ~4;
+    if (rec < 0 || rec >= 3)
+        return false;
+    CECPoint point;
+    if (!ECRecover(hash.begin(), &vchSig[1], rec, point))
         return false;
-    CPubKey pubkeyRec;
-    key.GetPubKey(pubkeyRec, IsCompressed());
-    if (*this != pubkeyRec)
+    unsigned char pub[65];
+    size_t nSize = ECSerializePubKey(point, IsCompressed(), pub);
+    if (nSize != size() || memcmp(pub, begin(), nSize) != 0)
         return false;
     return true;
 }
@@ -486,19 +566,19 @@ bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char
 bool CPubKey::IsFullyValid() const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(*this))
-        return false;
-    return true;
+    CECPoint point;
+    return ECParsePubKey(begin(), size(), point);
 }
 
 bool CPubKey::Decompress() {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(*this))
+    CECPoint point;
+    if (!ECParsePubKey(begin(), size(), point))
         return false;
-    key.GetPubKey(*this, false);
+    unsigned char pub[65];
+    size_t nSize = ECSerializePubKey(point, false, pub);
+    Set(pub, pub + nSize);
     return true;
 }
 
@@ -28,14 +28,15 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static leveldb::Options GetOptions(const CLevelDBOptions& dbOptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.block_cache = leveldb::NewLRUCache(dbOptions.nBlockCacheSize);
+    options.write_buffer_size = dbOptions.nWriteBufferSize; // up to two write buffers may be held in memory simultaneously
+    if (dbOptions.nBloomBits > 0)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(dbOptions.nBloomBits);
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -45,13 +46,24 @@ static leveldb::Options GetOptions(size_t nCacheSize)
 }
 
 CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+{
+    Open(path, CLevelDBOptions(nCacheSize), fMemory, fWipe);
+}
+
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, const CLevelDBOptions& dbOptionsIn, bool fMemory, bool fWipe)
+{
+    Open(path, dbOptionsIn, fMemory, fWipe);
+}
+
+void CLevelDBWrapper::Open(const boost::filesystem::path& path, const CLevelDBOptions& dbOptionsIn, bool fMemory, bool fWipe)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    dbOptions = dbOptionsIn;
+    options = GetOptions(dbOptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -64,6 +76,8 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
         TryCreateDirectory(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
     }
+    LogPrint("coindb", "LevelDB options: block cache %u, write buffer %u, bloom bits %d, max open files %d\n",
+        dbOptions.nBlockCacheSize, dbOptions.nWriteBufferSize, dbOptions.nBloomBits, dbOptions.nMaxOpenFiles);
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
@@ -81,9 +95,47 @@ CLevelDBWrapper::~CLevelDBWrapper()
     options.env = NULL;
 }
 
+std::string CLevelDBWrapper::GetProperty(const std::string& strName) const
+{
+    std::string strValue;
+    if (!pdb->GetProperty(strName, &strValue))
+        return std::string();
+    return strValue;
+}
+
+void CLevelDBWrapper::GetApproximateSizes(std::vector<uint64_t>& vSizes) const
+{
+    // Range i covers the keys from byte i up to, but not including, byte i+1
+    std::vector<std::string> vKeys(257);
+    for (unsigned int i = 0; i < 256; i++)
+        vKeys[i] = std::string(1, (char)i);
+    vKeys[256] = std::string(64, (char)0xff);
+    std::vector<leveldb::Range> vRanges(256);
+    for (unsigned int i = 0; i < 256; i++)
+        vRanges[i] = leveldb::Range(vKeys[i], vKeys[i + 1]);
+    vSizes.resize(256);
+    pdb->GetApproximateSizes(&vRanges[0], vRanges.size(), &vSizes[0]);
+}
+
 bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb_error)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     HandleError(status);
     return true;
 }
+
+CLevelDBSnapshot::CLevelDBSnapshot(leveldb::DB* pdbIn) : pdb(pdbIn)
+{
+    psnapshot = pdb->GetSnapshot();
+    readoptions.verify_checksums = true;
+    readoptions.snapshot = psnapshot;
+    iteroptions.verify_checksums = true;
+    iteroptions.fill_cache = false;
+    iteroptions.snapshot = psnapshot;
+}
+
+CLevelDBSnapshot::~CLevelDBSnapshot()
+{
+    pdb->ReleaseSnapshot(psnapshot);
+    psnapshot = NULL;
+}
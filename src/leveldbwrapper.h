@@ -25,6 +25,22 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/**
+ * Tunables of one LevelDB database. The defaults split the cache size handed
+ * to the database between the block cache and the write buffers.
+ */
+struct CLevelDBOptions
+{
+    size_t nBlockCacheSize;     //! bytes of uncompressed blocks kept in the LRU cache
+    size_t nWriteBufferSize;    //! bytes buffered before a memtable is written, up to two may be held
+    int nBloomBits;             //! bits per key of the bloom filter, 0 disables it
+    int nMaxOpenFiles;
+
+    explicit CLevelDBOptions(size_t nCacheSize = 0) :
+        nBlockCacheSize(nCacheSize / 2), nWriteBufferSize(nCacheSize / 4),
+        nBloomBits(10), nMaxOpenFiles(64) {}
+};
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -62,6 +78,84 @@ public:
     }
 };
 
+/**
+ * Consistent, read-only view of a CLevelDBWrapper database as it was when the
+ * snapshot was taken. Reads through it are safe from any thread and never
+ * observe writes made afterwards, so callers need not hold the lock that
+ * protects the live database. The owning CLevelDBWrapper must outlive it.
+ */
+class CLevelDBSnapshot
+{
+    friend class CLevelDBWrapper;
+
+private:
+    leveldb::DB* pdb;
+    const leveldb::Snapshot* psnapshot;
+
+    //! options used when reading from the snapshot
+    leveldb::ReadOptions readoptions;
+
+    //! options used when iterating over values of the snapshot
+    leveldb::ReadOptions iteroptions;
+
+    CLevelDBSnapshot(leveldb::DB* pdbIn);
+    CLevelDBSnapshot(const CLevelDBSnapshot&);
+    void operator=(const CLevelDBSnapshot&);
+
+public:
+    ~CLevelDBSnapshot();
+
+    template <typename K, typename V>
+    bool Read(const K& key, V& value) const throw(leveldb_error)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+
+        std::string strValue;
+        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            LogPrintf("LevelDB snapshot read failure: %s\n", status.ToString());
+            HandleError(status);
+        }
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    template <typename K>
+    bool Exists(const K& key) const throw(leveldb_error)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+
+        std::string strValue;
+        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            LogPrintf("LevelDB snapshot read failure: %s\n", status.ToString());
+            HandleError(status);
+        }
+        return true;
+    }
+
+    //! Each thread walking the snapshot needs its own iterator, the caller owns the result
+    leveldb::Iterator* NewIterator() const
+    {
+        return pdb->NewIterator(iteroptions);
+    }
+};
+
 class CLevelDBWrapper
 {
 private:
@@ -71,6 +165,9 @@ private:
     //! database options used
     leveldb::Options options;
 
+    //! the tunables options was built from
+    CLevelDBOptions dbOptions;
+
     //! options used when reading from the database
     leveldb::ReadOptions readoptions;
 
@@ -86,8 +183,11 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    void Open(const boost::filesystem::path& path, const CLevelDBOptions& dbOptionsIn, bool fMemory, bool fWipe);
+
 public:
     CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, const CLevelDBOptions& dbOptionsIn, bool fMemory = false, bool fWipe = false);
     ~CLevelDBWrapper();
 
     template <typename K, typename V>
@@ -169,6 +269,20 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    const CLevelDBOptions& GetDbOptions() const { return dbOptions; }
+
+    //! Value of a LevelDB property such as "leveldb.stats", empty if it is unknown
+    std::string GetProperty(const std::string& strName) const;
+
+    //! Approximate bytes on disk used by the keys starting with each possible first byte
+    void GetApproximateSizes(std::vector<uint64_t>& vSizes) const;
+
+    //! Pin the current state of the database, the caller owns the result
+    CLevelDBSnapshot* GetSnapshot() const
+    {
+        return new CLevelDBSnapshot(pdb);
+    }
 };
 
 #endif // ANONCOIN_LEVELDBWRAPPER_H
@@ -11,6 +11,7 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinstats.h"
 #include "consensus.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -71,7 +72,25 @@ const uint32_t MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 const uint32_t MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-const uint32_t DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+const uint32_t DEFAULT_MAX_ORPHAN_TRANSACTIONS = 1000;
+/** Default for -maxorphansize, maximum kilobytes of orphan transactions kept in memory */
+const uint32_t DEFAULT_MAX_ORPHAN_SIZE = 5000;
+/** Default for -maxorphanpeersize, maximum kilobytes of orphan transactions kept for one peer */
+const uint32_t DEFAULT_MAX_ORPHAN_PEER_SIZE = 1000;
+/** Default for -maxmempool, maximum megabytes of memory the transaction pool may use */
+const uint32_t DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time in hours for transactions in the pool */
+const uint32_t DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, save the memory pool on shutdown and load it on startup */
+const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+const uint32_t DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+const uint32_t DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+const uint32_t DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+const uint32_t DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 const uint32_t MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -143,6 +162,7 @@ bool fTxIndex = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 uint32_t nCoinCacheSize = 5000;
+uint256 hashAssumeValid;
 
 //! If we've just initialized Testnet with a genesis block we need to create some initial blocks, this flag starts that process
 bool fGenerateInitialTestNetState = false;
@@ -151,14 +171,8 @@ bool fGenerateInitialTestNetState = false;
 CFeeRate minRelayTxFee = CFeeRate(1000);
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+COrphanPool orphanpool(DEFAULT_MAX_ORPHAN_TRANSACTIONS, DEFAULT_MAX_ORPHAN_SIZE * 1000, DEFAULT_MAX_ORPHAN_PEER_SIZE * 1000);
 
-void EraseOrphansFor(NodeId peer);
 static void CheckBlockIndex();
 
 /** Constant stuff for coinbase transactions we create: */
@@ -425,7 +439,7 @@ void FinalizeNode(NodeId nodeid) {
 
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
-    EraseOrphansFor(nodeid);
+    orphanpool.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -648,90 +662,155 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
+/**
+ * Transaction index positions of the blocks connected since the last flush,
+ * written to the block tree together with the dirty block index (protected by cs_main).
+ */
+static std::vector<boost::shared_ptr<const CTxIndexLayer> > vTxIndexPending;
+static size_t nTxIndexPendingSize = 0;
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
+/** Look up a transaction position, including the ones not yet flushed (cs_main must be held) */
+static bool LookupTxIndex(const uint256 &txid, CDiskTxPos &pos)
 {
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
+    AssertLockHeld(cs_main);
+    for (std::vector<boost::shared_ptr<const CTxIndexLayer> >::const_reverse_iterator rit = vTxIndexPending.rbegin(); rit != vTxIndexPending.rend(); rit++) {
+        CTxIndexLayer::const_iterator it = (*rit)->find(txid);
+        if (it != (*rit)->end()) {
+            pos = it->second;
+            return true;
+        }
+    }
+    return pblocktree->ReadTxIndex(txid, pos);
+}
 
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
+static CCriticalSection cs_chainStateSnapshot;
+static CChainStateSnapshot chainStateSnapshot;
+
+bool CChainStateSnapshot::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) const
+{
+    for (std::vector<boost::shared_ptr<const CTxIndexLayer> >::const_reverse_iterator rit = vTxIndexLayers.rbegin(); rit != vTxIndexLayers.rend(); rit++) {
+        CTxIndexLayer::const_iterator it = (*rit)->find(txid);
+        if (it != (*rit)->end()) {
+            pos = it->second;
+            return true;
+        }
     }
+    return CBlockTreeDB::ReadTxIndex(*pblocktree, txid, pos);
+}
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+bool GetChainStateSnapshot(CChainStateSnapshot &snapshot)
+{
+    LOCK(cs_chainStateSnapshot);
+    snapshot = chainStateSnapshot;
+    return snapshot.pcoins != NULL;
+}
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
+void ResetChainStateSnapshot()
+{
+    LOCK(cs_chainStateSnapshot);
+    chainStateSnapshot = CChainStateSnapshot();
 }
 
-void static EraseOrphanTx(uint256 hash)
+/**
+ * Publish a new chain state snapshot for pindexNew. With pviewBlock NULL the
+ * coin database has just been flushed and is pinned as is, otherwise the coins
+ * pviewBlock is about to flush into pcoinsTip are layered on the last snapshot.
+ * Nothing is published during initial block download, where the layers would
+ * only duplicate the coin cache. After it the coin database is flushed before
+ * the first snapshot, so the whole coin cache is never copied under cs_main.
+ */
+static void PublishChainStateSnapshot(const CCoinsViewCache *pviewBlock, const CBlockIndex *pindexNew)
 {
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
+    AssertLockHeld(cs_main);
+    if (!pcoinsdbview || !pindexNew || IsInitialBlockDownload()) {
+        ResetChainStateSnapshot();
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
     }
-    mapOrphanTransactions.erase(it);
-}
 
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
+    CChainStateSnapshot snapshot;
+    GetChainStateSnapshot(snapshot);
+    if (!pviewBlock) {
+        // Start over from the database
+        boost::shared_ptr<const CLevelDBSnapshot> pcoinsdb(pcoinsdbview->GetSnapshot());
+        snapshot.pcoins.reset(new CCoinsViewSnapshot(pcoinsdb, pindexNew->GetBlockHash(), pindexNew->nHeight));
+    } else if (!snapshot.pcoins) {
+        // Wait for the next flush rather than copy what the database is missing
+        return;
+    } else {
+        boost::shared_ptr<CCoinsLayer> player(new CCoinsLayer());
+        pviewBlock->GetDirtyCoins(*player);
+        snapshot.pcoins.reset(new CCoinsViewSnapshot(*snapshot.pcoins, player, pindexNew->GetBlockHash(), pindexNew->nHeight));
     }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    // Pin the block tree at the same moment, along with the index positions not flushed to it yet
+    snapshot.pblocktree.reset(pblocktree->GetSnapshot());
+    snapshot.vTxIndexLayers = vTxIndexPending;
+
+    LOCK(cs_chainStateSnapshot);
+    chainStateSnapshot = snapshot;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// orphanpool
+//
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+/**
+ * Try the orphans spending outputs of the transactions in vWorkQueue again.
+ * Orphans accepted go to the back of the queue in turn, so a whole chain of
+ * orphans is reconnected in one batch. Orphans still missing other inputs
+ * stay in the pool.
+ */
+static void ProcessOrphans(vector<uint256>& vWorkQueue)
 {
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    AssertLockHeld(cs_main);
+    set<NodeId> setMisbehaving;
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
+        vector<uint256> vOrphans;
+        orphanpool.GetChildren(vWorkQueue[i], vOrphans);
+        BOOST_FOREACH(const uint256& orphanHash, vOrphans)
+        {
+            COrphanTx orphan;
+            if (!orphanpool.GetTx(orphanHash, orphan))
+                continue;
+            const CTransaction& orphanTx = orphan.tx;
+            NodeId fromPeer = orphan.fromPeer;
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+            if (setMisbehaving.count(fromPeer)) {
+                orphanpool.EraseTx(orphanHash);
+                continue;
+            }
+            if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+            {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(orphanTx);
+                vWorkQueue.push_back(orphanHash);
+                orphanpool.EraseTx(orphanHash);
+            }
+            else if (!fMissingInputs2)
+            {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(fromPeer, nDos);
+                    setMisbehaving.insert(fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // too-little-fee orphan
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                orphanpool.EraseTx(orphanHash);
+            }
+            mempool.check(pcoinsTip);
+        }
+    }
 }
 
 
@@ -1042,8 +1121,24 @@ int64_t GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+/** Expire old transactions, then evict the cheapest ones until the pool fits in limit bytes */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, int64_t age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, fOverrideMempoolLimit);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1145,7 +1240,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         int64_t nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1155,6 +1250,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // Once the pool has been full, it only takes what pays at least the rate of what was evicted
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1188,6 +1290,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+            return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, true))
@@ -1210,7 +1323,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // Trim the pool and make sure the transaction is still in it
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1221,49 +1341,53 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uintFakeHash &hashBlock, bool fAllowSlow)
 {
-    CBlockIndex *pindexSlow = NULL;
-    {
-        LOCK(cs_main);
-        {
-            if (mempool.lookup(hash, txOut))
-            {
-                return true;
-            }
-        }
+    // The memory pool and the transaction index have their own locking, only
+    // the slow path needs cs_main.
+    if (mempool.lookup(hash, txOut))
+        return true;
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s : OpenBlockFile failed", __func__);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-                }
-                //! Returning a block hash to the outside world means the sha256d hash is needed
-                hashBlock = header.CalcSha256dHash();
-                if (txOut.GetHash() != hash)
-                    return error("%s : txid mismatch", __func__);
-                return true;
+    if (fTxIndex) {
+        CDiskTxPos postx;
+        bool fFound;
+        CChainStateSnapshot snapshot;
+        if (GetChainStateSnapshot(snapshot))
+            fFound = snapshot.ReadTxIndex(hash, postx);
+        else {
+            LOCK(cs_main);
+            fFound = LookupTxIndex(hash, postx);
+        }
+        if (fFound) {
+            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull())
+                return error("%s : OpenBlockFile failed", __func__);
+            CBlockHeader header;
+            try {
+                file >> header;
+                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                file >> txOut;
+            } catch (const std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
+            //! Returning a block hash to the outside world means the sha256d hash is needed
+            hashBlock = header.CalcSha256dHash();
+            if (txOut.GetHash() != hash)
+                return error("%s : txid mismatch", __func__);
+            return true;
         }
+    }
 
-        if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-            int nHeight = -1;
-            {
-                CCoinsViewCache &view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
-            }
-            if (nHeight > 0)
-                pindexSlow = chainActive[nHeight];
+    CBlockIndex *pindexSlow = NULL;
+    if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
+        LOCK(cs_main);
+        int nHeight = -1;
+        {
+            CCoinsViewCache &view = *pcoinsTip;
+            const CCoins* coins = view.AccessCoins(hash);
+            if (coins)
+                nHeight = coins->nHeight;
         }
+        if (nHeight > 0)
+            pindexSlow = chainActive[nHeight];
     }
 
     if (pindexSlow) {
@@ -1544,12 +1668,37 @@ bool CScriptCheck::operator()() {
  * again when accepted into the block chain)
  */
 
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata.get()), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
+/** Set state for input nIn of tx, whose script failed with serror under flags */
+static bool ScriptFailure(CValidationState &state, const CCoins& coins, const CTransaction& tx, unsigned int nIn, unsigned int flags, bool cacheStore, ScriptError serror)
+{
+    if (flags & SCRIPT_VERIFY_STRICTENC) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-standard DER encodings or non-null dummy
+        // arguments; if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        CScriptCheck check(coins, tx, nIn,
+                flags & (~SCRIPT_VERIFY_STRICTENC), cacheStore);
+        if (check())
+            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after a soft-fork
+    // super-majority vote has passed.
+    return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(serror)));
+}
+
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
@@ -1620,37 +1769,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Serialized once and shared by the signature hashes of all inputs
+            boost::shared_ptr<const CPrecomputedTransactionData> txdata(new CPrecomputedTransactionData(tx));
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
                 } else if (!check()) {
-                    if (flags & SCRIPT_VERIFY_STRICTENC) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
-                                flags & (~SCRIPT_VERIFY_STRICTENC), cacheStore);
-                        if (check())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+                    return ScriptFailure(state, *coins, tx, i, flags, cacheStore, check.GetScriptError());
                 }
             }
         }
@@ -1661,6 +1793,138 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
 
 
 
+/** Maximum bytes of undo data waiting for the writer thread before ConnectBlock blocks */
+static const size_t MAX_UNDO_QUEUE_BYTES = 32 * 1024 * 1024;
+
+/**
+ * Writes the undo data of connected blocks from a background thread, keeping
+ * disk latency out of ConnectBlock. The space in the rev file is reserved by
+ * FindUndoPos before a write is queued, so its position is known up front.
+ * Without a running thread writes happen in the caller.
+ */
+class CUndoWriter
+{
+private:
+    struct CUndoWrite
+    {
+        CDiskBlockPos pos;
+        uint256 hashBlock;
+        CBlockUndo blockundo;
+        size_t nSize;
+    };
+
+    boost::mutex mutex;
+    //! Signalled when a write is queued
+    boost::condition_variable condWork;
+    //! Signalled when writes complete
+    boost::condition_variable condDone;
+    std::list<CUndoWrite> queue;
+    size_t nQueuedBytes;
+    //! Writes taken from the queue but not finished yet
+    int nWriting;
+    bool fThread;
+    bool fError;
+
+    bool Write(CUndoWrite &write)
+    {
+        CDiskBlockPos pos = write.pos;
+        if (!write.blockundo.WriteToDisk(pos, write.hashBlock))
+            return false;
+        if (pos.nPos != GetDataPos(write.pos))
+            return error("%s : undo data written at 0x%x, expected 0x%x in rev%05u.dat", __func__, pos.nPos, GetDataPos(write.pos), pos.nFile);
+        return true;
+    }
+
+    //! Take all queued writes and perform them, mutex must be held by lock
+    void WriteAll(boost::unique_lock<boost::mutex> &lock)
+    {
+        std::list<CUndoWrite> batch;
+        batch.swap(queue);
+        nWriting += batch.size();
+        lock.unlock();
+        bool fOk = true;
+        BOOST_FOREACH(CUndoWrite &write, batch) {
+            // A write error must reach fError, not unwind past the counters below
+            try {
+                fOk = Write(write) && fOk;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : %s\n", __func__, e.what());
+                fOk = false;
+            }
+        }
+        lock.lock();
+        BOOST_FOREACH(const CUndoWrite &write, batch)
+            nQueuedBytes -= write.nSize;
+        nWriting -= batch.size();
+        if (!fOk)
+            fError = true;
+        condDone.notify_all();
+    }
+
+public:
+    CUndoWriter() : nQueuedBytes(0), nWriting(0), fThread(false), fError(false) {}
+
+    //! Position the undo data will have once written, for undo space reserved at posReserved
+    static unsigned int GetDataPos(const CDiskBlockPos &posReserved)
+    {
+        return posReserved.nPos + MESSAGE_START_SIZE + sizeof(unsigned int);
+    }
+
+    //! Queue blockundo to be written at posReserved, its contents are taken over
+    bool Push(const CDiskBlockPos &posReserved, const uint256 &hashBlock, CBlockUndo &blockundo, size_t nSize)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.push_back(CUndoWrite());
+        CUndoWrite &write = queue.back();
+        write.pos = posReserved;
+        write.hashBlock = hashBlock;
+        write.blockundo.vtxundo.swap(blockundo.vtxundo);
+        write.nSize = nSize;
+        nQueuedBytes += nSize;
+        if (!fThread) {
+            WriteAll(lock);
+            return !fError;
+        }
+        condWork.notify_one();
+        while (fThread && nQueuedBytes > MAX_UNDO_QUEUE_BYTES && !fError)
+            condDone.wait(lock);
+        return !fError;
+    }
+
+    //! Wait until every queued write is on its way to disk, false if any of them failed
+    bool Flush()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fThread && !queue.empty())
+            WriteAll(lock);
+        while (!queue.empty() || nWriting > 0)
+            condDone.wait(lock);
+        return !fError;
+    }
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fThread = true;
+        try {
+            while (true) {
+                while (queue.empty())
+                    condWork.wait(lock);
+                WriteAll(lock);
+            }
+        } catch (const boost::thread_interrupted&) {
+            // Interrupted, leave the remaining writes to the callers of Push() and Flush()
+            fThread = false;
+            if (!queue.empty())
+                WriteAll(lock);
+            condDone.notify_all();
+            throw;
+        }
+    }
+};
+
+static CUndoWriter undowriter;
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
@@ -1674,6 +1938,8 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull())
         return error("DisconnectBlock() : no undo data available");
+    if (!undowriter.Flush())
+        return error("DisconnectBlock() : failure writing undo data");
     if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
         return error("DisconnectBlock() : failure reading undo data");
 
@@ -1748,10 +2014,14 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     }
 }
 
-void static FlushBlockFile(bool fFinalize = false)
+/** Commit the last block and undo files to disk, false if a pending undo write failed */
+bool static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
 
+    // Pending undo writes must land before the files are committed or truncated
+    bool fUndoOk = undowriter.Flush();
+
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
     FILE *fileOld = OpenBlockFile(posOld);
@@ -1769,6 +2039,8 @@ void static FlushBlockFile(bool fFinalize = false)
         FileCommit(fileOld);
         fclose(fileOld);
     }
+
+    return fUndoOk;
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
@@ -1780,13 +2052,187 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+CCheckQueueStats GetScriptCheckStats() {
+    return scriptcheckqueue.GetStats();
+}
+
+void ThreadUndoWriter() {
+    RenameThread("anoncoin-undo");
+    undowriter.Thread();
+}
+
+/** Verifies the scripts of loose transactions before they take cs_main */
+static CCheckQueue<CScriptCheck> txcheckqueue(128);
+//! Only one thread at a time may wait on txcheckqueue
+static CCriticalSection cs_txcheckqueue;
+
+void ThreadTxScriptCheck() {
+    RenameThread("anoncoin-txcheck");
+    txcheckqueue.Thread();
+}
+
+bool PreValidateTransaction(CTxMemPool& pool, CValidationState &state, const CTransaction &tx)
+{
+    if (!CheckTransaction(tx, state))
+        return error("PreValidateTransaction : CheckTransaction failed");
+
+    // Coinbase is only valid in a block, not as a loose transaction
+    if (tx.IsCoinBase())
+        return state.DoS(100, error("PreValidateTransaction : coinbase as individual tx"),
+                         REJECT_INVALID, "coinbase");
+
+    // Rather not work on nonstandard transactions (unless -testnet/-regtest)
+    string reason;
+    if (isMainNetwork() && !IsStandardTx(tx, reason))
+        return state.DoS(0,
+                         error("PreValidateTransaction : nonstandard transaction: %s", reason),
+                         REJECT_NONSTANDARD, reason);
+
+    // Without a chain state snapshot (during initial block download) the
+    // scripts are left to AcceptToMemoryPool()
+    CChainStateSnapshot snapshot;
+    if (pool.exists(tx.GetHash()) || !GetChainStateSnapshot(snapshot))
+        return true;
+    return PreValidateTransaction(pool, state, tx, snapshot.pcoins.get(), snapshot.pcoins->GetBestHeight());
+}
+
+bool PreValidateTransaction(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, CCoinsView *pcoins, int nHeight)
+{
+    // Replacements are rejected by AcceptToMemoryPool() anyway
+    {
+        LOCK(pool.cs); // protect pool.mapNextTx
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (pool.mapNextTx.count(txin.prevout))
+                return true;
+    }
+
+    // Fetch the spent coins from the pool or pcoins. A coin's output scripts
+    // never change, so a slightly old snapshot is fine. Missing or spent
+    // inputs are also left to AcceptToMemoryPool() to sort out.
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CAmount nValueIn = 0;
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoins, pool);
+        view.SetBackend(viewMemPool);
+        if (!view.HaveInputs(tx))
+            return true;
+        nValueIn = view.GetValueIn(tx);
+        view.SetBackend(dummy);
+    }
+
+    // The cheap checks of AcceptToMemoryPool() go first, so that whatever it
+    // would turn away never gets its signatures verified and cached. Anything
+    // that does not clearly pay its way, including free transactions which
+    // face the priority check and the rate limiter, is left to it entirely.
+    if (isMainNetwork() && !AreInputsStandard(tx, view))
+        return true;
+    if (GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view) > MAX_TX_SIGOPS)
+        return true;
+    CAmount nFees = nValueIn - tx.GetValueOut();
+    CTxMemPoolEntry entry(tx, nFees, GetTime(), 0, nHeight);
+    unsigned int nSize = entry.GetTxSize();
+    if (nFees < ::minRelayTxFee.GetFee(nSize))
+        return true;
+    if (nFees < pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize))
+        return true;
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors,
+                                        GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                        GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000,
+                                        GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                        GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000,
+                                        errString))
+        return true;
+
+    // Valid signatures go into the signature cache, so that CheckInputs()
+    // under cs_main finds them there.
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+    std::vector<CScriptCheck> vChecks(tx.vin.size());
+    boost::shared_ptr<const CPrecomputedTransactionData> txdata(new CPrecomputedTransactionData(tx));
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        CScriptCheck check(*view.AccessCoins(tx.vin[i].prevout.hash), tx, i, flags, true, txdata);
+        check.swap(vChecks[i]);
+    }
+    bool fValid = true;
+    if (nScriptCheckThreads) {
+        LOCK(cs_txcheckqueue);
+        CCheckQueueControl<CScriptCheck> control(&txcheckqueue);
+        control.Add(vChecks);
+        fValid = control.Wait();
+    } else {
+        BOOST_FOREACH(CScriptCheck& check, vChecks) {
+            if (!check()) {
+                fValid = false;
+                break;
+            }
+        }
+    }
+    if (fValid)
+        return true;
+
+    // The queue does not tell which input failed, find it for the reject reason
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CCoins& coins = *view.AccessCoins(tx.vin[i].prevout.hash);
+        CScriptCheck check(coins, tx, i, flags, true);
+        if (!check())
+            return ScriptFailure(state, coins, tx, i, flags, true, check.GetScriptError());
+    }
+    return true;
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+/** Work on top of a block, in seconds of blocks at the best header's difficulty, before -assumevalid may skip its scripts */
+static const int64_t ASSUMEVALID_MIN_BURIED_TIME = 14 * 24 * 60 * 60;
+
+/**
+ * Whether the scripts of pindex may go unverified under -assumevalid: the
+ * assumed valid block is in the best header chain, pindex is one of its
+ * ancestors, and the header chain has two weeks' worth of work on top of
+ * pindex, so a freshly made up chain cannot earn the shortcut.
+ */
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0 || pindexBestHeader == NULL)
+        return false;
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+    const CBlockIndex* pindexAssumed = it->second;
+    if (pindexAssumed->GetAncestor(pindex->nHeight) != pindex)
+        return false;
+    if (pindexBestHeader->GetAncestor(pindexAssumed->nHeight) != pindexAssumed)
+        return false;
+    uint256 nBlocksBuried = ASSUMEVALID_MIN_BURIED_TIME / nTargetSpacing;
+    return pindexBestHeader->nChainWork - pindex->nChainWork >= ancConsensus.GetBlockProof(*pindexBestHeader) * nBlocksBuried;
+}
+
+/** What connecting a block gathers before its scripts are verified, to finish connecting it with after */
+struct CBlockConnection
+{
+    CBlockUndo blockundo;
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    int nInputs;
+    int64_t nTimeStart;
+    //! The genesis block, whose transactions are not connected
+    bool fGenesis;
+
+    CBlockConnection() : nInputs(0), nTimeStart(0), fGenesis(false) {}
+};
+
+/**
+ * The first half of ConnectBlock: check block and apply its transactions to
+ * view, adding the script checks to control instead of waiting for them.
+ */
+static bool ConnectBlockInputs(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck,
+                               CCheckQueueControl<CScriptCheck>& control, CBlockConnection& conn)
 {
     AssertLockHeld(cs_main);
     // Check it again in case a previous version let a bad block in
@@ -1808,12 +2254,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == Params().HashGenesisBlock()) {
-        if (!fJustCheck)
-            view.SetBestBlock(pindex->GetBlockHash());
+        conn.fGenesis = true;
         return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    // Scripts below the last checkpoint or an assumed valid block are not verified, all else is
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1854,16 +2300,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     //    flags |= SCRIPT_VERIFY_DERSIG;
     //}
 
-    CBlockUndo blockundo;
-
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CBlockUndo& blockundo = conn.blockundo;
+    std::vector<std::pair<uint256, CDiskTxPos> >& vPos = conn.vPos;
 
-    int64_t nTimeStart = GetTimeMicros();
+    int64_t nTimeStart = conn.nTimeStart = GetTimeMicros();
     int64_t nFees = 0;
-    int nInputs = 0;
+    int& nInputs = conn.nInputs;
     unsigned int nSigOps = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
@@ -1919,26 +2363,36 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                block.vtx[0].GetValueOut(), ancConsensus.GetBlockValue(pindex->nHeight, nFees)),
                                REJECT_INVALID, "bad-cb-amount");
 
-    if (!control.Wait())
-        return state.DoS(100, false);
-    int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
-    LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
+    return true;
+}
 
-    if (fJustCheck)
-        return true;
+/**
+ * The second half of ConnectBlock, once the scripts of block passed: write
+ * its undo data, raise its validity and make it the best block of view.
+ */
+static bool FinishConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, CBlockConnection& conn)
+{
+    AssertLockHeld(cs_main);
+    assert(!conn.fGenesis);
+    CBlockUndo& blockundo = conn.blockundo;
+    const std::vector<std::pair<uint256, CDiskTxPos> >& vPos = conn.vPos;
+    int64_t nTime2 = GetTimeMicros();
 
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS))
     {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            unsigned int nSize = ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION);
+            if (!FindUndoPos(state, pindex->nFile, pos, nSize + 40))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
+            // The write happens in the background, FlushStateToDisk waits for it
+            // before this block index entry is persisted.
+            if (!undowriter.Push(pos, pindex->pprev->GetBlockHash(), blockundo, nSize))
                 return state.Abort(_("Failed to write undo data"));
 
             // update nUndoPos in block index
-            pindex->nUndoPos = pos.nPos;
+            pindex->nUndoPos = CUndoWriter::GetDataPos(pos);
             pindex->nStatus |= BLOCK_HAVE_UNDO;
         }
 
@@ -1946,9 +2400,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return state.Abort(_("Failed to write transaction index"));
+    if (fTxIndex && !vPos.empty()) {
+        // Written by FlushStateToDisk, together with the block index entry of this block
+        vTxIndexPending.push_back(boost::shared_ptr<const CTxIndexLayer>(new CTxIndexLayer(vPos.begin(), vPos.end())));
+        nTxIndexPendingSize += vPos.size();
+    }
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -1976,6 +2432,30 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+{
+    AssertLockHeld(cs_main);
+    CBlockConnection conn;
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    if (!ConnectBlockInputs(block, state, pindex, view, fJustCheck, control, conn))
+        return false;
+    if (conn.fGenesis) {
+        if (!fJustCheck)
+            view.SetBestBlock(pindex->GetBlockHash());
+        return true;
+    }
+
+    if (!control.Wait())
+        return state.DoS(100, false);
+    int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - conn.nTimeStart;
+    LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", conn.nInputs - 1, 0.001 * (nTime2 - conn.nTimeStart), conn.nInputs <= 1 ? 0 : 0.001 * (nTime2 - conn.nTimeStart) / (conn.nInputs-1), nTimeVerify * 0.000001);
+
+    if (fJustCheck)
+        return true;
+
+    return FinishConnectBlock(block, state, pindex, view, conn);
+}
+
 enum FlushStateMode {
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
@@ -1990,9 +2470,12 @@ enum FlushStateMode {
 bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     LOCK2(cs_main, cs_LastBlockFile);
     static int64_t nLastWrite = 0;
+    // A chain state snapshot is only published from a flushed coin database
+    CChainStateSnapshot snapshot;
+    bool fPublishSnapshot = pcoinsdbview && !GetChainStateSnapshot(snapshot) && !IsInitialBlockDownload();
     try {
     if ((mode == FLUSH_STATE_ALWAYS) ||
-        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && (pcoinsTip->GetCacheSize() > nCoinCacheSize || nTxIndexPendingSize > nCoinCacheSize || fPublishSnapshot)) ||
         (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
@@ -2002,29 +2485,35 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // First make sure all block and undo data is flushed to disk.
-        FlushBlockFile();
-        // Then update all block file information (which may refer to block and undo files).
-        bool fileschanged = false;
-        for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); ) {
-            if (!pblocktree->WriteBlockFileInfo(*it, vinfoBlockFile[*it])) {
-                return state.Abort("Failed to write to block index");
-            }
-            fileschanged = true;
-            setDirtyFileInfo.erase(it++);
-        }
-        if (fileschanged && !pblocktree->WriteLastBlockFile(nLastBlockFile)) {
+        if (!undowriter.Flush())
+            return state.Abort("Failed to write undo data");
+        if (!FlushBlockFile())
+            return state.Abort("Failed to write undo data");
+        // Then update all block file information (which may refer to block and undo files),
+        // the block index and the transaction index in one synced batch.
+        std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+        vFiles.reserve(setDirtyFileInfo.size());
+        for (set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); it++)
+            vFiles.push_back(make_pair(*it, &vinfoBlockFile[*it]));
+        std::vector<CBlockIndex*> vBlocks(setDirtyBlockIndex.begin(), setDirtyBlockIndex.end());
+        std::vector<std::pair<uint256, CDiskTxPos> > vTxIndex;
+        vTxIndex.reserve(nTxIndexPendingSize);
+        BOOST_FOREACH(const boost::shared_ptr<const CTxIndexLayer> &player, vTxIndexPending)
+            vTxIndex.insert(vTxIndex.end(), player->begin(), player->end());
+        if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks, vTxIndex)) {
             return state.Abort("Failed to write to block index");
         }
-        for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
-             if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(*it))) {
-                 return state.Abort("Failed to write to block index");
-             }
-             setDirtyBlockIndex.erase(it++);
-        }
-        pblocktree->Sync();
+        setDirtyFileInfo.clear();
+        setDirtyBlockIndex.clear();
+        vTxIndexPending.clear();
+        nTxIndexPendingSize = 0;
         // Finally flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return state.Abort("Failed to write to coin database");
+        // Called from ConnectTip or DisconnectTip the chain tip has not moved yet, so label the
+        // snapshot with the block the flushed coins actually belong to
+        BlockMap::iterator mi = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+        PublishChainStateSnapshot(NULL, mi != mapBlockIndex.end() ? mi->second : chainActive.Tip());
         // Update best block in wallet (so we can detect restored wallets).
         if (mode != FLUSH_STATE_IF_NEEDED) {
             g_signals.SetBestChain(chainActive.GetLocator());
@@ -2109,6 +2598,12 @@ bool static DisconnectTip(CValidationState &state) {
         CCoinsViewCache view(pcoinsTip);                    // Create an empty coin cache view, based on the main pcoinsTip cache
         if (!DisconnectBlock(block, state, pindexDelete, view))
             return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        if (coinsStatsEngine.IsTracking()) {
+            CCoinsStatsDelta delta;
+            view.GetStatsDelta(delta);
+            coinsStatsEngine.Update(delta, pindexDelete->pprev);
+        }
+        PublishChainStateSnapshot(&view, pindexDelete->pprev);
         assert(view.Flush());
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -2116,13 +2611,23 @@ bool static DisconnectTip(CValidationState &state) {
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2142,38 +2647,19 @@ static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
 /**
- * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
- * corresponding to pindexNew, to bypass loading it again from disk.
+ * Make pindexNew the tip, its block having been connected to view, a view
+ * on pcoinsTip. nTime1 is when connecting it started, for the benchmarks.
  */
-bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
-    assert(pindexNew->pprev == chainActive.Tip());
-    mempool.check(pcoinsTip);
-    // Read block from disk.
-    int64_t nTime1 = GetTimeMicros();
-    CBlock block;
-    if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
-            return state.Abort("Failed to read block");
-        pblock = &block;
-    }
-    // Apply the block atomically to the chain state.
-    int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
-    int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
-    {
-        CCoinsViewCache view(pcoinsTip);                    // Create an empty coin cache view, based on the main pcoinsTip cache
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view);
-        g_signals.BlockChecked(*pblock, state);                             // New signal used for the rpc miner
-        if (!rv) {
-            if (state.IsInvalid())
-                InvalidBlockFound(pindexNew, state);
-            return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
-        }
-        mapBlockSource.erase(pindexNew->GetBlockHash());
-        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
-        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
-        assert(view.Flush());
-    }
+static bool CommitConnectedTip(CValidationState &state, CBlockIndex *pindexNew, const CBlock &block, CCoinsViewCache &view, int64_t nTime1) {
+    int64_t nTime3 = GetTimeMicros();
+    mapBlockSource.erase(pindexNew->GetBlockHash());
+    if (coinsStatsEngine.IsTracking()) {
+        CCoinsStatsDelta delta;
+        view.GetStatsDelta(delta);
+        coinsStatsEngine.Update(delta, pindexNew);
+    }
+    PublishChainStateSnapshot(&view, pindexNew);
+    assert(view.Flush());
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
     // Write the chain state to disk, if necessary.
@@ -2183,7 +2669,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
-    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
+    mempool.removeForBlock(block.vtx, pindexNew->nHeight, txConflicted);
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
@@ -2193,7 +2679,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     if( !hashPrevBestCoinBase.IsNull() ) {
         g_signals.UpdatedTransaction( hashPrevBestCoinBase );
     }
-    hashPrevBestCoinBase = pblock->vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0].GetHash();
 
     // Tell wallet about transactions that went from mempool
     // to conflicted:
@@ -2201,8 +2687,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        SyncWithWallets(tx, &block);
     }
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
@@ -2211,6 +2697,104 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     return true;
 }
 
+/**
+ * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
+ * corresponding to pindexNew, to bypass loading it again from disk.
+ */
+bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
+    assert(pindexNew->pprev == chainActive.Tip());
+    mempool.check(pcoinsTip);
+    // Read block from disk.
+    int64_t nTime1 = GetTimeMicros();
+    CBlock block;
+    if (!pblock) {
+        if (!ReadBlockFromDisk(block, pindexNew))
+            return state.Abort("Failed to read block");
+        pblock = &block;
+    }
+    // Apply the block atomically to the chain state.
+    int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    CCoinsViewCache view(pcoinsTip);                    // Create an empty coin cache view, based on the main pcoinsTip cache
+    bool rv = ConnectBlock(*pblock, state, pindexNew, view);
+    g_signals.BlockChecked(*pblock, state);                             // New signal used for the rpc miner
+    if (!rv) {
+        if (state.IsInvalid())
+            InvalidBlockFound(pindexNew, state);
+        return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
+    }
+    int64_t nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
+    LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+    return CommitConnectedTip(state, pindexNew, *pblock, view, nTime1);
+}
+
+/** Most blocks ConnectTipsPipelined takes at once */
+static const unsigned int MAX_PIPELINED_BLOCKS = 16;
+
+/** A block connected by ConnectTipsPipelined, waiting for its scripts to be verified */
+struct CPipelinedTip
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    CCoinsViewCache view;
+    CBlockConnection conn;
+
+    CPipelinedTip(CBlockIndex* pindexIn, CCoinsView* pbase) : pindex(pindexIn), view(pbase) {}
+};
+
+/**
+ * Connect the blocks vpindex, children of the tip in order, with the script
+ * checks of each block running while the inputs of the next are connected,
+ * rather than waiting for them block by block.
+ *
+ * Each block is connected to a view stacked on the previous block's, so
+ * nothing reaches pcoinsTip before the scripts of all blocks passed. They
+ * are then made the tip one after the other, as ConnectTip would. If any
+ * block fails before that, nothing changed and false is returned: the
+ * caller connects the blocks one at a time, which finds the one at fault.
+ */
+static bool ConnectTipsPipelined(CValidationState &state, const std::vector<CBlockIndex*> &vpindex) {
+    AssertLockHeld(cs_main);
+    assert(!vpindex.empty() && vpindex[0]->pprev == chainActive.Tip());
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Declared before the control, whose destructor waits for the checks
+    // pointing into these blocks if we leave early
+    std::vector<boost::shared_ptr<CPipelinedTip> > vTips;
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        CCoinsView* pbase = pcoinsTip;
+        BOOST_FOREACH(CBlockIndex* pindex, vpindex) {
+            vTips.push_back(boost::shared_ptr<CPipelinedTip>(new CPipelinedTip(pindex, pbase)));
+            CPipelinedTip& tip = *vTips.back();
+            if (!ReadBlockFromDisk(tip.block, pindex))
+                return false;
+            if (!ConnectBlockInputs(tip.block, state, pindex, tip.view, false, control, tip.conn))
+                return false;
+            tip.view.SetBestBlock(pindex->GetBlockHash());
+            pbase = &tip.view;
+        }
+        if (!control.Wait())
+            return false;
+    }
+    int64_t nTimeVerified = GetTimeMicros();
+    LogPrint("bench", "  - Connect and verify %u blocks: %.2fms\n", (unsigned int)vTips.size(), (nTimeVerified - nTimeStart) * 0.001);
+
+    // All scripts passed; make the blocks the tip in order. The view of each
+    // rests on the previous one's, empty after that was flushed to pcoinsTip.
+    BOOST_FOREACH(const boost::shared_ptr<CPipelinedTip>& ptip, vTips) {
+        CPipelinedTip& tip = *ptip;
+        mempool.check(pcoinsTip);
+        tip.view.SetBackend(*pcoinsTip);
+        if (!FinishConnectBlock(tip.block, state, tip.pindex, tip.view, tip.conn))
+            return error("ConnectTipsPipelined() : FinishConnectBlock %s failed", tip.pindex->GetBlockHash().ToString());
+        g_signals.BlockChecked(tip.block, state);
+        if (!CommitConnectedTip(state, tip.pindex, tip.block, tip.view, GetTimeMicros()))
+            return false;
+    }
+    return true;
+}
+
 /**
  * Return the tip of the chain with the most work in it, that isn't
  * known to be invalid (it's however far from certain to be valid).
@@ -2300,9 +2884,23 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     }
     nHeight = nTargetHeight;
 
+    // During the initial download, connect runs of blocks without waiting
+    // for the scripts of each; what it leaves is connected one at a time.
+    if (nScriptCheckThreads && IsInitialBlockDownload() && chainActive.Tip() && vpindexToConnect.size() > 1) {
+        std::vector<CBlockIndex*> vpindexPipeline(vpindexToConnect.rbegin(),
+            vpindexToConnect.rbegin() + std::min<size_t>(vpindexToConnect.size(), MAX_PIPELINED_BLOCKS));
+        if (!ConnectTipsPipelined(state, vpindexPipeline)) {
+            // A system error (disk space, database) ends this step, as it would from ConnectTip;
+            // a block at fault is found again below when connecting one at a time
+            if (state.IsError())
+                return false;
+            state = CValidationState();
+        }
+    }
+
     // Connect new blocks.
     BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
-        if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
+        if (!chainActive.Contains(pindexConnect) && !ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
             if (state.IsInvalid()) {
                 // The block violates a consensus rule.
                 if (!state.CorruptionPossible())
@@ -2559,7 +3157,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
     if (!fKnown) {
         while (vinfoBlockFile[nFile].nSize + nAddSize >= MAX_BLOCKFILE_SIZE) {
             LogPrintf("Leaving block file %i: %s\n", nFile, vinfoBlockFile[nFile].ToString());
-            FlushBlockFile(true);
+            if (!FlushBlockFile(true))
+                return state.Abort("Failed to write undo data");
             nFile++;
             if (vinfoBlockFile.size() <= nFile) {
                 vinfoBlockFile.resize(nFile + 1);
@@ -3279,7 +3878,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             CBlockUndo undo;
             CDiskBlockPos pos = pindex->GetUndoPos();
             if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                if (!undowriter.Flush() || !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
                     return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
             }
         }
@@ -3332,8 +3931,7 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    orphanpool.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -3345,6 +3943,8 @@ void UnloadBlockIndex()
     nPreferredDownload = 0;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
+    vTxIndexPending.clear();
+    nTxIndexPendingSize = 0;
     mapNodeState.clear();
 
     BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
@@ -3512,6 +4112,121 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+/** Version of the mempool.dat format, bumped whenever its layout changes */
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+/** A transaction and its entry time, keyed by its count of in-pool ancestors */
+typedef std::pair<uint64_t, std::pair<CTransaction, int64_t> > MempoolDumpEntry;
+
+struct CompareByAncestorCount
+{
+    bool operator()(const MempoolDumpEntry& a, const MempoolDumpEntry& b) const
+    {
+        return a.first < b.first;
+    }
+};
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fopen(pathMempool.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("%s : No mempool file %s, starting with an empty pool\n", __func__, pathMempool.string());
+        return false;
+    }
+
+    int64_t nAccepted = 0, nFailed = 0, nExpired = 0;
+    int64_t nNow = GetTime();
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("%s : Unknown mempool file version %u, ignoring it\n", __func__, nVersion);
+            return false;
+        }
+
+        // Deltas go in first, so they apply as the transactions are accepted
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        filein >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nCount;
+        filein >> nCount;
+        while (nCount--) {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx;
+            filein >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                LOCK(cs_main);
+                CValidationState state;
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, false, NULL, nTime))
+                    ++nAccepted;
+                else
+                    ++nFailed;
+            } else {
+                ++nExpired;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+        return false;
+    }
+
+    LogPrintf("Loaded %i mempool transactions from disk (%i failed, %i expired) in %dms\n",
+              nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // Ancestors are written before their descendants, so the pool loads back in one pass
+    std::vector<MempoolDumpEntry> vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(std::make_pair(it->GetCountWithAncestors(), std::make_pair(it->GetTx(), it->GetTime())));
+    }
+    std::stable_sort(vEntries.begin(), vEntries.end(), CompareByAncestorCount());
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathMempoolNew = GetDataDir() / "mempool.dat.new";
+    try {
+        FILE* fileout = fopen(pathMempoolNew.string().c_str(), "wb");
+        if (!fileout)
+            return error("%s : Failed to open %s", __func__, pathMempoolNew.string());
+
+        CAutoFile file(fileout, SER_DISK, CLIENT_VERSION);
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vEntries.size();
+        for (unsigned int i = 0; i < vEntries.size(); i++) {
+            file << vEntries[i].second.first;
+            file << vEntries[i].second.second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathMempoolNew, pathMempool))
+            return error("%s : Failed to rename %s", __func__, pathMempoolNew.string());
+    } catch (const std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+
+    LogPrintf("Dumped %u mempool transactions to disk in %dms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
@@ -3753,7 +4468,7 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX:
         {
             bool fTxMemPool = mempool.exists(inv.hash);
-            bool fOrphan = mapOrphanTransactions.count(inv.hash) != 0;
+            bool fOrphan = orphanpool.HaveTx(inv.hash);
             CCoinsViewCache &view = *pcoinsTip;
             const CCoins* pCoins = view.AccessCoins(inv.hash);
             bool fInCoins = pCoins != NULL;
@@ -4523,7 +5238,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     if( fTxIndex ) {
                         // LogPrintf( "Double checking TxIndex for hash %s\n", inv.hash.ToString() );
                         CDiskTxPos postx;
-                        if( pblocktree->ReadTxIndex(inv.hash, postx) ) {
+                        if( LookupTxIndex(inv.hash, postx) ) {
                             LogPrintf( "WARNING - Tx hash found, likely old pruned coins in blockchain. Double spend attack?\n" );
                             Misbehaving(pfrom->GetId(), 1);
                             fAlreadyHave = true;
@@ -4691,26 +5406,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
         bool fMissingInputs = false;
         CValidationState state;
 
+        // The expensive checks run before taking cs_main
+        bool fPreValid = PreValidateTransaction(mempool, state, tx);
+
+        LOCK(cs_main);
+
         mapAlreadyAskedFor.erase(inv);
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (fPreValid && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
             vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
                 GetPeerLogStr(pfrom), pfrom->cleanSubVer,
@@ -4718,65 +5434,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 mempool.mapTx.size());
 
             // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    vEraseQueue.push_back(orphanHash);
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // too-little-fee orphan
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            orphanpool.EraseTx(inv.hash);
+            ProcessOrphans(vWorkQueue);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
+            // DoS prevention: the orphan pool is bounded in count and bytes, and per peer
+            orphanpool.AddTx(tx, pfrom->GetId(), GetTime());
+        } else if (fPreValid && pfrom->fWhitelisted) {
             // Always relay transactions received from whitelisted peers, even
             // if they are already in the mempool (allowing the node to function
             // as a gateway for nodes hidden behind it).
@@ -4869,6 +5534,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CValidationState state;
         ProcessNewBlock(state, pfrom, &block);
+
+        // Parents arriving in a block reconnect their orphans as well
+        if (state.IsValid()) {
+            vector<uint256> vWorkQueue;
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
+                vWorkQueue.push_back(tx.GetHash());
+            LOCK(cs_main);
+            ProcessOrphans(vWorkQueue);
+        }
+
         int nDoS;
         if (state.IsInvalid(nDoS)) {
             pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
@@ -5574,8 +6249,7 @@ public:
         mapBlockHashCrossReference.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanpool.clear();
 
     }
 } instance_of_cmaincleanup;
@@ -21,6 +21,7 @@
 #include "script.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "uint256.h"
 #include "undo.h"
 
@@ -33,18 +34,23 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 using namespace CashIsKing;
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
+class CCoinsViewSnapshot;
+class CLevelDBSnapshot;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
 
+struct CCheckQueueStats;
 struct CBlockTemplate;
 struct CNodeStateStats;
 
@@ -63,6 +69,24 @@ extern const uint32_t MAX_P2SH_SIGOPS;
 extern const uint32_t MAX_TX_SIGOPS;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 extern const uint32_t DEFAULT_MAX_ORPHAN_TRANSACTIONS;
+/** Default for -maxorphansize, maximum kilobytes of orphan transactions kept in memory */
+extern const uint32_t DEFAULT_MAX_ORPHAN_SIZE;
+/** Default for -maxorphanpeersize, maximum kilobytes of orphan transactions kept for one peer */
+extern const uint32_t DEFAULT_MAX_ORPHAN_PEER_SIZE;
+/** Default for -maxmempool, maximum megabytes of memory the transaction pool may use */
+extern const uint32_t DEFAULT_MAX_MEMPOOL_SIZE;
+/** Default for -mempoolexpiry, expiration time in hours for transactions in the pool */
+extern const uint32_t DEFAULT_MEMPOOL_EXPIRY;
+/** Default for -persistmempool, save the memory pool on shutdown and load it on startup */
+extern const bool DEFAULT_PERSIST_MEMPOOL;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+extern const uint32_t DEFAULT_ANCESTOR_LIMIT;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+extern const uint32_t DEFAULT_ANCESTOR_SIZE_LIMIT;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+extern const uint32_t DEFAULT_DESCENDANT_LIMIT;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+extern const uint32_t DEFAULT_DESCENDANT_SIZE_LIMIT;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 extern const uint32_t MAX_BLOCKFILE_SIZE;
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -116,6 +140,7 @@ extern const uint8_t REJECT_CHECKPOINT;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern COrphanPool orphanpool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern const std::string strMessageMagic;
@@ -129,6 +154,8 @@ extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern unsigned int nCoinCacheSize;
+/** Block whose ancestors need not have their scripts verified, set by -assumevalid */
+extern uint256 hashAssumeValid;
 extern CFeeRate minRelayTxFee;
 //! Used to initialize Testnet, soon after the genesis block has been created and the system initialized
 extern bool fGenerateInitialTestNetState;
@@ -181,6 +208,10 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
+/** Load the memory pool saved by DumpMempool() from mempool.dat */
+bool LoadMempool();
+/** Save the memory pool, with its entry times and prioritisation, to mempool.dat */
+bool DumpMempool();
 /** Unload database information */
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
@@ -194,6 +225,12 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Counters of the queue the script checking threads work from */
+CCheckQueueStats GetScriptCheckStats();
+/** Run the thread writing undo data of connected blocks */
+void ThreadUndoWriter();
+/** Run an instance of the thread checking the scripts of loose transactions */
+void ThreadTxScriptCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core */
@@ -217,9 +254,26 @@ void Misbehaving(NodeId nodeid, int howmuch);
 void FlushStateToDisk();
 
 
+/**
+ * Check the structure, standardness and scripts of a loose transaction without
+ * cs_main, on the transaction script check threads. Returns false only if the
+ * transaction is invalid; what could not be checked is left to AcceptToMemoryPool().
+ */
+bool PreValidateTransaction(CTxMemPool& pool, CValidationState &state, const CTransaction &tx);
+/**
+ * The input checks of the above against the coins of pcoins at height nHeight.
+ * Scripts are only verified once the transaction passes the conflict, input
+ * standardness, sigop, fee and ancestor checks of AcceptToMemoryPool().
+ */
+bool PreValidateTransaction(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, CCoinsView *pcoins, int nHeight);
+
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool fOverrideMempoolLimit=false);
+/** As AcceptToMemoryPool, but with the entry time given instead of the current time */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee=false,
+                                bool fOverrideMempoolLimit=false);
 
 
 struct CNodeStateStats {
@@ -346,17 +400,21 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    //! Signature hash data shared by the checks of all inputs of ptxTo, may be empty
+    boost::shared_ptr<const CPrecomputedTransactionData> txdata;
 
 public:
     CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn,
+                 const boost::shared_ptr<const CPrecomputedTransactionData>& txdataIn = boost::shared_ptr<const CPrecomputedTransactionData>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
+        txdata.swap(check.txdata);
         std::swap(ptxTo, check.ptxTo);
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
@@ -545,6 +603,31 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the coin database below pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Transaction index positions of one connected block, kept in memory until the next flush */
+typedef std::map<uint256, CDiskTxPos> CTxIndexLayer;
+
+/**
+ * Read-only state of the chain pinned at one best block, so RPC threads can
+ * query the coins and the transaction index without taking cs_main.
+ */
+struct CChainStateSnapshot
+{
+    boost::shared_ptr<CCoinsViewSnapshot> pcoins;
+    boost::shared_ptr<const CLevelDBSnapshot> pblocktree;
+    //! Transaction index positions not yet in pblocktree, the newest block last
+    std::vector<boost::shared_ptr<const CTxIndexLayer> > vTxIndexLayers;
+
+    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) const;
+};
+
+/** Fetch the latest chain state snapshot, false if there is none (e.g. during initial block download) */
+bool GetChainStateSnapshot(CChainStateSnapshot &snapshot);
+/** Drop the published chain state snapshot, must be called before the databases are closed */
+void ResetChainStateSnapshot();
+
 struct CBlockTemplate
 {
     CBlock block;
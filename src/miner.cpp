@@ -11,6 +11,8 @@
 
 #include "miner.h"
 
+#include <algorithm>
+#include <limits>
 #include <string>
 
 #include "amount.h"
@@ -31,8 +33,8 @@
 
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #include <boost/unordered_map.hpp>
 
 //! Used to initialize the scrypt mining hash buffers
@@ -43,63 +45,89 @@ using namespace std;
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
+/** Minimum seconds between two rebuilds of the block template for fees the cached one had to leave out */
+const int64_t TEMPLATE_REBUILD_INTERVAL = 5;
+
+CBlockTemplateCache blockTemplateCache;
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // AnoncoinMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+// We want to sort transactions by priority, so:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
-    }
-
-    void print() const
-    {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, FeePerKb=%d)\n",
-               ptx->GetHash().ToString(), dPriority, feeRate.GetFeePerK());
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+/**
+ * Add one mempool transaction to the block if it fits and its inputs are
+ * available in the block's view, which means its in-pool parents are already
+ * in the block.
+ */
+static bool AddToBlock(CBlockAssembly& assembly, CTxMemPool::txiter iter)
 {
-    bool byFee;
+    const CTransaction& tx = iter->GetTx();
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    // Size limits
+    unsigned int nTxSize = iter->GetTxSize();
+    if (assembly.nBlockSize + nTxSize >= assembly.nBlockMaxSize)
+        return false;
+
+    if (!IsFinalTx(tx, assembly.nHeight))
+        return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (assembly.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    CCoinsViewCache& view = *assembly.pview;
+    if (!view.HaveInputs(tx))
+        return false;
+
+    nTxSigOps += GetP2SHSigOpCount(tx, view);
+    if (assembly.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    CValidationState state;
+    if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, true))
+        return false;
+
+    UpdateCoins(tx, state, view, assembly.nHeight);
+
+    // Added
+    CBlockTemplate* pblocktemplate = assembly.pblocktemplate;
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    assembly.nBlockSize += nTxSize;
+    ++assembly.nBlockTx;
+    assembly.nBlockSigOps += nTxSigOps;
+    assembly.nFees += iter->GetFee();
+    assembly.inBlock.insert(iter);
+    return true;
+}
+
+/** Orders a package so that parents come before their children */
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
     }
 };
 
@@ -108,12 +136,51 @@ void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+CBlockTemplateCache::CBlockTemplateCache() :
+    pindexPrev(NULL), nTransactionsUpdatedLast(0), nBlockMinSize(0),
+    nFeesForgone(0), nTimeRebuilt(0), nRebuilds(0), nExtends(0)
 {
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
+    assembly.pblocktemplate = NULL;
+    assembly.pview = NULL;
+}
+
+CBlockTemplateCache::~CBlockTemplateCache()
+{
+}
+
+void CBlockTemplateCache::Clear()
+{
+    LOCK(cs);
+    pindexPrev = NULL;
+    vPending.clear();
+    assembly.inBlock.clear();
+    assembly.pblocktemplate = NULL;
+    assembly.pview = NULL;
+    ptemplate.reset();
+    pview.reset();
+}
+
+void CBlockTemplateCache::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    // Transactions found in a block come with a new tip, which rebuilds anyway
+    if (pblock)
+        return;
+    LOCK(cs);
+    if (ptemplate)
+        vPending.push_back(tx.GetHash());
+}
+
+void CBlockTemplateCache::Rebuild(CBlockIndex* pindexPrevIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    AssertLockHeld(cs);
+
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Anything thrown from here on leaves the cache empty
+    Clear();
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
     CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
     // -regtest only: allow overriding block.nVersion with
@@ -122,14 +189,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     if( RegTest() )
         pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-
-    // Add dummy coinbase tx as first transaction
+    // Add dummy coinbase tx as first transaction, Get() fills in the real one
     pblock->vtx.push_back(CTransaction());
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
@@ -146,234 +206,272 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
     // Collect memory pool transactions into the block
-    CAmount nFees = 0;
-
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);                    // Create an empty coin cache view, based on the main pcoinsTip cache
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
+    const int nHeight = pindexPrevIn->nHeight + 1;
+    boost::scoped_ptr<CCoinsViewCache> pviewNew(new CCoinsViewCache(pcoinsTip)); // Create an empty coin cache view, based on the main pcoinsTip cache
+
+    assembly.pblocktemplate = pblocktemplate.get();
+    assembly.pview = pviewNew.get();
+    assembly.nHeight = nHeight;
+    assembly.nBlockMaxSize = nBlockMaxSize;
+    assembly.nBlockSize = 1000;
+    assembly.nBlockTx = 0;
+    assembly.nBlockSigOps = 100;
+    assembly.nFees = 0;
+    bool fPrintPriority = GetBoolArg("-printpriority", false);
+
+    // The priority part of the block is filled from a heap of the
+    // priorities the entries cached when they entered the pool. A
+    // transaction whose parents are not in the block yet waits in
+    // waitPriMap until the last of them is added.
+    vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+    bool fPriorityBlock = nBlockPrioritySize > 0;
+    if (fPriorityBlock) {
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
              mi != mempool.mapTx.end(); ++mi)
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+    }
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    while (fPriorityBlock && !vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().first;
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
 
-                int nConf = nHeight - coins->nHeight;
+        if (assembly.inBlock.count(iter))
+            continue;
 
-                dPriority += (double)nValueIn * nConf;
+        bool fWaitForParents = false;
+        BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
+        {
+            if (!assembly.inBlock.count(parent)) {
+                fWaitForParents = true;
+                break;
             }
-            if (fMissingInputs) continue;
+        }
+        if (fWaitForParents) {
+            waitPriMap.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+        // Switch to ordering by fee once past the priority size or we run
+        // out of high-priority transactions
+        if (assembly.nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        if (!AddToBlock(assembly, iter))
+            continue;
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+        if (fPrintPriority)
+        {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+        }
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+        {
+            waitPriIter wpiter = waitPriMap.find(child);
+            if (wpiter != waitPriMap.end()) {
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                waitPriMap.erase(wpiter);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
+    }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+    // The rest of the block is filled by ancestor score, each transaction
+    // going in together with whatever of its in-pool ancestors the block
+    // does not have yet.
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi)
+    {
+        CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+        if (assembly.inBlock.count(iter))
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        CAmount nPackageFees = mi->GetModFeesWithAncestors();
+        uint64_t nPackageSize = mi->GetSizeWithAncestors();
+        if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && assembly.nBlockSize >= nBlockMinSize)
+            continue;
+        if (assembly.nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+            continue;
+
+        CTxMemPool::setEntries setAncestors;
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+        std::vector<CTxMemPool::txiter> vPackage;
+        BOOST_FOREACH(CTxMemPool::txiter ancestor, setAncestors)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            if (!assembly.inBlock.count(ancestor))
+                vPackage.push_back(ancestor);
+        }
+        vPackage.push_back(iter);
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+        BOOST_FOREACH(CTxMemPool::txiter packageIt, vPackage)
+        {
+            // A child whose parent did not make it fails on its inputs
+            if (!AddToBlock(assembly, packageIt))
                 continue;
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+            if (fPrintPriority)
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                LogPrintf("fee %s txid %s\n",
+                    CFeeRate(packageIt->GetModifiedFee(), packageIt->GetTxSize()).ToString(), packageIt->GetTx().GetHash().ToString());
             }
+        }
+    }
 
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, true))
-                continue;
 
-            UpdateCoins(tx, state, view, nHeight);
+    // Test the block with a coinbase paying everything to OP_TRUE, Get()
+    // only swaps in the real output script and refreshes the header.
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txNew.vout[0].nValue = ancConsensus.GetBlockValue(nHeight, assembly.nFees);
+    pblock->vtx[0] = txNew;
+
+    // Fill in header
+    // Make sure it places the sha256d hash of the previous block into this new one.
+    pblock->hashPrevBlock  = pindexPrevIn->GetBlockSha256dHash();
+    UpdateTime(pblock, pindexPrevIn);
+    pblock->nBits          = ancConsensus.GetNextWorkRequired(pindexPrevIn, pblock);
+    pblock->nNonce         = 0;
+
+    if (nHeight >= ancConsensus.nDifficultySwitchHeight6)
+    {
+        pblock->nVersion = 3;
+    } else {
+        pblock->nVersion = 2;
+    }
+    // Always set height locally
+    pblock->nHeight = nHeight;
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    //! Force both hash calculations to be updated before validity testing the block
+    assert( pblock->GetHash() != uint256(0) );
+    assert( pblock->CalcSha256dHash() != uintFakeHash(0) );
+    assert( pblock->GetGost3411Hash() != uint256(0) );
+    CValidationState state;
+    if (!TestBlockValidity(state, *pblock, pindexPrevIn, false, false))
+        throw std::runtime_error("CreateNewBlock() : TestBlockValidity failed");
+
+    ptemplate.swap(pblocktemplate);
+    pview.swap(pviewNew);
+    pindexPrev = pindexPrevIn;
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    nFeesForgone = 0;
+    nTimeRebuilt = GetTime();
+    nRebuilds++;
+
+    LogPrint("bench", "    - Block template rebuilt: %u txs, %u bytes, %.2fms (%u rebuilds, %u extends)\n",
+        assembly.nBlockTx, assembly.nBlockSize, 0.001 * (GetTimeMicros() - nTimeStart), nRebuilds, nExtends);
+}
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+bool CBlockTemplateCache::Extend()
+{
+    AssertLockHeld(mempool.cs);
+    AssertLockHeld(cs);
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+    // Every change to the pool bumps its counter, so if the pool saw more
+    // than the arrivals we were told about, something left it and the
+    // entries the template refers to may be gone.
+    if (mempool.GetTransactionsUpdated() - nTransactionsUpdatedLast != vPending.size())
+        return false;
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        //LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Compute final coinbase transaction.
-        txNew.vout[0].nValue = ancConsensus.GetBlockValue(nHeight, nFees);
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
-
-        // Fill in header
-        // Make sure it places the sha256d hash of the previous block into this new one.
-        pblock->hashPrevBlock  = pindexPrev->GetBlockSha256dHash();
-        UpdateTime(pblock, pindexPrev);
-        pblock->nBits          = ancConsensus.GetNextWorkRequired(pindexPrev, pblock);
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-
-        if (nHeight >= ancConsensus.nDifficultySwitchHeight6)
+    BOOST_FOREACH(const uint256& hash, vPending)
+    {
+        CTxMemPool::txiter iter = mempool.mapTx.find(hash);
+        if (iter == mempool.mapTx.end() || assembly.inBlock.count(iter))
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        if (iter->GetModFeesWithAncestors() < ::minRelayTxFee.GetFee(iter->GetSizeWithAncestors()) && assembly.nBlockSize >= nBlockMinSize)
+            continue;
+
+        // A transaction whose parents were left out, or that does not fit,
+        // waits for the next rebuild
+        bool fParentsInBlock = true;
+        BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
         {
-            pblock->nVersion = 3;
-        } else {
-            pblock->nVersion = 2;
+            if (!assembly.inBlock.count(parent)) {
+                fParentsInBlock = false;
+                break;
+            }
         }
-        // Always set height locally
-        pblock->nHeight = nHeight;
-
-        //! Force both hash calculations to be updated before validity testing the block
-        assert( pblock->GetHash() != uint256(0) );
-        assert( pblock->CalcSha256dHash() != uintFakeHash(0) );
-        assert( pblock->GetGost3411Hash() != uint256(0) );
-        CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
-            throw std::runtime_error("CreateNewBlock() : TestBlockValidity failed");
+        if (!fParentsInBlock || !AddToBlock(assembly, iter))
+            nFeesForgone += iter->GetModifiedFee();
     }
+    nTransactionsUpdatedLast += vPending.size();
+    vPending.clear();
+    nExtends++;
+    return true;
+}
+
+CBlockTemplate* CBlockTemplateCache::Get(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    LOCK(cs);
+
+    CBlockIndex* pindexPrevNew = chainActive.Tip();
+    if (!ptemplate || pindexPrev != pindexPrevNew || !Extend() ||
+        (nFeesForgone > 0 && GetTime() - nTimeRebuilt >= TEMPLATE_REBUILD_INTERVAL))
+        Rebuild(pindexPrevNew);
+
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate(*ptemplate));
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+    const int nHeight = assembly.nHeight;
+    CAmount nFees = assembly.nFees;
+
+    nLastBlockTx = assembly.nBlockTx;
+    nLastBlockSize = assembly.nBlockSize;
+
+    // Compute final coinbase transaction.
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = ancConsensus.GetBlockValue(nHeight, nFees);
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -nFees;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    // The work required follows the block time, so both are refreshed
+    UpdateTime(pblock, pindexPrevNew);
+    pblock->nBits = ancConsensus.GetNextWorkRequired(pindexPrevNew, pblock);
 
     return pblocktemplate.release();
 }
 
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    return blockTemplateCache.Get(scriptPubKeyIn);
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -714,16 +812,124 @@ double GetSlowMiningKHPS()
     return dResult;
 }
 
+/**
+ * The internal miner threads share one block template. A producer thread
+ * assembles it when the tip changes, or when the memory pool has changed and
+ * the template is 36 seconds old, and publishes it as an immutable snapshot.
+ * The hashing threads only take cs_minerwork to look for a newer snapshot,
+ * never cs_main, and each one hashes its own extranonce range.
+ */
+struct CMinerWork
+{
+    //! Increases with every snapshot published
+    uint64_t nGeneration;
+    boost::shared_ptr<const CBlockTemplate> ptemplate;
+    const CBlockIndex* pindexPrev;
+    //! Block time and work required, refreshed without assembling a new template
+    uint32_t nTime;
+    uint32_t nBits;
+    //! Set when the producer gave up, the hashing threads then stop too
+    bool fFailed;
+
+    CMinerWork() : nGeneration(0), pindexPrev(NULL), nTime(0), nBits(0), fFailed(false) {}
+};
+
+static CCriticalSection cs_minerwork;
+static CMinerWork minerWork;
+//! The coinbase key of the shared template, taken by the producer and by the thread that finds a block
+static CCriticalSection cs_minerkey;
+static boost::scoped_ptr<CReserveKey> pMinerReserveKey;
+
+static void PublishMinerWork(const CMinerWork& work)
+{
+    LOCK(cs_minerwork);
+    uint64_t nGeneration = minerWork.nGeneration;
+    minerWork = work;
+    minerWork.nGeneration = nGeneration + 1;
+}
+
+//! Copy the published snapshot into work if it is newer than the generation given
+static bool GetMinerWork(CMinerWork& work, uint64_t nGeneration)
+{
+    LOCK(cs_minerwork);
+    if (minerWork.nGeneration == nGeneration)
+        return false;
+    work = minerWork;
+    return true;
+}
+
+void static AnoncoinMinerTemplates()
+{
+    RenameThread("anoncoin-minetmpl");
+
+    CMinerWork work;
+    unsigned int nTransactionsUpdatedLast = 0;
+    int64_t nStart = 0;
+
+    try {
+        while (true) {
+            {
+                // Sleep until a new block arrives, or at most a second to keep the block time current
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                if (work.ptemplate && work.pindexPrev == chainActive.Tip())
+                    cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+            }
+            boost::this_thread::interruption_point();
+
+            if (!work.ptemplate || work.pindexPrev != chainActive.Tip() ||
+                (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 36))
+            {
+                nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+                nStart = GetTime();
+                {
+                    LOCK2(cs_minerkey, cs_main);
+                    work.pindexPrev = chainActive.Tip();
+                    work.ptemplate.reset(CreateNewBlockWithKey(*pMinerReserveKey));
+                }
+                if (!work.ptemplate) {
+                    LogPrintf("%s : ERROR - Keypool ran out, please refill before restarting.\n", __func__ );
+                    work.fFailed = true;
+                    PublishMinerWork(work);
+                    return;
+                }
+                work.nTime = work.ptemplate->block.nTime;
+                work.nBits = work.ptemplate->block.nBits;
+                PublishMinerWork(work);
+                continue;
+            }
+
+            //! Changing the block time effects the work required for Anoncoin if the blockheader time is used for PID calculations,
+            //! so both are updated here for all the threads at once.
+            CBlockHeader header = work.ptemplate->block.GetBlockHeader();
+            UpdateTime(&header, work.pindexPrev);
+            header.nBits = ancConsensus.GetNextWorkRequired(work.pindexPrev, &header);
+            if (header.nTime != work.nTime || header.nBits != work.nBits) {
+                work.nTime = header.nTime;
+                work.nBits = header.nBits;
+                PublishMinerWork(work);
+            }
+        }
+    }
+    catch (const boost::thread_interrupted&)
+    {
+        LogPrintf("%s : terminated.\n", __func__ );
+        throw;
+    }
+    catch (const std::runtime_error &e)
+    {
+        LogPrintf("%s : runtime error: %s\n", __func__, e.what());
+        work.ptemplate.reset();
+        work.fFailed = true;
+        PublishMinerWork(work);
+    }
+}
+
 void static AnoncoinMiner(CWallet *pwallet)
 {
     LogPrintf("%s : v3.0 for Scrypt/GOST3411 started with (DDA) Dynamic Difficulty Awareness and (MTHM) Multi-Threaded HashMeter technologies.\n", __func__ );
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("anoncoin-miner");
 
-    //! Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    uint32_t nExtraNonce = 0;
-
     //! Create a new Hash meter for this thread, destruction handled automatically
     uint8_t nMyID;
     {
@@ -743,6 +949,11 @@ void static AnoncoinMiner(CWallet *pwallet)
         // return;
     //}
 
+    //! All threads share the template, the top byte of the extranonce keeps their coinbases apart
+    const uint32_t nExtraNonceBase = (uint32_t)nMyID << 24;
+    CMinerWork work;
+    boost::shared_ptr<const CBlockTemplate> ptemplateMine;
+
     try {
         while (true) {
             /*if (!RegTest()) {
@@ -753,19 +964,24 @@ void static AnoncoinMiner(CWallet *pwallet)
             }*/
 
             /**
-             * Create new block
+             * Pick up the shared block template
              */
-            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-
-            auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-            if (!pblocktemplate.get())
-            {
-                LogPrintf("%s %2d: ERROR - Keypool ran out, please refill before restarting.\n", __func__, nMyID );
+            GetMinerWork(work, work.nGeneration);
+            if (work.fFailed) {
+                LogPrintf("%s %2d: no block template to work on, stopping.\n", __func__, nMyID );
                 return;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            if (!work.ptemplate || work.ptemplate == ptemplateMine) {
+                MilliSleep(100);
+                boost::this_thread::interruption_point();
+                continue;
+            }
+            ptemplateMine = work.ptemplate;
+            CBlock block(work.ptemplate->block);
+            CBlock *pblock = &block;
+            const CBlockIndex* pindexPrev = work.pindexPrev;
+            const int nHeight = pindexPrev->nHeight + 1;
+            uint32_t nExtraNonce = 0;
 
             //LogPrintf("%s %2d: Running with %u transactions in block (%u bytes)\n", __func__, nMyID, pblock->vtx.size(),
             //    ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -773,103 +989,121 @@ void static AnoncoinMiner(CWallet *pwallet)
             /**
              * Search
              */
-            int64_t nStart = GetTime();
-            uint256 hashTarget;
-            hashTarget.SetCompact(pblock->nBits);
-            std::string powHashType = "scrypt";
-            while( true ) {
-                bool fFound = false;
-                bool fAccepted = false;
-                uint16_t nHashesDone = 0;
-                uint256 thash;
-                //! Scan nonces looking for a solution
-                while(true) {
-                    if (pindexPrev->nHeight+1 >= ancConsensus.nDifficultySwitchHeight6)
-                    {
-                        thash = HashGOST(BEGIN(pblock->nVersion), END(pblock->nNonce));
-                        pblock->nVersion = 3;
-                        pblock->nHeight  = pindexPrev->nHeight+1;
-                        powHashType = "gost3411";
-                    } else {
-                        scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), spScratchPad.get());
-                        pblock->nVersion = 2;
+            bool fNewTemplate = false;
+            while( !fNewTemplate && nExtraNonce < 0xffffff ) {
+                //! Height first in coinbase required for block.version=2
+                CMutableTransaction txCoinbase(pblock->vtx[0]);
+                txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonceBase | ++nExtraNonce)) + COINBASE_FLAGS;
+                assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+                pblock->vtx[0] = txCoinbase;
+                pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+                pblock->nTime = work.nTime;
+                pblock->nBits = work.nBits;
+                pblock->nNonce = 0;
+
+                uint256 hashTarget;
+                hashTarget.SetCompact(pblock->nBits);
+                std::string powHashType = "scrypt";
+                while( true ) {
+                    bool fFound = false;
+                    bool fAccepted = false;
+                    uint16_t nHashesDone = 0;
+                    uint256 thash;
+                    //! Scan nonces looking for a solution
+                    while(true) {
+                        if (nHeight >= ancConsensus.nDifficultySwitchHeight6)
+                        {
+                            thash = HashGOST(BEGIN(pblock->nVersion), END(pblock->nNonce));
+                            pblock->nVersion = 3;
+                            pblock->nHeight  = nHeight;
+                            powHashType = "gost3411";
+                        } else {
+                            scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), spScratchPad.get());
+                            pblock->nVersion = 2;
+                        }
+                        nHashesDone++;
+                        if( thash <= hashTarget ) {
+                            fFound = true;
+                            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                            //! Found a solution
+                            //! Force new proof-of-work block scrypt hash and the sha256d hash values to be calculated.
+                            //! Calling GetHash() & CalcSha256dHash() with true invalidates any previous (and obsolete) ones.
+                            assert( thash == pblock->GetHash() );
+                            //! Basically this next line does the Scrypt calculation again once, then all the normal
+                            //! validation code kicks in from the call to ProcessBlockFound(), insuring that is the case...
+                            assert( pblock->CalcSha256dHash() != uintFakeHash(0) );
+                            LogPrintf("%s %2d:\n", __func__, nMyID );
+                            LogPrintf("proof-of-work found (%s)  \n  hash: %s  \ntarget: %s\n", powHashType.c_str(), thash.GetHex(), hashTarget.GetHex());
+                            {
+                                LOCK(cs_minerkey);
+                                fAccepted = ProcessBlockFound(pblock, *pwallet, *pMinerReserveKey);
+                            }
+                            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+                            //! In regression test mode, stop mining after a block is found.
+                            if( RegTest() )
+                                throw boost::thread_interrupted();
+                            break;
+                        }
+                        pblock->nNonce++;
+                        //! In this inner loop, we calculate 256 hashes, if none are found, we'll try updating some other factors
+                        if( (pblock->nNonce & 0xFF) == 0 )
+                            break;
+                    }
+
+                    //!
+                    //if( fFound ) {
+                        //if( !fAccepted )
+                        //break;
+                    //}
+
+                    //! Meter hashes/sec production, UpdateFastCounter starts returning true if its time to log results (10 sec.)
+                    if( spMyMeter->UpdateFastCounter(nHashesDone) ) {
+                        //! If lock fails, its no big deal, we'll try again next time, the meter update is fast & keeps accumulating...
+                        TRY_LOCK(cs_hashmeter, lockedmeter);
+                        if( lockedmeter ) {
+                            //! Once we have the meter locked we first update our meter results, 'then' the 10 sec summary mru.
+                            bool fUpdateLog = spMyMeter->UpdateAccumulations();
+                            //! Now we store the whole hash meter as another (most recent) data point in the short term sample buffer,
+                            //! its new start time, becomes our final timestamp and can be used outside this thread anytime in the future.
+                            mruFastReadings.insert( *spMyMeter );
+                            //! If it turns out that the 10 minute log update needs to be done, we update that and report it and other stuff as well, otherwise we're done.
+                            if( fUpdateLog ) {
+                                //! Again before saving the sample, we make sure the timestamp is updated and the meters log fields reset for another interval,
+                                //! this call returns the logged HashesPermilliSec, so the value is correct for KiloHashes per second already...cool
+                                double dKiloHashesPerSec = spMyMeter->RestartSlowCounter();
+                                //! Store the whole hash meter as another data point in the long term sample buffer, and report that to the log.
+                                mruSlowReadings.insert( *spMyMeter );
+                                LogPrintf("%s %2d: reporting new 10 min sample update of %6.3f KHashes/Sec.\n", __func__, nMyID, dKiloHashesPerSec );
+                            }
+                        }
                     }
-                    nHashesDone++;
-                    if( thash <= hashTarget ) {
-                        fFound = true;
-                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                        //! Found a solution
-                        //! Force new proof-of-work block scrypt hash and the sha256d hash values to be calculated.
-                        //! Calling GetHash() & CalcSha256dHash() with true invalidates any previous (and obsolete) ones.
-                        assert( thash == pblock->GetHash() );
-                        //! Basically this next line does the Scrypt calculation again once, then all the normal
-                        //! validation code kicks in from the call to ProcessBlockFound(), insuring that is the case...
-                        assert( pblock->CalcSha256dHash() != uintFakeHash(0) );
-                        LogPrintf("%s %2d:\n", __func__, nMyID );
-                        LogPrintf("proof-of-work found (%s)  \n  hash: %s  \ntarget: %s\n", powHashType.c_str(), thash.GetHex(), hashTarget.GetHex());
-                        fAccepted = ProcessBlockFound(pblock, *pwallet, reservekey);
-                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
-
-                        //! In regression test mode, stop mining after a block is found.
-                        if( RegTest() )
-                            throw boost::thread_interrupted();
+                    //! Check for stop or if block needs to be rebuilt
+                    boost::this_thread::interruption_point();
+                    //! If there are no peers we terminate the miner... except for RegTests
+                    if( vNodes.empty() && !RegTest() )
+                        break;
+                    //! A block was found, wait for the template on top of it
+                    if( fFound ) {
+                        fNewTemplate = true;
                         break;
                     }
-                    pblock->nNonce++;
-                    //! In this inner loop, we calculate 256 hashes, if none are found, we'll try updating some other factors
-                    if( (pblock->nNonce & 0xFF) == 0 )
+                    //! Having processed more than 65K hashes means moving on to our next extranonce
+                    if( pblock->nNonce >= 0xffff0000 )
                         break;
-                }
-
-                //!
-                //if( fFound ) {
-                    //if( !fAccepted )
-                    //break;
-                //}
-
-                //! Meter hashes/sec production, UpdateFastCounter starts returning true if its time to log results (10 sec.)
-                if( spMyMeter->UpdateFastCounter(nHashesDone) ) {
-                    //! If lock fails, its no big deal, we'll try again next time, the meter update is fast & keeps accumulating...
-                    TRY_LOCK(cs_hashmeter, lockedmeter);
-                    if( lockedmeter ) {
-                        //! Once we have the meter locked we first update our meter results, 'then' the 10 sec summary mru.
-                        bool fUpdateLog = spMyMeter->UpdateAccumulations();
-                        //! Now we store the whole hash meter as another (most recent) data point in the short term sample buffer,
-                        //! its new start time, becomes our final timestamp and can be used outside this thread anytime in the future.
-                        mruFastReadings.insert( *spMyMeter );
-                        //! If it turns out that the 10 minute log update needs to be done, we update that and report it and other stuff as well, otherwise we're done.
-                        if( fUpdateLog ) {
-                            //! Again before saving the sample, we make sure the timestamp is updated and the meters log fields reset for another interval,
-                            //! this call returns the logged HashesPermilliSec, so the value is correct for KiloHashes per second already...cool
-                            double dKiloHashesPerSec = spMyMeter->RestartSlowCounter();
-                            //! Store the whole hash meter as another data point in the long term sample buffer, and report that to the log.
-                            mruSlowReadings.insert( *spMyMeter );
-                            LogPrintf("%s %2d: reporting new 10 min sample update of %6.3f KHashes/Sec.\n", __func__, nMyID, dKiloHashesPerSec );
+                    //! The producer published a new snapshot, either a new template or a new block time and
+                    //! difficulty for the one we are working on
+                    if( GetMinerWork(work, work.nGeneration) ) {
+                        if( work.fFailed || work.ptemplate != ptemplateMine ) {
+                            fNewTemplate = true;
+                            break;
                         }
+                        pblock->nTime = work.nTime;
+                        pblock->nBits = work.nBits;
+                        hashTarget.SetCompact(pblock->nBits);
                     }
-                }
-                //! Check for stop or if block needs to be rebuilt
-                boost::this_thread::interruption_point();
-                //! If there are no peers we terminate the miner... except for RegTests
-                if( vNodes.empty() && !RegTest() )
-                    break;
-                //! Having processed more than 65K hashes means updating would be a good idea...
-                if( pblock->nNonce >= 0xffff0000 )
-                    break;
-                //! Checks for transaction changes happen at least 5 times over the coarse of one nTargetSpacing interval
-                if( mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 36 )
-                    break;
-                //! If the previous block has changed, we must as well...
-                if (pindexPrev != chainActive.Tip())
-                    break;
-
-                //! Update nTime and difficulty required (if needed) every so often
-                //! Changing pblock->nTime effects the work required for Anoncoin if the blockheader time is used for PID calculations,
-                //! otherwise it does not.  No older generation of the NextWorkRequired will be effected by time change.
-                UpdateTime(pblock, pindexPrev);
-                pblock->nBits = ancConsensus.GetNextWorkRequired(pindexPrev, pblock);
-                hashTarget.SetCompact(pblock->nBits);
-            } // Looping forever while true and no nonce overflow, transactions updated or new blocks arrived
+                } // Looping forever while true and no nonce overflow, transactions updated or new blocks arrived
+            } // Looping over our extranonce range
         } // Looping forever while true in this thread
     } // try, errors caught and logged before terminating
     catch (const boost::thread_interrupted&)
@@ -899,6 +1133,7 @@ void GenerateAnoncoins(bool fGenerate, CWallet* pwallet, int nThreads)
     if (minerThreads != NULL)
     {
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
     }
@@ -909,6 +1144,13 @@ void GenerateAnoncoins(bool fGenerate, CWallet* pwallet, int nThreads)
         mruFastReadings.clear();
     }
 
+    //! With the threads gone, return an unused coinbase key to the pool and forget their template
+    {
+        LOCK(cs_minerkey);
+        pMinerReserveKey.reset();
+    }
+    PublishMinerWork(CMinerWork());
+
     if (nThreads == 0 || !fGenerate) {
         nMiningStoppedTime = GetTime();
         return;
@@ -923,7 +1165,12 @@ void GenerateAnoncoins(bool fGenerate, CWallet* pwallet, int nThreads)
     nLastRunThreadCount = nThreads;
     nMiningStoppedTime = 0;
 
+    {
+        LOCK(cs_minerkey);
+        pMinerReserveKey.reset(new CReserveKey(pwallet));
+    }
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(&AnoncoinMinerTemplates);
     for (int i = 0; i < nThreads; i++)
         minerThreads->create_thread(boost::bind(&AnoncoinMiner, pwallet));
 }
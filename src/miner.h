@@ -7,11 +7,19 @@
 #ifndef ANONCOIN_MINER_H
 #define ANONCOIN_MINER_H
 
+#include "main.h"
+#include "sync.h"
+#include "txmempool.h"
+
 #include <stdint.h>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
 
 class CBlock;
 class CBlockHeader;
 class CBlockIndex;
+class CCoinsViewCache;
 class CReserveKey;
 class CScript;
 class CWallet;
@@ -21,6 +29,66 @@ struct CBlockTemplate;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 
+/** Minimum seconds between two rebuilds of the block template for fees the cached one had to leave out */
+extern const int64_t TEMPLATE_REBUILD_INTERVAL;
+
+/** Running totals of a block template while transactions are added to it */
+struct CBlockAssembly
+{
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache* pview;
+    int nHeight;
+    unsigned int nBlockMaxSize;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+};
+
+/**
+ * Keeps the block template of the current tip between calls. Transactions
+ * accepted to the memory pool are appended to it as they arrive, so serving a
+ * template only costs a copy. The template is assembled again from the whole
+ * pool when the tip changes, when anything leaves the pool, or when fees had
+ * to be left out and the last rebuild is TEMPLATE_REBUILD_INTERVAL old.
+ */
+class CBlockTemplateCache : public CValidationInterface
+{
+private:
+    mutable CCriticalSection cs;
+    const CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    //! Transactions accepted to the pool since the template was last updated
+    std::vector<uint256> vPending;
+    boost::scoped_ptr<CBlockTemplate> ptemplate;
+    boost::scoped_ptr<CCoinsViewCache> pview;
+    CBlockAssembly assembly;
+    unsigned int nBlockMinSize;
+    //! Fees of pending transactions that could not be appended
+    CAmount nFeesForgone;
+    int64_t nTimeRebuilt;
+    uint64_t nRebuilds;
+    uint64_t nExtends;
+
+    void Rebuild(CBlockIndex* pindexPrevIn);
+    bool Extend();
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+public:
+    CBlockTemplateCache();
+    ~CBlockTemplateCache();
+
+    /** Return a new block on the current tip paying to scriptPubKeyIn, without valid proof-of-work */
+    CBlockTemplate* Get(const CScript& scriptPubKeyIn);
+    /** Drop the cached template, the next call to Get() assembles a new one */
+    void Clear();
+};
+
+extern CBlockTemplateCache blockTemplateCache;
+
 struct HashMeterStats
 {
     uint8_t nIDsReporting;
@@ -8,8 +8,11 @@
 // anoncoin-config.h loaded...
 
 #include "checkpoints.h"
+#include "checkqueue.h"
+#include "coinstats.h"
 #include "main.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include "chainparams.h"
@@ -180,6 +183,12 @@ Value getrawmempool(const Array& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) modified fees (see above) of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -200,10 +209,9 @@ Value getrawmempool(const Array& params, bool fHelp)
     {
         LOCK(mempool.cs);
         Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             Object info;
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -211,6 +219,12 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -308,8 +322,6 @@ Value getblock(const Array& params, bool fHelp)
             + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
-    LOCK(cs_main);
-
     uintFakeHash GivenHash;
     GivenHash.SetHex(params[0].get_str());
     //! Allow the user to enter either the real block hash value or the sha256d hash,
@@ -321,12 +333,17 @@ Value getblock(const Array& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(GivenHash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[GivenHash];
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(GivenHash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+    }
 
+    // Block index entries are never freed, the disk read does not need cs_main
     if(!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -338,16 +355,20 @@ Value getblock(const Array& params, bool fHelp)
         return strHex;
     }
 
+    LOCK(cs_main);
     return blockToJSON(block, pblockindex);
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( recompute )\n"
             "\n Returns statistics about the unspent transaction output set.\n"
-            " Note this call may take some time.\n"
+            " The first call walks the whole set and may take some time, later calls are served\n"
+            " from statistics which are kept up to date as blocks are connected and disconnected.\n"
+            "\nArguments:\n"
+            "1. recompute                (boolean, optional, default=false) Walk the whole set again\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,                (numeric) The current block height (index)\n"
@@ -355,32 +376,117 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             "  \"transactions\": n,         (numeric) The number of transactions\n"
             "  \"txouts\": n,               (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,     (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\", (string) The serialized hash\n"
+            "  \"utxo_checksum\": \"hash\", (string) Order independent checksum of all unspent outputs, not collision resistant\n"
             "  \"total_amount\": x.xxx      (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
-    LOCK(cs_main);
+    bool fRecompute = false;
+    if (params.size() > 0)
+        fRecompute = params[0].get_bool();
 
     Object ret;
 
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
+    if (coinsStatsEngine.GetStats(stats, fRecompute)) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("utxo_checksum", stats.hashChecksum.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
 }
 
+/** Look up the unspent outputs of a transaction in pview, optionally with the memory pool on top */
+static bool GetUnspentCoins(CCoinsView *pview, const uint256 &hash, bool fMempool, CCoins &coins)
+{
+    if (fMempool) {
+        LOCK(mempool.cs);
+        CCoinsViewMemPool view(pview, mempool);
+        if (!view.GetCoins(hash, coins))
+            return false;
+        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        return true;
+    }
+    return pview->GetCoins(hash, coins);
+}
+
+static Object LevelDBStatsToJSON(const CLevelDBWrapper& db)
+{
+    Object result;
+    const CLevelDBOptions& dbOptions = db.GetDbOptions();
+    Object options;
+    options.push_back(Pair("blockcache", (uint64_t)dbOptions.nBlockCacheSize));
+    options.push_back(Pair("writebuffer", (uint64_t)dbOptions.nWriteBufferSize));
+    options.push_back(Pair("bloombits", dbOptions.nBloomBits));
+    options.push_back(Pair("maxopenfiles", dbOptions.nMaxOpenFiles));
+    result.push_back(Pair("options", options));
+
+    std::vector<uint64_t> vSizes;
+    db.GetApproximateSizes(vSizes);
+    uint64_t nTotal = 0;
+    Object sizes;
+    for (unsigned int i = 0; i < vSizes.size(); i++) {
+        if (!vSizes[i])
+            continue;
+        nTotal += vSizes[i];
+        std::string strPrefix = isprint(i) ? std::string(1, (char)i) : strprintf("0x%02x", i);
+        sizes.push_back(Pair(strPrefix, vSizes[i]));
+    }
+    result.push_back(Pair("approximate_size", nTotal));
+    result.push_back(Pair("prefix_sizes", sizes));
+    result.push_back(Pair("sstables", db.GetProperty("leveldb.sstables")));
+    result.push_back(Pair("stats", db.GetProperty("leveldb.stats")));
+    return result;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns the LevelDB options and internal statistics of the chainstate and block index databases.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\" : {            (json object) The coin database\n"
+            "    \"options\" : {             (json object) The LevelDB tunables in use\n"
+            "      \"blockcache\" : n,        (numeric) Block cache size in bytes\n"
+            "      \"writebuffer\" : n,       (numeric) Write buffer size in bytes\n"
+            "      \"bloombits\" : n,         (numeric) Bloom filter bits per key, 0 if disabled\n"
+            "      \"maxopenfiles\" : n,      (numeric) Maximum number of open table files\n"
+            "    },\n"
+            "    \"approximate_size\" : n,   (numeric) Approximate size on disk in bytes\n"
+            "    \"prefix_sizes\" : {        (json object) Approximate size on disk by first key byte\n"
+            "      \"c\" : n,\n"
+            "      ...\n"
+            "    },\n"
+            "    \"sstables\" : \"...\",     (string) The leveldb.sstables property\n"
+            "    \"stats\" : \"...\"         (string) The leveldb.stats property\n"
+            "  },\n"
+            "  \"blockindex\" : { ... }      (json object) The block index database, as above\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    // The databases are only swapped out under cs_main, reading them is thread safe
+    LOCK(cs_main);
+    Object result;
+    if (pcoinsdbview)
+        result.push_back(Pair("chainstate", LevelDBStatsToJSON(pcoinsdbview->GetDB())));
+    if (pblocktree)
+        result.push_back(Pair("blockindex", LevelDBStatsToJSON(*pblocktree)));
+    return result;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -419,8 +525,6 @@ Value gettxout(const Array& params, bool fHelp)
             + HelpExampleRpc("gettxout", "\"txid\", 1")
         );
 
-    LOCK(cs_main);
-
     Object ret;
 
     std::string strHash = params[0].get_str();
@@ -431,31 +535,36 @@ Value gettxout(const Array& params, bool fHelp)
         fMempool = params[2].get_bool();
 
     CCoins coins;
-    if (fMempool) {
-        LOCK(mempool.cs);
-        CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+    uint256 hashBestBlock;
+    int nBestHeight;
+    CChainStateSnapshot snapshot;
+    if (GetChainStateSnapshot(snapshot)) {
+        // Served from the published snapshot, no need to wait for cs_main
+        if (!GetUnspentCoins(snapshot.pcoins.get(), hash, fMempool, coins))
             return Value::null;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        hashBestBlock = snapshot.pcoins->GetBestBlock();
+        nBestHeight = snapshot.pcoins->GetBestHeight();
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        LOCK(cs_main);
+        if (!GetUnspentCoins(pcoinsTip, hash, fMempool, coins))
             return Value::null;
+        uint256 viewBestBlock = pcoinsTip->GetBestBlock();
+        BlockMap::iterator itBM = (viewBestBlock != 0) ? mapBlockIndex.find( viewBestBlock ) : mapBlockIndex.end();
+        if( itBM == mapBlockIndex.end() ) {
+            LogPrintf( "%s : pcoinsTip->GetBestBlock() returned:%s not setup correctly. Failed to finish steps...", __func__, viewBestBlock.ToString() );
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't find coin view best block");
+        }
+        hashBestBlock = itBM->second->GetBlockHash();
+        nBestHeight = itBM->second->nHeight;
     }
     if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
         return Value::null;
 
-    uint256 viewBestBlock = pcoinsTip->GetBestBlock();
-    BlockMap::iterator itBM = (viewBestBlock != 0) ? mapBlockIndex.find( viewBestBlock ) : mapBlockIndex.end();
-    if( itBM == mapBlockIndex.end() ) {
-        LogPrintf( "%s : pcoinsTip->GetBestBlock() returned:%s not setup correctly. Failed to finish steps...", __func__, viewBestBlock.ToString() );
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't find coin view best block");
-    }
-    CBlockIndex *pindex = itBM->second;
-    ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
+    ret.push_back(Pair("bestblock", hashBestBlock.GetHex()));
     if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
+        ret.push_back(Pair("confirmations", nBestHeight - coins.nHeight + 1));
     ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
     Object o;
     ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
@@ -652,6 +761,9 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx   (numeric) Current tx count\n"
             "  \"bytes\": xxxxx  (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx  (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx  (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx  (numeric) Minimum fee for tx to be accepted, in ANC/kB\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -661,6 +773,58 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+
+    return ret;
+}
+
+Value getscriptcheckinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getscriptcheckinfo\n"
+            "\nReturns counters of the parallel script verification of blocks.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": xxxxx        (numeric) Blocks verified in parallel since startup\n"
+            "  \"checks\": xxxxx        (numeric) Script checks done since startup\n"
+            "  \"lastchecks\": xxxxx    (numeric) Script checks of the last block\n"
+            "  \"lasttime\": xxxxx      (numeric) Microseconds from the first check queued for the last block to the last one done\n"
+            "  \"lastwaittime\": xxxxx  (numeric) Microseconds the block validating thread waited on the workers for the last block\n"
+            "  \"workers\": [          (array) The block validating thread first, then the script check threads\n"
+            "    {\n"
+            "      \"checks\": xxxxx    (numeric) Script checks done\n"
+            "      \"batches\": xxxxx   (numeric) Batches they were done in\n"
+            "      \"steals\": xxxxx    (numeric) Times it ran out of work and took over half of another worker's\n"
+            "      \"idletime\": xxxxx  (numeric) Microseconds spent waiting for work\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getscriptcheckinfo", "")
+            + HelpExampleRpc("getscriptcheckinfo", "")
+        );
+
+    CCheckQueueStats stats = GetScriptCheckStats();
+    Object ret;
+    ret.push_back(Pair("blocks", (uint64_t)stats.nRounds));
+    ret.push_back(Pair("checks", (uint64_t)stats.nTotalChecks));
+    ret.push_back(Pair("lastchecks", (uint64_t)stats.nLastChecks));
+    ret.push_back(Pair("lasttime", stats.nLastMicros));
+    ret.push_back(Pair("lastwaittime", stats.nLastWaitMicros));
+    Array workers;
+    BOOST_FOREACH(const CCheckQueueWorkerStats& worker, stats.vWorkers) {
+        Object obj;
+        obj.push_back(Pair("checks", (uint64_t)worker.nChecks));
+        obj.push_back(Pair("batches", (uint64_t)worker.nBatches));
+        obj.push_back(Pair("steals", (uint64_t)worker.nSteals));
+        obj.push_back(Pair("idletime", worker.nIdleMicros));
+        workers.push_back(obj);
+    }
+    ret.push_back(Pair("workers", workers));
 
     return ret;
 }
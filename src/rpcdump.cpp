@@ -66,6 +66,11 @@ std::string DecodeDumpString(const std::string &str) {
     return ret.str();
 }
 
+CBlockIndex static *GetGenesis() {
+    LOCK(cs_main);
+    return chainActive.Genesis();
+}
+
 Value importprivkey(const Array& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -91,9 +96,8 @@ Value importprivkey(const Array& params, bool fHelp)
             + HelpExampleRpc("importprivkey", "\"mykey\", \"testing\", false")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
+    if (pwalletMain->GetRescanStatus().fScanning)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning, see getrescaninfo and abortrescan");
 
     string strSecret = params[0].get_str();
     string strLabel = "";
@@ -117,6 +121,10 @@ Value importprivkey(const Array& params, bool fHelp)
     // assert(key.VerifyPubKey(pubkey));
     CKeyID vchAddress = pubkey.GetID();
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
 
@@ -131,12 +139,12 @@ Value importprivkey(const Array& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        }
     }
 
+    // The rescan takes the locks itself, block by block
+    if (fRescan && pwalletMain->ScanForWalletTransactions(GetGenesis(), true) < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan did not complete, another rescan was running or it was aborted");
+
     return Value::null;
 }
 
@@ -163,7 +171,8 @@ Value importaddress(const Array& params, bool fHelp)
             + HelpExampleRpc("importaddress", "\"myaddress\", \"testing\", false")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    if (pwalletMain->GetRescanStatus().fScanning)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning, see getrescaninfo and abortrescan");
 
     CScript script;
 
@@ -187,6 +196,8 @@ Value importaddress(const Array& params, bool fHelp)
         fRescan = params[2].get_bool();
 
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
         if (::IsMine(*pwalletMain, script) == ISMINE_SPENDABLE)
             throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
 
@@ -202,12 +213,14 @@ Value importaddress(const Array& params, bool fHelp)
 
         if (!pwalletMain->AddWatchOnly(script))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
+    }
 
-        if (fRescan)
-        {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+    // The rescan takes the locks itself, block by block
+    if (fRescan)
+    {
+        if (pwalletMain->ScanForWalletTransactions(GetGenesis(), true) < 0)
+            throw JSONRPCError(RPC_WALLET_ERROR, "Rescan did not complete, another rescan was running or it was aborted");
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
@@ -233,89 +246,160 @@ Value importwallet(const Array& params, bool fHelp)
             + HelpExampleRpc("importwallet", "\"test\"")
         );
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
-    ifstream file;
-    file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
-    if (!file.is_open())
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
-
-    int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
+    if (pwalletMain->GetRescanStatus().fScanning)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning, see getrescaninfo and abortrescan");
 
+    CBlockIndex *pindex;
     bool fGood = true;
-
-    int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
-    file.seekg(0, file.beg);
-
-    pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
-    while (file.good()) {
-        pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
-        std::string line;
-        std::getline(file, line);
-        if (line.empty() || line[0] == '#')
-            continue;
-
-        std::vector<std::string> vstr;
-        boost::split(vstr, line, boost::is_any_of(" "));
-        if (vstr.size() < 2)
-            continue;
-        CAnoncoinSecret vchSecret;
-        if (!vchSecret.SetString(vstr[0]))
-            continue;
-        CKey key = vchSecret.GetKey();
-        CPubKey pubkey = key.GetPubKey();
-        CKeyID keyid = pubkey.GetID();
-        if (pwalletMain->HaveKey(keyid)) {
-            LogPrintf("Skipping import of %s (key already present)\n", CAnoncoinAddress(keyid).ToString());
-            continue;
-        }
-        int64_t nTime = DecodeDumpTime(vstr[1]);
-        std::string strLabel;
-        bool fLabel = true;
-        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
-            if (boost::algorithm::starts_with(vstr[nStr], "#"))
-                break;
-            if (vstr[nStr] == "change=1")
-                fLabel = false;
-            if (vstr[nStr] == "reserve=1")
-                fLabel = false;
-            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-                strLabel = DecodeDumpString(vstr[nStr].substr(6));
-                fLabel = true;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        EnsureWalletIsUnlocked();
+
+        ifstream file;
+        file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
+        if (!file.is_open())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
+
+        int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
+
+        int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
+        file.seekg(0, file.beg);
+
+        // Write all the keys in one transaction, flushed to disk once
+        CDBBatch batch(pwalletMain->strWalletFile);
+
+        pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
+        while (file.good()) {
+            pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
+            std::string line;
+            std::getline(file, line);
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::vector<std::string> vstr;
+            boost::split(vstr, line, boost::is_any_of(" "));
+            if (vstr.size() < 2)
+                continue;
+            CAnoncoinSecret vchSecret;
+            if (!vchSecret.SetString(vstr[0]))
+                continue;
+            CKey key = vchSecret.GetKey();
+            CPubKey pubkey = key.GetPubKey();
+            CKeyID keyid = pubkey.GetID();
+            if (pwalletMain->HaveKey(keyid)) {
+                LogPrintf("Skipping import of %s (key already present)\n", CAnoncoinAddress(keyid).ToString());
+                continue;
             }
+            int64_t nTime = DecodeDumpTime(vstr[1]);
+            std::string strLabel;
+            bool fLabel = true;
+            for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
+                if (boost::algorithm::starts_with(vstr[nStr], "#"))
+                    break;
+                if (vstr[nStr] == "change=1")
+                    fLabel = false;
+                if (vstr[nStr] == "reserve=1")
+                    fLabel = false;
+                if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
+                    strLabel = DecodeDumpString(vstr[nStr].substr(6));
+                    fLabel = true;
+                }
+            }
+            LogPrintf("Importing %s...\n", CAnoncoinAddress(keyid).ToString());
+            if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
+                fGood = false;
+                continue;
+            }
+            pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
+            if (fLabel)
+                pwalletMain->SetAddressBook(keyid, strLabel, "receive");
+            nTimeBegin = std::min(nTimeBegin, nTime);
         }
-        LogPrintf("Importing %s...\n", CAnoncoinAddress(keyid).ToString());
-        if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
-            fGood = false;
-            continue;
-        }
-        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
-        if (fLabel)
-            pwalletMain->SetAddressBook(keyid, strLabel, "receive");
-        nTimeBegin = std::min(nTimeBegin, nTime);
-    }
-    file.close();
-    pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+        file.close();
+        pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
 
-    CBlockIndex *pindex = chainActive.Tip();
-    while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+        pindex = chainActive.Tip();
+        while (pindex && pindex->pprev && pindex->GetBlockTime() > nTimeBegin - 7200)
+            pindex = pindex->pprev;
 
-    if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
-        pwalletMain->nTimeFirstKey = nTimeBegin;
+        if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBegin;
+
+        LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
+    }
 
-    LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    // The rescan takes the locks itself, block by block
+    bool fRescanComplete = pwalletMain->ScanForWalletTransactions(pindex) >= 0;
     pwalletMain->MarkDirty();
 
+    if (!fRescanComplete)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan did not complete, another rescan was running or it was aborted");
+
     if (!fGood)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
 
     return Value::null;
 }
 
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return Value::null;
+
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "\n Returns the progress of the wallet rescan started by -rescan, importprivkey, importaddress or importwallet.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"rescanning\": true|false, (boolean) whether a rescan is running\n"
+            "  \"startheight\": n,         (numeric) the height the rescan started from\n"
+            "  \"height\": n,              (numeric) the last block scanned\n"
+            "  \"stopheight\": n,          (numeric) the tip when the rescan started, where it ends\n"
+            "  \"progress\": x.xxx,        (numeric) the fraction of the blocks scanned\n"
+            "  \"found\": n,               (numeric) how many transactions were added or updated\n"
+            "  \"duration\": n,            (numeric) seconds since the rescan started\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrescaninfo", "")
+            + HelpExampleRpc("getrescaninfo", "")
+        );
+
+    CRescanStatus status = pwalletMain->GetRescanStatus();
+    Object obj;
+    obj.push_back(Pair("rescanning", status.fScanning));
+    if (status.fScanning) {
+        int nBlocks = status.nStopHeight - status.nStartHeight + 1;
+        obj.push_back(Pair("startheight", status.nStartHeight));
+        obj.push_back(Pair("height", status.nHeight));
+        obj.push_back(Pair("stopheight", status.nStopHeight));
+        obj.push_back(Pair("progress", (double)(status.nHeight - status.nStartHeight + 1) / nBlocks));
+        obj.push_back(Pair("found", status.nFound));
+        obj.push_back(Pair("duration", GetTime() - status.nStartTime));
+    }
+    return obj;
+}
+
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return Value::null;
+
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\n Stops the running wallet rescan after the block it is scanning. Transactions found so far stay in the wallet.\n"
+            "\nResult:\n"
+            "true|false    (boolean) whether a rescan was running\n"
+            "\nExamples:\n"
+            + HelpExampleCli("abortrescan", "")
+            + HelpExampleRpc("abortrescan", "")
+        );
+
+    return pwalletMain->AbortRescan();
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -621,12 +621,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
+    // Update block, the template cache makes this cheap enough to do on every pool change
     static CBlockIndex* pindexPrev = NULL;
-    static int64_t nStart;
     static CBlockTemplate* pblocktemplate = NULL;
     if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast)
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
@@ -635,7 +634,6 @@ Value getblocktemplate(const Array& params, bool fHelp)
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew;
         pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
 
         // Create new block
         if(pblocktemplate)
@@ -121,8 +121,7 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+    pwalletMain->RequestKeyPoolTopUp();
 
     // Generate a new key that is added to wallet
     CPubKey newKey;
@@ -225,8 +224,7 @@ Value getrawchangeaddress(const Array& params, bool fHelp)
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+    pwalletMain->RequestKeyPoolTopUp();
 
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
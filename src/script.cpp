@@ -7,12 +7,14 @@
 #include "script.h"
 
 #include "compressor.h"
+#include "crypto/common.h"
 #include "crypto/sha1.h"
 #include "hash.h"
 #include "key.h"
 #include "keystore.h"
 #include "random.h"
 #include "sigcache.h"
+#include "streams.h"
 #include "sync.h"
 #include "uint256.h"
 #include "util.h"
@@ -1310,6 +1312,64 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
     return ss.GetHash();
 }
 
+/** Serialized size of an input with a blanked out script: prevout, empty script, sequence */
+static const size_t BLANKED_INPUT_SIZE = 32 + 4 + 1 + 4;
+
+CPrecomputedTransactionData::CPrecomputedTransactionData(const CTransaction& txTo)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    CSHA256 hasher;
+    hasher.Write((const unsigned char*)&ss[0], ss.size());
+
+    vPrefix.reserve(txTo.vin.size());
+    vBlankedInputs.reserve(txTo.vin.size() * BLANKED_INPUT_SIZE);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vPrefix.push_back(hasher);
+        ss.clear();
+        ss << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        assert(ss.size() == BLANKED_INPUT_SIZE);
+        hasher.Write((const unsigned char*)&ss[0], ss.size());
+        vBlankedInputs.insert(vBlankedInputs.end(), ss.begin(), ss.end());
+    }
+
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    vOutputs.assign(ss.begin(), ss.end());
+}
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                      const CPrecomputedTransactionData* txdata)
+{
+    // Anything but SIGHASH_NONE, SIGHASH_SINGLE and SIGHASH_ANYONECANPAY serializes as SIGHASH_ALL
+    if (txdata == NULL || nIn >= txTo.vin.size() || txdata->vPrefix.size() != txTo.vin.size() ||
+        (nHashType & SIGHASH_ANYONECANPAY) || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    // Only the input being signed is serialized here, the rest comes from txdata
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+    CDataStream ss(SER_GETHASH, 0);
+    txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+
+    CSHA256 hasher(txdata->vPrefix[nIn]);
+    hasher.Write((const unsigned char*)&ss[0], ss.size());
+    size_t nAfter = (nIn + 1) * BLANKED_INPUT_SIZE;
+    if (nAfter < txdata->vBlankedInputs.size())
+        hasher.Write(&txdata->vBlankedInputs[nAfter], txdata->vBlankedInputs.size() - nAfter);
+    hasher.Write(&txdata->vOutputs[0], txdata->vOutputs.size());
+    unsigned char vchHashType[4];
+    WriteLE32(vchHashType, nHashType);
+    hasher.Write(vchHashType, sizeof(vchHashType));
+
+    // Double SHA256, as CHashWriter does
+    unsigned char vchHash[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(vchHash);
+    uint256 hash;
+    CSHA256().Write(vchHash, sizeof(vchHash)).Finalize(hash.begin());
+    return hash;
+}
+
 
 //
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
@@ -7,6 +7,7 @@
 #ifndef ANONCOIN_SCRIPT_H
 #define ANONCOIN_SCRIPT_H
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "script_error.h"
 #include "util.h"
@@ -781,6 +782,27 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+/**
+ * The parts of a transaction's SIGHASH_ALL signature hash that do not depend on
+ * the input being signed, serialized once so checking many inputs does not
+ * serialize and hash the whole transaction again for each of them.
+ */
+struct CPrecomputedTransactionData
+{
+    //! SHA256 state after the version and the blanked out inputs before input i
+    std::vector<CSHA256> vPrefix;
+    //! Every input with its script blanked out, serialized back to back
+    std::vector<unsigned char> vBlankedInputs;
+    //! The outputs and the lock time, serialized
+    std::vector<unsigned char> vOutputs;
+
+    CPrecomputedTransactionData(const CTransaction& txTo);
+};
+
+/** SignatureHash, using txdata (which may be NULL) for SIGHASH_ALL */
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                      const CPrecomputedTransactionData* txdata);
+
 // Needed for v10 anoncoin-tx
 CScript GetScriptForDestination(const CTxDestination& dest);
 CScript GetScriptForMultisig(int nRequired, const std::vector<CPubKey>& keys);
@@ -6,13 +6,17 @@
 
 #include "sigcache.h"
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <limits>
+#include <string.h>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
 
 using namespace boost;
 using namespace std;
@@ -35,7 +39,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -43,78 +47,140 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     return true;
 }
 
+/** Default for -sigcachemb, maximum megabytes of memory used by the signature cache */
+const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+
 namespace {
 
+/** Number of separately locked shards of the signature cache */
+static const unsigned int SIGCACHE_SHARDS = 64;
+/** Slots searched for an entry, starting at the one its digest points to */
+static const unsigned int SIGCACHE_PROBES = 8;
+
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are salted 32 byte digests of (signature hash, signature, public
+ * key) held in a fixed number of slots, split over shards with a lock of
+ * their own so the script check threads seldom wait on each other. When all
+ * probed slots are taken, the digest picks the one to overwrite; the salt
+ * keeps would-be DoS attackers from predicting which entries they evict.
  */
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct CShard
+    {
+        boost::mutex cs;
+        std::vector<uint256> vSlots;
+    };
+
+    uint256 nonce;
+    CShard shards[SIGCACHE_SHARDS];
+    size_t nSlotsPerShard;
+
+    static uint64_t DigestWord(const uint256& digest, int n)
+    {
+        uint64_t nWord;
+        memcpy(&nWord, digest.begin() + 8 * n, sizeof(nWord));
+        return nWord;
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache() : nSlotsPerShard(0) {}
+
+    /** Size the cache to nBytes and draw a new salt, dropping all entries. Not thread safe. */
+    void Setup(size_t nBytes)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        GetRandBytes(nonce.begin(), nonce.size());
+        nSlotsPerShard = nBytes / sizeof(uint256) / SIGCACHE_SHARDS;
+        if (nSlotsPerShard > 0)
+            nSlotsPerShard = std::max<size_t>(nSlotsPerShard, SIGCACHE_PROBES);
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+            shards[i].vSlots.assign(nSlotsPerShard, uint256(0));
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    size_t GetMaxEntries() const { return nSlotsPerShard * SIGCACHE_SHARDS; }
+
+    uint256 Digest(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        uint256 digest;
+        CSHA256 hasher;
+        // The public key goes before the signature: its length follows from its first byte, so no
+        // other split of the same bytes into (signature, key) can produce the same digest
+        hasher.Write(nonce.begin(), nonce.size()).Write(hash.begin(), hash.size());
+        hasher.Write(pubKey.begin(), pubKey.size());
+        if (!vchSig.empty())
+            hasher.Write(&vchSig[0], vchSig.size());
+        hasher.Finalize(digest.begin());
+        return digest;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    bool Get(const uint256& digest)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        if (nSlotsPerShard == 0)
+            return false;
+        CShard& shard = shards[DigestWord(digest, 0) % SIGCACHE_SHARDS];
+        size_t nSlot = DigestWord(digest, 1) % nSlotsPerShard;
+
+        boost::lock_guard<boost::mutex> lock(shard.cs);
+        for (unsigned int i = 0; i < SIGCACHE_PROBES; i++) {
+            if (shard.vSlots[(nSlot + i) % nSlotsPerShard] == digest)
+                return true;
         }
+        return false;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void Set(const uint256& digest)
+    {
+        if (nSlotsPerShard == 0)
+            return;
+        CShard& shard = shards[DigestWord(digest, 0) % SIGCACHE_SHARDS];
+        size_t nSlot = DigestWord(digest, 1) % nSlotsPerShard;
+
+        boost::lock_guard<boost::mutex> lock(shard.cs);
+        for (unsigned int i = 0; i < SIGCACHE_PROBES; i++) {
+            uint256& slot = shard.vSlots[(nSlot + i) % nSlotsPerShard];
+            if (slot == digest || slot == 0) {
+                slot = digest;
+                return;
+            }
+        }
+        shard.vSlots[(nSlot + DigestWord(digest, 2) % SIGCACHE_PROBES) % nSlotsPerShard] = digest;
     }
 };
 
+static CSignatureCache signatureCache;
+
 }
 
-bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+void InitSignatureCache()
 {
-    static CSignatureCache signatureCache;
+    int64_t nMaxBytes = GetArg("-sigcachemb", DEFAULT_MAX_SIG_CACHE_SIZE) * 1024 * 1024;
+    // -maxsigcachesize used to count entries, each of which now takes one slot of a digest
+    if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-sigcachemb")) {
+        int64_t nEntries = std::max<int64_t>(GetArg("-maxsigcachesize", 0), 0);
+        nMaxBytes = std::min<int64_t>(nEntries, std::numeric_limits<int64_t>::max() / (int64_t)sizeof(uint256)) * (int64_t)sizeof(uint256);
+        LogPrintf("Warning: -maxsigcachesize is deprecated, sizing the signature cache for %d entries; use -sigcachemb=<megabytes> instead\n", nEntries);
+    }
+    if (nMaxBytes < 0)
+        nMaxBytes = 0;
+    signatureCache.Setup(nMaxBytes);
+    LogPrintf("Using %d KiB for the signature cache, room for %u entries\n", nMaxBytes / 1024, signatureCache.GetMaxEntries());
+}
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+{
+    uint256 digest = signatureCache.Digest(sighash, vchSig, pubkey);
+    if (signatureCache.Get(digest))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(digest);
     return true;
 }
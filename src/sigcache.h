@@ -14,6 +14,12 @@
 
 class CPubKey;
 
+/** Default for -sigcachemb, maximum megabytes of memory used by the signature cache */
+extern const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE;
+
+/** Size the signature cache from -sigcachemb (or the deprecated entry count -maxsigcachesize); until then nothing is cached */
+void InitSignatureCache();
+
 // v10 code that needs a new home, it can not go into script.h as we have it structured today Todo:...upgrage to the new script subsystem...
 
 // More classes and code from v10.  This was needed somewhere else a couple days ago, now trying to build with it for anoncoin-tx
@@ -34,12 +40,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const CPrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CPrecomputedTransactionData* txdataIn=NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
@@ -58,7 +65,8 @@ private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, const CPrecomputedTransactionData* txdataIn=NULL) :
+        TransactionSignatureChecker(txToIn, nInIn, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
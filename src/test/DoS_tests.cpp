@@ -26,17 +26,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -109,13 +98,18 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+//! Build an orphan spending output 0 of prev, paying to key
+static CMutableTransaction OrphanSpending(const uint256& prev, const CKey& key)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = prev;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    return tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -125,42 +119,34 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    COrphanPool pool(1000, 1000000, 1000000);
+    int64_t nTime = GetTime();
+
     // 50 orphan transactions:
+    std::vector<uint256> vHashes;
     for (int i = 0; i < 50; i++)
     {
-        CMutableTransaction tx;
-        tx.vin.resize(1);
-        tx.vin[0].prevout.n = 0;
-        tx.vin[0].prevout.hash = GetRandHash();
-        tx.vin[0].scriptSig << OP_1;
-        tx.vout.resize(1);
-        tx.vout[0].nValue = 1*CENT;
-        tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
-
-        AddOrphanTx(tx, i);
+        CMutableTransaction tx = OrphanSpending(GetRandHash(), key);
+        BOOST_CHECK(pool.AddTx(tx, i, nTime));
+        vHashes.push_back(tx.GetHash());
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
-
-        CMutableTransaction tx;
-        tx.vin.resize(1);
-        tx.vin[0].prevout.n = 0;
-        tx.vin[0].prevout.hash = txPrev.GetHash();
-        tx.vout.resize(1);
-        tx.vout[0].nValue = 1*CENT;
-        tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
-        SignSignature(keystore, txPrev, tx, 0);
-
-        AddOrphanTx(tx, i);
+        CMutableTransaction tx = OrphanSpending(vHashes[i], key);
+        BOOST_CHECK(pool.AddTx(tx, i, nTime));
+        std::vector<uint256> vChildren;
+        pool.GetChildren(vHashes[i], vChildren);
+        BOOST_CHECK(vChildren.size() == 1 && vChildren[0] == tx.GetHash());
     }
+    BOOST_CHECK_EQUAL(pool.size(), 100);
+    BOOST_CHECK(!pool.AddTx(OrphanSpending(vHashes[0], key), 0, nTime)); // known
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = OrphanSpending(GetRandHash(), key);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -178,25 +164,64 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!pool.AddTx(tx, i, nTime));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer, each of the first peers has two orphans:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t nSizeBefore = pool.TotalSize();
+        size_t nPeerSize = pool.PeerSize(i);
+        BOOST_CHECK(nPeerSize > 0);
+        BOOST_CHECK_EQUAL(pool.EraseForPeer(i), 2);
+        BOOST_CHECK_EQUAL(pool.PeerSize(i), 0);
+        BOOST_CHECK_EQUAL(pool.TotalSize(), nSizeBefore - nPeerSize);
     }
+    BOOST_CHECK_EQUAL(pool.size(), 94);
+
+    // Test the count limit:
+    pool.SetLimits(40, 1000000, 1000000);
+    BOOST_CHECK(pool.size() <= 40);
+    pool.SetLimits(10, 1000000, 1000000);
+    BOOST_CHECK(pool.size() <= 10);
+    pool.SetLimits(0, 1000000, 1000000);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.TotalSize(), 0);
+}
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+BOOST_AUTO_TEST_CASE(DoS_orphanQuotas)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    int64_t nTime = GetTime();
+
+    CMutableTransaction txFirst = OrphanSpending(GetRandHash(), key);
+    unsigned int nTxSize = ::GetSerializeSize(CTransaction(txFirst), SER_NETWORK, PROTOCOL_VERSION);
+    COrphanPool pool(1000, 8 * nTxSize, 3 * nTxSize);
+
+    // A peer over its quota only pushes out its own oldest orphans
+    BOOST_CHECK(pool.AddTx(txFirst, 1, nTime));
+    for (int i = 0; i < 5; i++)
+        BOOST_CHECK(pool.AddTx(OrphanSpending(GetRandHash(), key), 2, nTime + i));
+    BOOST_CHECK(pool.HaveTx(txFirst.GetHash()));
+    BOOST_CHECK_EQUAL(pool.PeerSize(2), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // Over the total size the peer using the most bytes is evicted from
+    for (NodeId peer = 3; peer < 6; peer++) {
+        BOOST_CHECK(pool.AddTx(OrphanSpending(GetRandHash(), key), peer, nTime));
+        BOOST_CHECK(pool.AddTx(OrphanSpending(GetRandHash(), key), peer, nTime));
+    }
+    BOOST_CHECK_EQUAL(pool.TotalSize(), 8 * nTxSize);
+    BOOST_CHECK_EQUAL(pool.PeerSize(1), nTxSize);
+    BOOST_CHECK_EQUAL(pool.PeerSize(2), nTxSize);
+
+    // Orphans expire
+    BOOST_CHECK_EQUAL(pool.Expire(nTime + ORPHAN_TX_EXPIRE_TIME - 1), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(nTime + ORPHAN_TX_EXPIRE_TIME), 7);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK_EQUAL(pool.PeerSize(1), 0);
+    BOOST_CHECK_EQUAL(pool.PeerSize(2), nTxSize);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
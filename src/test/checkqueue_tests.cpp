@@ -0,0 +1,99 @@
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+/** A check that counts how often it ran and gives a set result */
+struct CCountedCheck
+{
+    static boost::mutex cs;
+    static unsigned int nRun;
+
+    bool fResult;
+
+    CCountedCheck(bool fResultIn = true) : fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        boost::lock_guard<boost::mutex> lock(cs);
+        nRun++;
+        return fResult;
+    }
+
+    void swap(CCountedCheck& check) { std::swap(fResult, check.fResult); }
+};
+
+boost::mutex CCountedCheck::cs;
+unsigned int CCountedCheck::nRun = 0;
+
+static CCheckQueue<CCountedCheck> checkqueue(16, 4);
+
+static void CheckQueueThread()
+{
+    checkqueue.Thread();
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_rounds)
+{
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(&CheckQueueThread);
+
+    unsigned int nAdded = 0;
+    for (int nRound = 0; nRound < 200; nRound++) {
+        bool fExpected = true;
+        unsigned int nRunBefore;
+        {
+            boost::lock_guard<boost::mutex> lock(CCountedCheck::cs);
+            nRunBefore = CCountedCheck::nRun;
+        }
+        unsigned int nRoundAdded = 0;
+        {
+            CCheckQueueControl<CCountedCheck> control(&checkqueue);
+            for (int nTx = 0; nTx < nRound % 40; nTx++) {
+                vector<CCountedCheck> vChecks;
+                for (int i = 0; i <= (nTx + nRound) % 7; i++) {
+                    // Every tenth round has one failing check
+                    bool fResult = !(nRound % 10 == 9 && nTx == 3 && i == 0);
+                    fExpected &= fResult;
+                    vChecks.push_back(CCountedCheck(fResult));
+                }
+                nRoundAdded += vChecks.size();
+                control.Add(vChecks);
+            }
+            BOOST_CHECK_EQUAL(control.Wait(), fExpected);
+        }
+        nAdded += nRoundAdded;
+
+        // A failed round may skip checks, a passing one runs them all
+        boost::lock_guard<boost::mutex> lock(CCountedCheck::cs);
+        if (fExpected)
+            BOOST_CHECK_EQUAL(CCountedCheck::nRun - nRunBefore, nRoundAdded);
+        else
+            BOOST_CHECK(CCountedCheck::nRun - nRunBefore <= nRoundAdded);
+    }
+
+    CCheckQueueStats stats = checkqueue.GetStats();
+    BOOST_CHECK_EQUAL(stats.nTotalChecks, nAdded);
+    BOOST_CHECK(stats.vWorkers.size() <= 4U);
+    uint64_t nWorkerChecks = 0;
+    BOOST_FOREACH(const CCheckQueueWorkerStats& worker, stats.vWorkers)
+        nWorkerChecks += worker.nChecks;
+    BOOST_CHECK_EQUAL(nWorkerChecks, nAdded);
+    BOOST_CHECK(checkqueue.IsIdle());
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,7 +3,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "clientversion.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
@@ -175,4 +177,163 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Sum up the statistics of a set of coins the slow way
+static CCoinsStats ComputeStats(const std::map<uint256, CCoins>& mapCoins)
+{
+    CCoinsStats stats;
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoins& coins = it->second;
+        if (coins.IsPruned())
+            continue;
+        stats.nTransactions++;
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull()) {
+                stats.nTransactionOutputs++;
+                stats.nTotalAmount += coins.vout[i].nValue;
+                stats.hashChecksum += GetCoinsOutputHash(it->first, i, coins);
+            }
+        }
+        stats.nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+    }
+    return stats;
+}
+
+// Apply random batches of changes through a child cache, and check that
+// the delta it reports keeps the statistics in line with a full recount.
+BOOST_AUTO_TEST_CASE(coins_stats_delta_test)
+{
+    std::vector<uint256> txids;
+    txids.resize(NUM_SIMULATION_ITERATIONS / 400);
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i] = GetRandHash();
+    }
+
+    CCoinsViewTest base;
+    CCoinsViewCache tip(&base);
+    std::map<uint256, CCoins> result;
+    CCoinsStats stats;
+
+    for (unsigned int round = 0; round < 200; round++) {
+        CCoinsViewCache view(&tip);
+        for (unsigned int n = 0; n < 20; n++) {
+            uint256 txid = txids[insecure_rand() % txids.size()];
+            CCoins& coins = result[txid];
+            CCoinsModifier entry = view.ModifyCoins(txid);
+            BOOST_CHECK(coins == *entry);
+            if (insecure_rand() % 3 == 0 && !coins.IsPruned()) {
+                // Spend a random output
+                unsigned int nPos = insecure_rand() % coins.vout.size();
+                coins.Spend(nPos);
+                entry->Spend(nPos);
+            } else {
+                coins.nHeight = insecure_rand() % 1000;
+                coins.fCoinBase = insecure_rand() % 2 == 0;
+                coins.vout.resize((insecure_rand() % 4) + 1);
+                for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                    coins.vout[i].nValue = insecure_rand();
+                    coins.vout[i].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                }
+                *entry = coins;
+            }
+        }
+
+        CCoinsStatsDelta delta;
+        view.GetStatsDelta(delta);
+        BOOST_CHECK(view.Flush());
+        delta.ApplyTo(stats);
+
+        CCoinsStats statsFull = ComputeStats(result);
+        BOOST_CHECK_EQUAL(stats.nTransactions, statsFull.nTransactions);
+        BOOST_CHECK_EQUAL(stats.nTransactionOutputs, statsFull.nTransactionOutputs);
+        BOOST_CHECK_EQUAL(stats.nSerializedSize, statsFull.nSerializedSize);
+        BOOST_CHECK_EQUAL(stats.nTotalAmount, statsFull.nTotalAmount);
+        BOOST_CHECK(stats.hashChecksum == statsFull.hashChecksum);
+
+        if (insecure_rand() % 10 == 0) {
+            BOOST_CHECK(tip.Flush());
+        }
+    }
+}
+
+// A snapshot view keeps answering from the state it was pinned at, with the
+// coins of later blocks only visible through the layers put on top of it.
+BOOST_AUTO_TEST_CASE(coins_snapshot_view_test)
+{
+    CCoinsViewDB db(1 << 20, true);
+    uint256 txidA = GetRandHash();
+    uint256 txidB = GetRandHash();
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = 1;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1000;
+
+    {
+        CCoinsViewCache view(&db);
+        *view.ModifyCoins(txidA) = coins;
+        view.SetBestBlock(uint256(1));
+        BOOST_CHECK(view.Flush());
+    }
+    boost::shared_ptr<const CLevelDBSnapshot> psnapshot(db.GetSnapshot());
+    CCoinsViewSnapshot viewSnapshot(psnapshot, uint256(1), 1);
+
+    // Spend A and create B in the database, the snapshot does not see it
+    CCoinsLayer layer;
+    {
+        CCoinsViewCache view(&db);
+        view.ModifyCoins(txidA)->Spend(0);
+        *view.ModifyCoins(txidB) = coins;
+        view.SetBestBlock(uint256(2));
+        view.GetDirtyCoins(layer);
+        BOOST_CHECK(view.Flush());
+    }
+    CCoins coinsOut;
+    BOOST_CHECK(!db.HaveCoins(txidA));
+    BOOST_CHECK(db.GetCoins(txidB, coinsOut));
+    BOOST_CHECK(viewSnapshot.GetCoins(txidA, coinsOut) && coinsOut == coins);
+    BOOST_CHECK(!viewSnapshot.HaveCoins(txidB));
+    BOOST_CHECK(viewSnapshot.GetBestBlock() == uint256(1));
+
+    // The same changes as a layer bring the snapshot up to date
+    CCoinsViewSnapshot viewLayered(viewSnapshot, boost::shared_ptr<const CCoinsLayer>(new CCoinsLayer(layer)), uint256(2), 2);
+    BOOST_CHECK(!viewLayered.HaveCoins(txidA));
+    BOOST_CHECK(!viewLayered.GetCoins(txidA, coinsOut));
+    BOOST_CHECK(viewLayered.GetCoins(txidB, coinsOut) && coinsOut == coins);
+    BOOST_CHECK_EQUAL(viewLayered.GetBestHeight(), 2);
+    BOOST_CHECK_EQUAL(viewLayered.GetLayerCount(), 1U);
+    BOOST_CHECK(viewSnapshot.HaveCoins(txidA));
+}
+
+// Layers stacked block after block are merged, without changing what the view answers.
+BOOST_AUTO_TEST_CASE(coins_snapshot_merge_test)
+{
+    CCoinsViewDB db(1 << 20, true);
+    boost::shared_ptr<const CLevelDBSnapshot> psnapshot(db.GetSnapshot());
+    CCoinsViewSnapshot viewSnapshot(psnapshot, uint256(0), 0);
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1000;
+
+    // Each block creates a coin and spends the one of the block before
+    std::vector<uint256> vTxids;
+    for (int i = 1; i <= 100; i++) {
+        boost::shared_ptr<CCoinsLayer> player(new CCoinsLayer());
+        coins.nHeight = i;
+        vTxids.push_back(GetRandHash());
+        (*player)[vTxids.back()] = coins;
+        if (i > 1)
+            (*player)[vTxids[i - 2]] = CCoins();
+        CCoinsViewSnapshot viewOld(viewSnapshot);
+        viewSnapshot = CCoinsViewSnapshot(viewOld, player, uint256(i), i);
+        BOOST_CHECK(viewSnapshot.GetLayerCount() <= CCoinsViewSnapshot::MAX_SNAPSHOT_LAYERS);
+        // Merging copies, the older view still answers as before
+        BOOST_CHECK(i == 1 || viewOld.HaveCoins(vTxids[i - 2]));
+    }
+    CCoins coinsOut;
+    for (int i = 0; i < 99; i++)
+        BOOST_CHECK(!viewSnapshot.HaveCoins(vTxids[i]));
+    BOOST_CHECK(viewSnapshot.GetCoins(vTxids[99], coinsOut) && coinsOut.nHeight == 100);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,366 @@
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "ecverify.h"
+
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "script.h"
+#include "streams.h"
+#include "uint256.h"
+#include "util.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(ecverify_tests)
+
+BOOST_AUTO_TEST_CASE(ecverify_parse_pubkey)
+{
+    // The generator, uncompressed and compressed
+    vector<unsigned char> vchG = ParseHex("0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8");
+    vector<unsigned char> vchGC = ParseHex("0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798");
+    CECPoint point, pointC;
+    BOOST_CHECK(ECParsePubKey(&vchG[0], vchG.size(), point));
+    BOOST_CHECK(ECParsePubKey(&vchGC[0], vchGC.size(), pointC));
+    BOOST_CHECK(memcmp(&point, &pointC, sizeof(point)) == 0);
+
+    unsigned char pub[65];
+    BOOST_CHECK_EQUAL(ECSerializePubKey(point, false, pub), 65U);
+    BOOST_CHECK(vector<unsigned char>(pub, pub + 65) == vchG);
+    BOOST_CHECK_EQUAL(ECSerializePubKey(point, true, pub), 33U);
+    BOOST_CHECK(vector<unsigned char>(pub, pub + 33) == vchGC);
+
+    // Hybrid form: the header must repeat the parity of y, which is even here
+    vchG[0] = 0x06;
+    BOOST_CHECK(ECParsePubKey(&vchG[0], vchG.size(), point));
+    vchG[0] = 0x07;
+    BOOST_CHECK(!ECParsePubKey(&vchG[0], vchG.size(), point));
+
+    // Off the curve
+    vchG[0] = 0x04;
+    vchG[64] ^= 1;
+    BOOST_CHECK(!ECParsePubKey(&vchG[0], vchG.size(), point));
+    // x = 5 has no point on the curve
+    vector<unsigned char> vchNoPoint = ParseHex("020000000000000000000000000000000000000000000000000000000000000005");
+    BOOST_CHECK(!ECParsePubKey(&vchNoPoint[0], vchNoPoint.size(), point));
+    // Wrong sizes and headers
+    BOOST_CHECK(!ECParsePubKey(&vchGC[0], 32, point));
+    vchGC[0] = 0x04;
+    BOOST_CHECK(!ECParsePubKey(&vchGC[0], vchGC.size(), point));
+}
+
+BOOST_AUTO_TEST_CASE(ecverify_sign_verify)
+{
+    for (int i = 0; i < 32; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        if (i % 8 == 0)
+            hash = ~uint256(0);
+
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+        CECPoint point;
+        BOOST_CHECK(ECParsePubKey(pubkey.begin(), pubkey.size(), point));
+        BOOST_CHECK(ECVerify(point, hash.begin(), &vchSig[0], vchSig.size()));
+
+        // Other hash, other key, damaged signature
+        uint256 hashOther = hash;
+        *(hashOther.begin() + i) ^= 1;
+        BOOST_CHECK(!pubkey.Verify(hashOther, vchSig));
+        CKey keyOther;
+        keyOther.MakeNewKey(true);
+        BOOST_CHECK(!keyOther.GetPubKey().Verify(hash, vchSig));
+        vector<unsigned char> vchBad = vchSig;
+        vchBad[vchBad.size() - 1 - i % 8] ^= 0x10;
+        BOOST_CHECK(!pubkey.Verify(hash, vchBad));
+
+        // Not strictly encoded, still verifies: trailing garbage, padded integer
+        vchBad = vchSig;
+        vchBad.push_back(0);
+        BOOST_CHECK(pubkey.Verify(hash, vchBad));
+        vchBad = vchSig;
+        vchBad[1]++;
+        vchBad[3]++;
+        vchBad.insert(vchBad.begin() + 4, 0);
+        BOOST_CHECK(pubkey.Verify(hash, vchBad));
+
+        // Compact signatures recover the key, and its compression
+        vector<unsigned char> vchCompact;
+        BOOST_CHECK(key.SignCompact(hash, vchCompact));
+        CPubKey pubkeyRec;
+        BOOST_CHECK(pubkeyRec.RecoverCompact(hash, vchCompact));
+        BOOST_CHECK(pubkeyRec == pubkey);
+        BOOST_CHECK(pubkey.VerifyCompact(hash, vchCompact));
+        BOOST_CHECK(!pubkey.VerifyCompact(hashOther, vchCompact));
+        BOOST_CHECK(pubkeyRec.RecoverCompact(hashOther, vchCompact));
+        BOOST_CHECK(pubkeyRec != pubkey);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ecverify_pubkey_cache)
+{
+    // A compressed key verifies from the cache after its first use, and the
+    // negated key, differing only in the header byte, gets a point of its own
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    for (int i = 0; i < 8; i++) {
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+
+        vector<unsigned char> vchFlipped(pubkey.begin(), pubkey.end());
+        vchFlipped[0] ^= 1;
+        CPubKey pubkeyFlipped(vchFlipped);
+        BOOST_CHECK(!pubkeyFlipped.Verify(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ecverify_signature_range)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+
+    // r = 0, s = 1 and r = n, s = 1 are out of range
+    vector<unsigned char> vchZero = ParseHex("3006020100020101");
+    BOOST_CHECK(!pubkey.Verify(hash, vchZero));
+    vector<unsigned char> vchOrder = ParseHex("3026022100fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141020101");
+    BOOST_CHECK(!pubkey.Verify(hash, vchOrder));
+    vector<unsigned char> vchEmpty;
+    BOOST_CHECK(!pubkey.Verify(hash, vchEmpty));
+}
+
+/**
+ * Results of OpenSSL's ECDSA_verify, which CPubKey::Verify used before,
+ * for signatures it made with the private keys 1, 2, n-1 and two others.
+ * The hash is in memory order, as OpenSSL was handed &hash. Encodings that
+ * OpenSSL 1.0.1k and later reject but earlier versions accepted are expected
+ * to verify: the chain was validated with those, and so is the lax parse.
+ */
+struct OpenSSLVerifyVector
+{
+    const char* pubkey;
+    const char* hash;
+    const char* sig;
+    bool fValid;
+};
+
+static const OpenSSLVerifyVector vOpenSSLVectors[] = {
+    // G: valid, compressed key
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3045022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", true},
+    // G: valid, uncompressed key
+    {"0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3045022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", true},
+    // G: valid, hybrid key
+    {"0679be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3045022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", true},
+    // G: high S
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3046022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022100ad5e3e3f924b131008de64d907476a95113874908ca89ef9c91019b9d0bcae29", true},
+    // G: other hash
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378958",
+     "3045022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", false},
+    // G: damaged r
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3045022100f10037fae971902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", false},
+    // G: r padded with a needless zero, rejected since OpenSSL 1.0.1k
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "304602220000f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", true},
+    // G: trailing byte, rejected since OpenSSL 1.0.1k
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3045022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff79931800", true},
+    // G: long form sequence length, rejected since OpenSSL 1.0.1k
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "308145022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", true},
+    // G: hybrid key with the wrong parity
+    {"0779be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3045022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", false},
+    // G: sequence length too long, rejected since OpenSSL 1.0.1k
+    {"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "e9d24cb97d33c024283cada203f19f33af775f99cbabf9827008535824378959",
+     "3046022100f10037fae970902d6e7fa6a8e835ed944ccab0245d6a003934d33b57fca6583e022052a1c1c06db4eceff7219b26f8b89569a976685622a00141f6c244d2ff799318", true},
+    // 2G: valid, compressed key
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304402200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de66202206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", true},
+    // 2G: valid, uncompressed key
+    {"04c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee51ae168fea63dc339a3c58419466ceaeef7f632653266d0e1236431a950cfe52a",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304402200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de66202206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", true},
+    // 2G: valid, hybrid key
+    {"06c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee51ae168fea63dc339a3c58419466ceaeef7f632653266d0e1236431a950cfe52a",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304402200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de66202206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", true},
+    // 2G: high S
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304502200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de662022100911194a1b66fac1211452fb1c3a18c635cec5a1f0065db6a98c69070c3405b8d", true},
+    // 2G: other hash
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f46",
+     "304402200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de66202206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", false},
+    // 2G: damaged r
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304402200fdf13085dd8e7c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de66202206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", false},
+    // 2G: r = 0
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "302502010002206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", false},
+    // 2G: s = 0
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "302502200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de662020100", false},
+    // 2G: s = n
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304502200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de662022100fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141", false},
+    // 2G: r + n
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "30450221010fdf13085dd8e6c2eebf10dd89a144c68765bc4d358abbc111a1a4506b6427a302206eee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", false},
+    // 2G: negative s
+    {"02c6047f9441ed7d6d3045406e95c07cd85c778e4b8cef3ca7abac09b95c709ee5",
+     "96e0dc1695c46cb05635c4180887311511bbd33b967ce2005f7eb87d70739f47",
+     "304402200fdf13085dd8e6c2eebf10dd89a144c7ccb6df6686421b8551cf45c39b2de6620220eeee6b5e499053edeebad04e3c5e739b5dc282c7aee2c4d1270bce1c0cf5e5b4", false},
+    // -G: valid, compressed key
+    {"0379be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b3",
+     "3044022030a8dc34f736a5b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022010d2da083dfc25ccac43b80d77333e6dd5d33eb01ba02ce8b8771724b7b4612d", true},
+    // -G: valid, uncompressed key
+    {"0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798b7c52588d95c3b9aa25b0403f1eef75702e84bb7597aabe663b82f6f04ef2777",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b3",
+     "3044022030a8dc34f736a5b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022010d2da083dfc25ccac43b80d77333e6dd5d33eb01ba02ce8b8771724b7b4612d", true},
+    // -G: valid, hybrid key
+    {"0779be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798b7c52588d95c3b9aa25b0403f1eef75702e84bb7597aabe663b82f6f04ef2777",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b3",
+     "3044022030a8dc34f736a5b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022010d2da083dfc25ccac43b80d77333e6dd5d33eb01ba02ce8b8771724b7b4612d", true},
+    // -G: high S
+    {"0379be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b3",
+     "3045022030a8dc34f736a5b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022100ef2d25f7c203da3353bc47f288ccc190e4db9e3693a87353075b47681881e014", true},
+    // -G: other hash
+    {"0379be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b2",
+     "3044022030a8dc34f736a5b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022010d2da083dfc25ccac43b80d77333e6dd5d33eb01ba02ce8b8771724b7b4612d", false},
+    // -G: damaged r
+    {"0379be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b3",
+     "3044022030a8dc34f736a4b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022010d2da083dfc25ccac43b80d77333e6dd5d33eb01ba02ce8b8771724b7b4612d", false},
+    // -G: uncompressed key off the curve
+    {"0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798b7c52588d95c3b9aa25b0403f1eef75702e84bb7597aabe663b82f6f04ef2776",
+     "43441cc821adc5b1d7bd69d4617d2cac85deef5009053c9e945ac4c0baa9e8b3",
+     "3044022030a8dc34f736a5b181d629c0bb461af99a03d24b470e03bee5960b0f3e6f1908022010d2da083dfc25ccac43b80d77333e6dd5d33eb01ba02ce8b8771724b7b4612d", false},
+    // key 3: valid, compressed key
+    {"0250863ad64a87ae8a2fe83c1af1a8403cb53f53e486d8511dad8a04887e5b2352",
+     "e1e7b9d15e11b004c98866defb0e784c497ada42402cd1a1dc8cab7e3a79ed8e",
+     "3044022063048e952be6796fc0be2a89c9162ffa0abd19de17d3084dd769297b9d095bc1022072b5d910e21b4241c115c3f3f76db5616b2b42b3912cdaa052624facfecd5b55", true},
+    // key 3: valid, uncompressed key
+    {"0450863ad64a87ae8a2fe83c1af1a8403cb53f53e486d8511dad8a04887e5b23522cd470243453a299fa9e77237716103abc11a1df38855ed6f2ee187e9c582ba6",
+     "e1e7b9d15e11b004c98866defb0e784c497ada42402cd1a1dc8cab7e3a79ed8e",
+     "3044022063048e952be6796fc0be2a89c9162ffa0abd19de17d3084dd769297b9d095bc1022072b5d910e21b4241c115c3f3f76db5616b2b42b3912cdaa052624facfecd5b55", true},
+    // key 3: valid, hybrid key
+    {"0650863ad64a87ae8a2fe83c1af1a8403cb53f53e486d8511dad8a04887e5b23522cd470243453a299fa9e77237716103abc11a1df38855ed6f2ee187e9c582ba6",
+     "e1e7b9d15e11b004c98866defb0e784c497ada42402cd1a1dc8cab7e3a79ed8e",
+     "3044022063048e952be6796fc0be2a89c9162ffa0abd19de17d3084dd769297b9d095bc1022072b5d910e21b4241c115c3f3f76db5616b2b42b3912cdaa052624facfecd5b55", true},
+    // key 3: high S
+    {"0250863ad64a87ae8a2fe83c1af1a8403cb53f53e486d8511dad8a04887e5b2352",
+     "e1e7b9d15e11b004c98866defb0e784c497ada42402cd1a1dc8cab7e3a79ed8e",
+     "3045022063048e952be6796fc0be2a89c9162ffa0abd19de17d3084dd769297b9d095bc10221008d4a26ef1de4bdbe3eea3c0c08924a9d4f839a331e1bc59b6d700edfd168e5ec", true},
+    // key 3: other hash
+    {"0250863ad64a87ae8a2fe83c1af1a8403cb53f53e486d8511dad8a04887e5b2352",
+     "e1e7b9d15e11b004c98866defb0e784c497ada42402cd1a1dc8cab7e3a79ed8f",
+     "3044022063048e952be6796fc0be2a89c9162ffa0abd19de17d3084dd769297b9d095bc1022072b5d910e21b4241c115c3f3f76db5616b2b42b3912cdaa052624facfecd5b55", false},
+    // key 3: damaged r
+    {"0250863ad64a87ae8a2fe83c1af1a8403cb53f53e486d8511dad8a04887e5b2352",
+     "e1e7b9d15e11b004c98866defb0e784c497ada42402cd1a1dc8cab7e3a79ed8e",
+     "3044022063048e952be6786fc0be2a89c9162ffa0abd19de17d3084dd769297b9d095bc1022072b5d910e21b4241c115c3f3f76db5616b2b42b3912cdaa052624facfecd5b55", false},
+    // key 4, hash above the group order: valid, compressed key
+    {"0319501d7fa15478098979fd5d176ea7ff3892b5a4d08417b070e0bf9487a3d568",
+     "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+     "3045022100b48e1769f409798b01ee7b8044751e26ca5a2cf6d8174a1b809885a000851031022068fab72e97524a317ca239e180c54d6ef9e736e73dce3b8cc7ff9de20eb21677", true},
+    // key 4: valid, uncompressed key
+    {"0419501d7fa15478098979fd5d176ea7ff3892b5a4d08417b070e0bf9487a3d5689d672225666e054ef1ac1fb2a771c7c464fae68435c30cc24dfde4863ddd8e91",
+     "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+     "3045022100b48e1769f409798b01ee7b8044751e26ca5a2cf6d8174a1b809885a000851031022068fab72e97524a317ca239e180c54d6ef9e736e73dce3b8cc7ff9de20eb21677", true},
+    // key 4: valid, hybrid key
+    {"0719501d7fa15478098979fd5d176ea7ff3892b5a4d08417b070e0bf9487a3d5689d672225666e054ef1ac1fb2a771c7c464fae68435c30cc24dfde4863ddd8e91",
+     "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+     "3045022100b48e1769f409798b01ee7b8044751e26ca5a2cf6d8174a1b809885a000851031022068fab72e97524a317ca239e180c54d6ef9e736e73dce3b8cc7ff9de20eb21677", true},
+    // key 4: high S
+    {"0319501d7fa15478098979fd5d176ea7ff3892b5a4d08417b070e0bf9487a3d568",
+     "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+     "3046022100b48e1769f409798b01ee7b8044751e26ca5a2cf6d8174a1b809885a000851031022100970548d168adb5ce835dc61e7f3ab28fc0c7a5ff717a64aef7d2c0aac1842aca", true},
+    // key 4: other hash
+    {"0319501d7fa15478098979fd5d176ea7ff3892b5a4d08417b070e0bf9487a3d568",
+     "fffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffe",
+     "3045022100b48e1769f409798b01ee7b8044751e26ca5a2cf6d8174a1b809885a000851031022068fab72e97524a317ca239e180c54d6ef9e736e73dce3b8cc7ff9de20eb21677", false},
+    // key 4: damaged r
+    {"0319501d7fa15478098979fd5d176ea7ff3892b5a4d08417b070e0bf9487a3d568",
+     "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+     "3045022100b48e1769f408798b01ee7b8044751e26ca5a2cf6d8174a1b809885a000851031022068fab72e97524a317ca239e180c54d6ef9e736e73dce3b8cc7ff9de20eb21677", false}
+};
+
+BOOST_AUTO_TEST_CASE(ecverify_negative_s)
+{
+    // The first input of 23b397edccd3740a74adb603c9756370fafcde9bcc4483eb271ecad09a94dd63 in
+    // tx_valid.json, whose s is encoded as a negative number and was accepted by OpenSSL
+    CPubKey pubkey(ParseHex("04cc71eb30d653c0c3163990c47b976f3fb3f37cccdcbedb169a1dfef58bbfbfaff7d8a473e7e2e6d317b87bafe8bde97e3cf8f065dec022b51d11fcdd0d348ac4"));
+    CPubKey pubkeyOther(ParseHex("0461cbdcc5409fb4b4d42b51d33381354d80e550078cb532a34bfa2fcfdeb7d76519aecc62770f5b0e4ef8551946d8a540911abe3e7854a26f39f58b25c15342af"));
+    CMutableTransaction tx;
+    CDataStream stream(ParseHex("0100000001b14bdcbc3e01bdaad36cc08e81e69c82e1060bc14e518db2b49aa43ad90ba26000000000490047304402203f16c6f40162ab686621ef3000b04e75418a0c0cb2d8aebeac894ae360ac1e780220ddc15ecdfc3507ac48e1681a33eb60996631bf6bf5bc0a0682c4db743ce7ca2b01ffffffff0140420f00000000001976a914660d4ef3a743e3e696ad990364e555c271ad504b88ac00000000"), SER_NETWORK, PROTOCOL_VERSION);
+    stream >> tx;
+    CScript scriptCode = CScript() << OP_1 << ToByteVector(pubkey) << ToByteVector(pubkeyOther) << OP_2 << OP_CHECKMULTISIG;
+    uint256 hash = SignatureHash(scriptCode, CTransaction(tx), 0, SIGHASH_ALL);
+    BOOST_CHECK(hash == uint256(ParseHex("259d83e4174d7a386542918b53294b6d0affd82b2939d37f5066d296f36914c2")));
+
+    vector<unsigned char> vchSig = ParseHex("304402203f16c6f40162ab686621ef3000b04e75418a0c0cb2d8aebeac894ae360ac1e780220ddc15ecdfc3507ac48e1681a33eb60996631bf6bf5bc0a0682c4db743ce7ca2b");
+    BOOST_CHECK(pubkey.Verify(hash, vchSig));
+    BOOST_CHECK(!pubkeyOther.Verify(hash, vchSig));
+    CECPoint point;
+    BOOST_CHECK(ECParsePubKey(pubkey.begin(), pubkey.size(), point));
+    BOOST_CHECK(ECVerify(point, hash.begin(), &vchSig[0], vchSig.size()));
+}
+
+BOOST_AUTO_TEST_CASE(ecverify_openssl_vectors)
+{
+    for (unsigned int i = 0; i < sizeof(vOpenSSLVectors) / sizeof(vOpenSSLVectors[0]); i++) {
+        const OpenSSLVerifyVector& test = vOpenSSLVectors[i];
+        CPubKey pubkey(ParseHex(test.pubkey));
+        uint256 hash(ParseHex(test.hash));
+        vector<unsigned char> vchSig = ParseHex(test.sig);
+        BOOST_CHECK_MESSAGE(pubkey.Verify(hash, vchSig) == test.fValid, strprintf("vector %u", i));
+
+        CECPoint point;
+        bool fValid = ECParsePubKey(pubkey.begin(), pubkey.size(), point) && ECVerify(point, hash.begin(), &vchSig[0], vchSig.size());
+        BOOST_CHECK_MESSAGE(fValid == test.fValid, strprintf("vector %u", i));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
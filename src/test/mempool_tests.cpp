@@ -0,0 +1,257 @@
+// Copyright (c) 2011-2014 The Bitcoin Core developers
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <list>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+//! Build a one input, one output transaction spending output n of prev
+static CMutableTransaction SpendTx(const uint256& prev, uint32_t n, const CAmount& nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = prev;
+    tx.vin[0].prevout.n = n;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = SpendTx(uint256(1), 0, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    // tx2 pays the lowest rate, but tx3 spends it and pays enough for both
+    CMutableTransaction tx2 = SpendTx(uint256(2), 0, 10 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1));
+    CMutableTransaction tx3 = SpendTx(tx2.GetHash(), 0, 10 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 10.0, 1));
+
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    pool.TrimToSize(nUsage);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    // The tx2 package is worth more than tx1, so tx1 goes first
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+
+    // The rolling minimum is the evicted rate plus the relay fee, until a block is seen
+    size_t nTxSize = CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1).GetTxSize();
+    CFeeRate evictedRate(10000LL, nTxSize);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(evictedRate.GetFeePerK() + 1000));
+
+    // Evicting tx2 takes its spender with it
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    CFeeRate packageRate(25000LL, 2 * nTxSize);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(packageRate.GetFeePerK() + 1000));
+
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = SpendTx(uint256(1), 0, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 100, 10.0, 1));
+    CMutableTransaction tx2 = SpendTx(uint256(2), 0, 10 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 10000LL, 200, 10.0, 1));
+    // A young child of an old parent goes along with it
+    CMutableTransaction tx3 = SpendTx(tx1.GetHash(), 0, 10 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 10000LL, 300, 10.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(1000), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // parent <- child <- grandchild
+    CMutableTransaction txParent = SpendTx(uint256(1), 0, 10 * COIN);
+    CMutableTransaction txChild = SpendTx(txParent.GetHash(), 0, 10 * COIN);
+    CMutableTransaction txGrandChild = SpendTx(txChild.GetHash(), 0, 10 * COIN);
+    CTxMemPoolEntry entryParent(txParent, 1000LL, 0, 10.0, 1);
+    pool.addUnchecked(txParent.GetHash(), entryParent);
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 5000LL, 0, 10.0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 2000LL, 0, 10.0, 1));
+    uint64_t nTxSize = entryParent.GetTxSize();
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 8000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 8000);
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).count(itParent));
+    BOOST_CHECK(pool.GetMemPoolChildren(itChild).count(itGrandChild));
+
+    // The child pays for its parent, so it outranks it by ancestor score
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(mi->GetTx().GetHash() == txChild.GetHash());
+
+    // Prioritising the grandchild shows up in the package totals of the others
+    pool.PrioritiseTransaction(txGrandChild.GetHash(), txGrandChild.GetHash().ToString(), 0.0, 3000);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 11000);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithDescendants(), 10000);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 11000);
+
+    // Confirming the parent leaves the rest in the pool with one ancestor less
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txParent);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), 2 * nTxSize);
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).empty());
+
+    // A reorg puts the parent back after its children
+    pool.addUnchecked(txParent.GetHash(), entryParent);
+    itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 1);
+    std::vector<uint256> vHashUpdate;
+    vHashUpdate.push_back(txParent.GetHash());
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 11000);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).count(itParent));
+
+    // Removing the child recursively takes the grandchild too
+    std::list<CTransaction> removed;
+    pool.remove(txChild, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nTxSize);
+    BOOST_CHECK(pool.GetMemPoolChildren(itParent).empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolFeeEstimatorTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> conflicts;
+
+    // Each block confirms five high fee transactions sent just before it and
+    // five low fee ones sent three blocks earlier
+    const CAmount nHighFee = 20000, nLowFee = 4000;
+    std::vector<std::vector<CTransaction> > vLowPending;
+    int nPrev = 0;
+    for (int nHeight = 1; nHeight <= 200; nHeight++) {
+        std::vector<CTransaction> vHigh, vLow;
+        for (int i = 0; i < 5; i++) {
+            CMutableTransaction txHigh = SpendTx(uint256(++nPrev), 0, 10 * COIN);
+            pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, nHighFee, 0, 0.0, nHeight - 1));
+            vHigh.push_back(txHigh);
+            CMutableTransaction txLow = SpendTx(uint256(++nPrev), 0, 10 * COIN);
+            pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, nLowFee, 0, 0.0, nHeight - 1));
+            vLow.push_back(txLow);
+        }
+        vLowPending.push_back(vLow);
+        std::vector<CTransaction> vtx(vHigh);
+        if (nHeight >= 3)
+            vtx.insert(vtx.end(), vLowPending[nHeight - 3].begin(), vLowPending[nHeight - 3].end());
+        pool.removeForBlock(vtx, nHeight, conflicts);
+    }
+
+    size_t nTxSize = CTxMemPoolEntry(SpendTx(uint256(1), 0, 10 * COIN), 0, 0, 0.0, 0).GetTxSize();
+    CAmount nHighRate = CFeeRate(nHighFee, nTxSize).GetFeePerK();
+    CAmount nLowRate = CFeeRate(nLowFee, nTxSize).GetFeePerK();
+    BOOST_CHECK(abs(pool.estimateFee(1).GetFeePerK() - nHighRate) <= 1);
+    BOOST_CHECK(abs(pool.estimateFee(2).GetFeePerK() - nHighRate) <= 1);
+    BOOST_CHECK(abs(pool.estimateFee(3).GetFeePerK() - nLowRate) <= 1);
+    BOOST_CHECK(abs(pool.estimateFee(10).GetFeePerK() - nLowRate) <= 1);
+    BOOST_CHECK(pool.estimateFee(0) == CFeeRate(0));
+    BOOST_CHECK(pool.estimateFee(1000) == CFeeRate(0));
+    // No transaction got in on priority alone
+    BOOST_CHECK_EQUAL(pool.estimatePriority(1), -1);
+
+    // The estimates survive a round trip through the estimates file
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(pool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool poolRead(CFeeRate(1000));
+    BOOST_CHECK(poolRead.ReadFeeEstimates(file));
+    for (int i = 1; i <= 10; i++)
+        BOOST_CHECK(poolRead.estimateFee(i) == pool.estimateFee(i));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPreValidateTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    CCoinsView dummy;
+    CCoinsViewCache coins(&dummy);
+
+    // A pay to pubkey hash output and a nonstandard one
+    CMutableTransaction txPrev;
+    txPrev.vout.resize(2);
+    txPrev.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txPrev.vout[0].nValue = 10 * COIN;
+    txPrev.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txPrev.vout[1].nValue = 10 * COIN;
+    *coins.ModifyCoins(txPrev.GetHash()) = CCoins(txPrev, 1);
+
+    // Spends of both whose scripts fail
+    CMutableTransaction tx = SpendTx(txPrev.GetHash(), 0, 10 * COIN);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(71, 0x30) << std::vector<unsigned char>(33, 0x02);
+    tx.vout[0].scriptPubKey = txPrev.vout[0].scriptPubKey;
+    CMutableTransaction txNonstandard = SpendTx(txPrev.GetHash(), 1, 9 * COIN);
+    txNonstandard.vin[0].scriptSig = CScript() << OP_10;
+    txNonstandard.vout[0].scriptPubKey = txPrev.vout[0].scriptPubKey;
+
+    // Free transactions are left to AcceptToMemoryPool() unverified
+    CValidationState state;
+    BOOST_CHECK(PreValidateTransaction(pool, state, tx, &coins, 1));
+    BOOST_CHECK(state.IsValid());
+
+    // So are transactions with nonstandard inputs
+    BOOST_CHECK(PreValidateTransaction(pool, state, txNonstandard, &coins, 1));
+    BOOST_CHECK(state.IsValid());
+
+    // Once it pays a fee the scripts are verified
+    tx.vout[0].nValue = 9 * COIN;
+    BOOST_CHECK(!PreValidateTransaction(pool, state, tx, &coins, 1));
+    BOOST_CHECK(!state.IsValid());
+
+    // Unless it conflicts with the pool
+    CMutableTransaction txConflict = SpendTx(txPrev.GetHash(), 0, 9 * COIN);
+    pool.addUnchecked(txConflict.GetHash(), CTxMemPoolEntry(txConflict, COIN, 0, 10.0, 1));
+    CValidationState stateConflict;
+    BOOST_CHECK(PreValidateTransaction(pool, stateConflict, tx, &coins, 1));
+    BOOST_CHECK(stateConflict.IsValid());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
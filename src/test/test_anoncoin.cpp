@@ -12,6 +12,7 @@
 #define BOOST_TEST_LOG_LEVEL message
 
 #include "main.h"
+#include "sigcache.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -48,6 +49,7 @@ struct TestingSetup {
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::MAIN);   // Set our test to use the 'main' network parameters
         noui_connect();
+        InitSignatureCache();
 #ifdef ENABLE_WALLET
         bitdb.MakeMock();
 #endif
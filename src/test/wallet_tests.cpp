@@ -5,6 +5,9 @@
 
 #include "wallet.h"
 
+#include "main.h"
+#include "random.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -326,4 +329,299 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_large_wallets)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    // Synthetic wallets of many small coins, up to about 0.17 ANC, the kind
+    // that builds up from paying out in batches. A subset within the window always
+    // exists, and the branch and bound search has to find one.
+    const int nSizes[] = { 10000, 100000 };
+    BOOST_FOREACH(int nSize, nSizes)
+    {
+        empty_wallet();
+        uint32_t nRand = 1;
+        for (int i = 0; i < nSize; i++) {
+            nRand = nRand * 1103515245 + 12345;
+            add_coin(COIN / 1000 + (nRand >> 8) % COIN);
+        }
+
+        for (int nTarget = 1; nTarget <= 50; nTarget += 7) {
+            int64_t nStart = GetTimeMicros();
+            BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget * COIN + CENT / 3, 1, 6, vCoins, setCoinsRet, nValueRet));
+            BOOST_TEST_MESSAGE(strprintf("%d coins, target %d ANC: %d coins selected in %dus", nSize, nTarget, setCoinsRet.size(), GetTimeMicros() - nStart));
+            BOOST_CHECK(nValueRet >= nTarget * COIN + CENT / 3);
+            BOOST_CHECK(nValueRet - (nTarget * COIN + CENT / 3) < 3 * minRelayTxFee.GetFee(182));
+        }
+    }
+    empty_wallet();
+}
+
+/**
+ * A chain of blocks that are only in the index, stacked on the real tip, so
+ * wallet transactions can be given a depth without mining. The previous tip
+ * is restored when it goes out of scope.
+ */
+class CFakeChain
+{
+private:
+    CBlockIndex* pindexOrig;
+    std::vector<CBlockIndex*> vIndex;
+
+public:
+    CFakeChain() : pindexOrig(chainActive.Tip()) {}
+
+    ~CFakeChain()
+    {
+        chainActive.SetTip(pindexOrig);
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex) {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+    }
+
+    //! Make block, whose transactions are given, the new tip
+    CBlockIndex* Connect(CBlock& block)
+    {
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        block.nVersion = 3;
+        block.nTime = pindexPrev->GetBlockTime() + 180;
+        block.nHeight = pindexPrev->nHeight + 1;
+        block.nNonce = vIndex.size();
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        uintFakeHash hashFake = block.CalcSha256dHash();
+        uint256 hash = hashFake;
+        hashFake.SetRealHash(hash);
+
+        CBlockIndex* pindex = new CBlockIndex(block);
+        pindex->phashBlock = &mapBlockIndex.insert(std::make_pair(hash, pindex)).first->first;
+        pindex->pprev = pindexPrev;
+        pindex->BuildSkip();
+        vIndex.push_back(pindex);
+        chainActive.SetTip(pindex);
+        return pindex;
+    }
+
+    //! Take the tip off the chain, it stays in the index
+    void Disconnect()
+    {
+        chainActive.SetTip(chainActive.Tip()->pprev);
+    }
+};
+
+static CTransaction MakeCoinbase(const CScript& scriptPubKey, const CAmount& nValue)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout.SetNull();
+    mtx.vin[0].scriptSig = CScript() << (int64_t)(chainActive.Height() + 1) << OP_0;
+    mtx.vout.resize(1);
+    mtx.vout[0].scriptPubKey = scriptPubKey;
+    mtx.vout[0].nValue = nValue;
+    return CTransaction(mtx);
+}
+
+/** The balances and coins as they were found before the index, by walking all of mapWallet */
+static void CheckBalances(const CWallet& wallet)
+{
+    LOCK2(cs_main, wallet.cs_wallet);
+    CWalletBalances balances;
+    vector<COutput> vCoinsAll;
+    for (map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+    {
+        const CWalletTx* pcoin = &(*it).second;
+        if (pcoin->IsTrusted()) {
+            balances.nTrusted += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyTrusted += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0)) {
+            balances.nUnconfirmed += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyUnconfirmed += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nWatchOnlyImmature += pcoin->GetImmatureWatchOnlyCredit();
+
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (!IsFinalTx(*pcoin) || (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) || nDepth < 0)
+            continue;
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            isminetype mine = wallet.IsMine(pcoin->vout[i]);
+            if (!wallet.IsSpent(it->first, i) && mine != ISMINE_NO && pcoin->vout[i].nValue > 0)
+                vCoinsAll.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+        }
+    }
+
+    // Twice, the second time from the cache
+    for (int i = 0; i < 2; i++) {
+        BOOST_CHECK_EQUAL(wallet.GetBalance(), balances.nTrusted);
+        BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), balances.nUnconfirmed);
+        BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), balances.nImmature);
+        BOOST_CHECK_EQUAL(wallet.GetWatchOnlyBalance(), balances.nWatchOnlyTrusted);
+        BOOST_CHECK_EQUAL(wallet.GetUnconfirmedWatchOnlyBalance(), balances.nWatchOnlyUnconfirmed);
+        BOOST_CHECK_EQUAL(wallet.GetImmatureWatchOnlyBalance(), balances.nWatchOnlyImmature);
+    }
+
+    vector<COutput> vCoinsIndexed;
+    wallet.AvailableCoins(vCoinsIndexed, false);
+    set<pair<pair<uint256, int>, pair<int, bool> > > setAll, setIndexed;
+    BOOST_FOREACH(const COutput& out, vCoinsAll)
+        setAll.insert(make_pair(make_pair(out.tx->GetHash(), out.i), make_pair(out.nDepth, out.fSpendable)));
+    BOOST_FOREACH(const COutput& out, vCoinsIndexed)
+        setIndexed.insert(make_pair(make_pair(out.tx->GetHash(), out.i), make_pair(out.nDepth, out.fSpendable)));
+    BOOST_CHECK(setAll == setIndexed);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_cached_balances)
+{
+    LOCK(cs_main);
+    CWallet walletTest("wallet_balances_test.dat");
+    bool fFirstRun;
+    walletTest.LoadWallet(fFirstRun);
+    CFakeChain chain;
+
+    CKey key, keyChange, keyOther;
+    key.MakeNewKey(true);
+    keyChange.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(walletTest.AddKeyPubKey(key, key.GetPubKey()));
+    BOOST_CHECK(walletTest.AddKeyPubKey(keyChange, keyChange.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptChange = GetScriptForDestination(keyChange.GetPubKey().GetID());
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    CheckBalances(walletTest);
+
+    // A coinbase of ours, and a payment with an output to us and one to a stranger
+    CBlock block1;
+    block1.vtx.push_back(MakeCoinbase(scriptMine, 50 * COIN));
+    CMutableTransaction mtxPay;
+    mtxPay.vin.resize(1);
+    mtxPay.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtxPay.vout.resize(2);
+    mtxPay.vout[0].scriptPubKey = scriptMine;
+    mtxPay.vout[0].nValue = 10 * COIN;
+    mtxPay.vout[1].scriptPubKey = scriptOther;
+    mtxPay.vout[1].nValue = 5 * COIN;
+    CTransaction txPay(mtxPay);
+    block1.vtx.push_back(txPay);
+    int nHeight1 = chain.Connect(block1)->nHeight;
+    BOOST_FOREACH(const CTransaction& tx, block1.vtx)
+        walletTest.SyncTransaction(tx, &block1);
+    CheckBalances(walletTest);
+    BOOST_CHECK_EQUAL(walletTest.GetBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(walletTest.GetImmatureBalance(), 50 * COIN);
+
+    // Spend our output of the payment, with change
+    CBlock block2;
+    block2.vtx.push_back(MakeCoinbase(scriptOther, 50 * COIN));
+    CMutableTransaction mtxSpend;
+    mtxSpend.vin.resize(1);
+    mtxSpend.vin[0].prevout = COutPoint(txPay.GetHash(), 0);
+    mtxSpend.vout.resize(2);
+    mtxSpend.vout[0].scriptPubKey = scriptOther;
+    mtxSpend.vout[0].nValue = 4 * COIN;
+    mtxSpend.vout[1].scriptPubKey = scriptChange;
+    mtxSpend.vout[1].nValue = 6 * COIN;
+    CTransaction txSpend(mtxSpend);
+    block2.vtx.push_back(txSpend);
+    chain.Connect(block2);
+    BOOST_FOREACH(const CTransaction& tx, block2.vtx)
+        walletTest.SyncTransaction(tx, &block2);
+    CheckBalances(walletTest);
+    BOOST_CHECK_EQUAL(walletTest.GetBalance(), 6 * COIN);
+
+    // Disconnecting the spend gives the payment its output back
+    chain.Disconnect();
+    BOOST_FOREACH(const CTransaction& tx, block2.vtx)
+        walletTest.SyncTransaction(tx, NULL);
+    CheckBalances(walletTest);
+    BOOST_CHECK_EQUAL(walletTest.GetBalance(), 10 * COIN);
+
+    chain.Connect(block2);
+    BOOST_FOREACH(const CTransaction& tx, block2.vtx)
+        walletTest.SyncTransaction(tx, &block2);
+    CheckBalances(walletTest);
+
+    // The coinbase matures at a depth of COINBASE_MATURITY + 1
+    while (chainActive.Height() < nHeight1 + COINBASE_MATURITY) {
+        CBlock block;
+        block.vtx.push_back(MakeCoinbase(scriptOther, 50 * COIN));
+        chain.Connect(block);
+        walletTest.SyncTransaction(block.vtx[0], &block);
+        CheckBalances(walletTest);
+        BOOST_CHECK_EQUAL(walletTest.GetImmatureBalance(), chainActive.Height() < nHeight1 + COINBASE_MATURITY ? 50 * COIN : 0);
+    }
+    BOOST_CHECK_EQUAL(walletTest.GetBalance(), 56 * COIN);
+
+    // Watching the stranger's outputs brings the payment, spent as far as our keys
+    // go, back into the index
+    BOOST_CHECK(walletTest.AddWatchOnly(scriptOther));
+    walletTest.MarkDirty();
+    CheckBalances(walletTest);
+    BOOST_CHECK_EQUAL(walletTest.GetWatchOnlyBalance(), 9 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_db_batch)
+{
+    const std::string strFile = "wallet_batch_test.dat";
+    CWallet walletTest(strFile);
+    CWalletTx wtx;
+    CAccount account;
+    {
+        CWalletDB walletdb(strFile, "cr+");
+    }
+
+    // A batch opened inside another joins it, and only the outer one commits
+    {
+        CDBBatch batch(strFile);
+        {
+            CDBBatch batchInner(strFile);
+            CWalletDB walletdb(strFile);
+            BOOST_CHECK(!batchInner.Abort());
+            BOOST_CHECK(!walletdb.TxnBegin());
+            BOOST_CHECK(!walletdb.TxnCommit());
+            BOOST_CHECK(!walletdb.TxnAbort());
+            BOOST_CHECK(walletdb.WriteAccount("batch", account));
+            BOOST_CHECK(walletdb.WriteTx(uint256(1), wtx));
+            BOOST_CHECK(walletdb.WriteTx(uint256(2), wtx));
+        }
+        {
+            LOCK(bitdb.cs_db);
+            BOOST_CHECK(bitdb.mapBatchTxn.count(strFile));
+        }
+        CWalletDB walletdb(strFile);
+        BOOST_CHECK(walletdb.ReadAccount("batch", account));
+    }
+    {
+        LOCK(bitdb.cs_db);
+        BOOST_CHECK(!bitdb.mapBatchTxn.count(strFile));
+    }
+    CWalletDB walletdb(strFile);
+    BOOST_CHECK(walletdb.ReadAccount("batch", account));
+
+    // Zapping inside a batch that is then aborted leaves the transactions
+    std::vector<uint256> vTxHash;
+    std::vector<CWalletTx> vWtx;
+    {
+        CDBBatch batch(strFile);
+        CWalletDB walletdbBatch(strFile);
+        BOOST_CHECK(walletdbBatch.ZapWalletTx(&walletTest, vWtx) == DB_LOAD_OK);
+        BOOST_CHECK_EQUAL(vWtx.size(), 2U);
+        BOOST_CHECK(walletdbBatch.FindWalletTx(&walletTest, vTxHash, vWtx) == DB_LOAD_OK);
+        BOOST_CHECK(vTxHash.empty());
+        BOOST_CHECK(batch.Abort());
+    }
+    BOOST_CHECK(walletdb.FindWalletTx(&walletTest, vTxHash, vWtx) == DB_LOAD_OK);
+    BOOST_CHECK_EQUAL(vTxHash.size(), 2U);
+
+    // On its own it erases them in a transaction of its own
+    vWtx.clear();
+    BOOST_CHECK(walletdb.ZapWalletTx(&walletTest, vWtx) == DB_LOAD_OK);
+    vTxHash.clear();
+    BOOST_CHECK(walletdb.FindWalletTx(&walletTest, vTxHash, vWtx) == DB_LOAD_OK);
+    BOOST_CHECK(vTxHash.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,7 @@
 #include <stdint.h>
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 
 //! Constants found in this source codes header(.h)
 //! -dbcache default (MiB)
@@ -22,6 +23,8 @@ const int64_t nDefaultDbCache = 400;
 const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 const int64_t nMinDbCache = 4;
+//! max. number of threads walking the coin database for GetStats()
+const int32_t MAX_COINSTATS_THREADS = 8;
 
 using namespace std;
 
@@ -40,7 +43,19 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CLevelDBOptions GetLevelDBOptions(const std::string& strPrefix, size_t nCacheSize)
+{
+    CLevelDBOptions dbOptions(nCacheSize);
+    if (mapArgs.count("-" + strPrefix + "blockcache"))
+        dbOptions.nBlockCacheSize = std::max((int64_t)0, GetArg("-" + strPrefix + "blockcache", 0)) << 20;
+    if (mapArgs.count("-" + strPrefix + "writebuffer"))
+        dbOptions.nWriteBufferSize = std::max((int64_t)1, GetArg("-" + strPrefix + "writebuffer", 0)) << 20;
+    dbOptions.nBloomBits = std::max(0, std::min(64, (int)GetArg("-" + strPrefix + "bloombits", dbOptions.nBloomBits)));
+    dbOptions.nMaxOpenFiles = std::max(16, (int)GetArg("-" + strPrefix + "maxopenfiles", dbOptions.nMaxOpenFiles));
+    return dbOptions;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", GetLevelDBOptions("coindb", nCacheSize), fMemory, fWipe) {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
@@ -87,7 +102,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", GetLevelDBOptions("blockdb", nCacheSize), fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -124,17 +139,68 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    int64_t nTotalAmount = 0;
+CLevelDBSnapshot* CCoinsViewDB::GetSnapshot() const {
+    return db.GetSnapshot();
+}
+
+CCoinsViewSnapshot::CCoinsViewSnapshot(boost::shared_ptr<const CLevelDBSnapshot> psnapshotIn, const uint256 &hashBestBlockIn, int nBestHeightIn) :
+    psnapshot(psnapshotIn), hashBestBlock(hashBestBlockIn), nBestHeight(nBestHeightIn) {}
+
+CCoinsViewSnapshot::CCoinsViewSnapshot(const CCoinsViewSnapshot &parent, boost::shared_ptr<const CCoinsLayer> player, const uint256 &hashBestBlockIn, int nBestHeightIn) :
+    psnapshot(parent.psnapshot), vLayers(parent.vLayers), hashBestBlock(hashBestBlockIn), nBestHeight(nBestHeightIn) {
+    vLayers.push_back(player);
+    // Merge the newest layer into the one below while that is at most twice
+    // its size, which keeps the layers few and copies each coin a few times
+    while (vLayers.size() >= 2 && (vLayers.size() > MAX_SNAPSHOT_LAYERS || vLayers[vLayers.size() - 2]->size() <= 2 * vLayers.back()->size())) {
+        boost::shared_ptr<CCoinsLayer> pmerged(new CCoinsLayer(*vLayers[vLayers.size() - 2]));
+        for (CCoinsLayer::const_iterator it = vLayers.back()->begin(); it != vLayers.back()->end(); it++)
+            (*pmerged)[it->first] = it->second;
+        vLayers.pop_back();
+        vLayers.back() = pmerged;
+    }
+}
+
+bool CCoinsViewSnapshot::GetCoins(const uint256 &txid, CCoins &coins) const {
+    for (std::vector<boost::shared_ptr<const CCoinsLayer> >::const_reverse_iterator rit = vLayers.rbegin(); rit != vLayers.rend(); rit++) {
+        CCoinsLayer::const_iterator it = (*rit)->find(txid);
+        if (it != (*rit)->end()) {
+            coins = it->second;
+            return !coins.IsPruned();
+        }
+    }
+    return psnapshot->Read(make_pair('c', txid), coins);
+}
+
+bool CCoinsViewSnapshot::HaveCoins(const uint256 &txid) const {
+    for (std::vector<boost::shared_ptr<const CCoinsLayer> >::const_reverse_iterator rit = vLayers.rbegin(); rit != vLayers.rend(); rit++) {
+        CCoinsLayer::const_iterator it = (*rit)->find(txid);
+        if (it != (*rit)->end())
+            return !it->second.IsPruned();
+    }
+    return psnapshot->Exists(make_pair('c', txid));
+}
+
+/** One slice of the coin database key space, walked by its own thread */
+struct CCoinsStatsRange
+{
+    unsigned int nBegin;    //! first byte of the txids in this range
+    unsigned int nEnd;      //! one past the last byte of the txids in this range
+    CCoinsStats stats;
+    bool fOk;
+
+    CCoinsStatsRange() : nBegin(0), nEnd(0), fOk(false) {}
+};
+
+static void ThreadCoinsStatsRange(const CLevelDBSnapshot* psnapshot, CCoinsStatsRange* prange)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(psnapshot->NewIterator());
+    uint256 hashStart(0);
+    *hashStart.begin() = prange->nBegin;
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', hashStart);
+    pcursor->Seek(ssKeySet.str());
+
+    CCoinsStats &stats = prange->stats;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -142,38 +208,76 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+            if (chType != 'c')
+                break;
+            uint256 txhash;
+            ssKey >> txhash;
+            if (*txhash.begin() >= prange->nEnd)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            stats.nTransactions++;
+            for (unsigned int i=0; i<coins.vout.size(); i++) {
+                const CTxOut &out = coins.vout[i];
+                if (!out.IsNull()) {
+                    stats.nTransactionOutputs++;
+                    stats.nTotalAmount += out.nValue;
+                    stats.hashChecksum += GetCoinsOutputHash(txhash, i, coins);
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
             }
+            stats.nSerializedSize += 32 + slValue.size();
             pcursor->Next();
         } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            prange->fOk = error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return;
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    prange->fOk = true;
+}
+
+bool CCoinsViewDB::GetSnapshotStats(const CLevelDBSnapshot &snapshot, CCoinsStats &stats, int nThreads) {
+    nThreads = std::max(1, std::min(nThreads, 256));
+    if (!snapshot.Read('B', stats.hashBlock))
+        stats.hashBlock = uint256(0);
+
+    std::vector<CCoinsStatsRange> vRanges(nThreads);
+    boost::thread_group threadGroup;
+    try {
+        for (int i = 0; i < nThreads; i++) {
+            vRanges[i].nBegin = 256 * i / nThreads;
+            vRanges[i].nEnd = 256 * (i + 1) / nThreads;
+            threadGroup.create_thread(boost::bind(&ThreadCoinsStatsRange, &snapshot, &vRanges[i]));
+        }
+        threadGroup.join_all();
+    } catch (...) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+
+    // The set hash is a plain sum, so the ranges combine in any order
+    BOOST_FOREACH(const CCoinsStatsRange &range, vRanges) {
+        if (!range.fOk)
+            return false;
+        stats.nTransactions += range.stats.nTransactions;
+        stats.nTransactionOutputs += range.stats.nTransactionOutputs;
+        stats.nSerializedSize += range.stats.nSerializedSize;
+        stats.nTotalAmount += range.stats.nTotalAmount;
+        stats.hashChecksum += range.stats.hashChecksum;
+    }
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    boost::scoped_ptr<CLevelDBSnapshot> psnapshot(GetSnapshot());
+    int nThreads = std::min((int)boost::thread::hardware_concurrency(), MAX_COINSTATS_THREADS);
+    if (!GetSnapshotStats(*psnapshot, stats, nThreads))
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+    if (mi != mapBlockIndex.end())
+        stats.nHeight = mi->second->nHeight;
     return true;
 }
 
@@ -181,6 +285,10 @@ bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
 
+bool CBlockTreeDB::ReadTxIndex(const CLevelDBSnapshot &snapshot, const uint256 &txid, CDiskTxPos &pos) {
+    return snapshot.Read(make_pair('t', txid), pos);
+}
+
 bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
     CLevelDBBatch batch;
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
@@ -188,6 +296,22 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile,
+                                  const std::vector<CBlockIndex*>& blockinfo, const std::vector<std::pair<uint256, CDiskTxPos> >& txinfo) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++)
+        batch.Write(make_pair('f', it->first), *it->second);
+    if (!fileInfo.empty())
+        batch.Write('l', nLastFile);
+    for (std::vector<CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
+        CDiskBlockIndex diskindex(*it);
+        batch.Write(make_pair('b', diskindex.GetBlockHash()), diskindex);
+    }
+    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=txinfo.begin(); it!=txinfo.end(); it++)
+        batch.Write(make_pair('t', it->first), it->second);
+    return WriteBatch(batch, true);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
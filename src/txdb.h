@@ -15,6 +15,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 class CCoins;
 class uint256;
 
@@ -24,6 +26,15 @@ extern const int64_t nDefaultDbCache;
 extern const int64_t nMaxDbCache;
 //! min. -dbcache in (MiB)
 extern const int64_t nMinDbCache;
+//! max. number of threads walking the coin database for GetStats()
+extern const int32_t MAX_COINSTATS_THREADS;
+
+/**
+ * LevelDB tunables for one database, overridable with -<prefix>blockcache,
+ * -<prefix>writebuffer (both MiB), -<prefix>bloombits and -<prefix>maxopenfiles.
+ * The prefixes are "coindb" and "blockdb".
+ */
+CLevelDBOptions GetLevelDBOptions(const std::string& strPrefix, size_t nCacheSize);
 
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -38,6 +49,48 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Pin the current state of the coin database, the caller owns the result
+    CLevelDBSnapshot* GetSnapshot() const;
+
+    const CLevelDBWrapper& GetDB() const { return db; }
+
+    /**
+     * Calculate statistics (except nHeight) from a snapshot of the coin database.
+     * The txid key space is split into nThreads ranges which are walked in parallel,
+     * no locks are needed.
+     */
+    static bool GetSnapshotStats(const CLevelDBSnapshot &snapshot, CCoinsStats &stats, int nThreads);
+};
+
+/**
+ * Read-only view of the coin database pinned at one best block, for use by RPC
+ * threads without cs_main. It is a LevelDB snapshot with the coins changed by
+ * blocks connected since the snapshot was taken layered on top. Once built a
+ * view never changes, newer views share the snapshot and layers of older ones.
+ */
+class CCoinsViewSnapshot : public CCoinsView
+{
+private:
+    boost::shared_ptr<const CLevelDBSnapshot> psnapshot;
+    //! Coins changed since the snapshot was taken, the newest layer last
+    std::vector<boost::shared_ptr<const CCoinsLayer> > vLayers;
+    uint256 hashBestBlock;
+    int nBestHeight;
+
+public:
+    //! Most layers stacked on the database snapshot, older ones are merged beyond that
+    static const unsigned int MAX_SNAPSHOT_LAYERS = 16;
+
+    CCoinsViewSnapshot(boost::shared_ptr<const CLevelDBSnapshot> psnapshotIn, const uint256 &hashBestBlockIn, int nBestHeightIn);
+    //! A view of parent with the coins of player layered on top, merged into the layers below as they pile up
+    CCoinsViewSnapshot(const CCoinsViewSnapshot &parent, boost::shared_ptr<const CCoinsLayer> player, const uint256 &hashBestBlockIn, int nBestHeightIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const { return hashBestBlock; }
+    int GetBestHeight() const { return nBestHeight; }
+    unsigned int GetLayerCount() const { return vLayers.size(); }
 };
 
 //! We now return and sort the following structure of details during a LoadBlockIndexGuts() call.
@@ -70,7 +123,11 @@ public:
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
+    static bool ReadTxIndex(const CLevelDBSnapshot &snapshot, const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    //! Write the dirty block file info, block index entries and transaction positions as one synced batch
+    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile,
+                        const std::vector<CBlockIndex*>& blockinfo, const std::vector<std::pair<uint256, CDiskTxPos> >& txinfo);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts( std::vector<BlockTreeEntry>& vSortedByHeight );
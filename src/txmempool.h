@@ -7,12 +7,17 @@
 #define ANONCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "sync.h"
 #include "transaction.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -34,7 +39,11 @@ inline bool AllowFree(double dPriority)
 extern const uint32_t MEMPOOL_HEIGHT;
 
 /**
- * CTxMemPool stores these:
+ * CTxMemPool stores these, along with the aggregate size and fee of the
+ * entry's in-pool ancestors and descendants (both counts include the entry
+ * itself). The aggregates are kept up to date as transactions enter and
+ * leave the pool, so that eviction and block assembly can order whole
+ * packages without walking the dependency graph.
  */
 class CTxMemPoolEntry
 {
@@ -46,6 +55,16 @@ private:
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    size_t nUsageSize; //! ... and the heap memory held by tx
+    CAmount feeDelta; //! Fee adjustment made by prioritisetransaction
+
+    uint64_t nCountWithDescendants; //! Number of descendant transactions
+    uint64_t nSizeWithDescendants; //! ... and their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees
+
+    uint64_t nCountWithAncestors; //! Number of ancestor transactions
+    uint64_t nSizeWithAncestors; //! ... and their total size
+    CAmount nModFeesWithAncestors; //! ... and their total modified fees
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -59,8 +78,176 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    CAmount GetModifiedFee() const { return nFee + feeDelta; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    //! Adjust the descendant state, when descendants enter or leave the pool
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Adjust the ancestor state, when ancestors enter or leave the pool
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Set the fee delta, updating both aggregates
+    void UpdateFeeDelta(CAmount newFeeDelta);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+//! Helpers for modifying entries inside CTxMemPool::mapTx
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+//! Extracts a transaction hash from a CTxMemPoolEntry
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort an entry by max(own fee rate, fee rate of the entry with all its
+ * descendants), lowest first. The front of this index is the package
+ * that costs the pool least to evict.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aModFee = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+
+        double bModFee = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aModFee * bSize;
+        double f2 = aSize * bModFee;
+
+        if (f1 == f2)
+            return a.GetTime() > b.GetTime();
+        return f1 < f2;
+    }
+
+    //! Whether the descendant package scores higher than the entry alone
+    bool UseDescendantScore(const CTxMemPoolEntry &a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/** Sort by entry time, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/** Sort by the entry's own modified fee rate, highest first */
+class CompareTxMemPoolEntryByScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return b.GetTx().GetHash() < a.GetTx().GetHash();
+        return f1 > f2;
+    }
 };
 
+/**
+ * Sort by min(own fee rate, fee rate of the entry with all its ancestors),
+ * highest first. This is the order in which packages are worth mining.
+ */
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees = a.GetModFeesWithAncestors();
+        double aSize = a.GetSizeWithAncestors();
+        if ((double)a.GetModifiedFee() * aSize < aFees * a.GetTxSize()) {
+            aFees = a.GetModifiedFee();
+            aSize = a.GetTxSize();
+        }
+
+        double bFees = b.GetModFeesWithAncestors();
+        double bSize = b.GetSizeWithAncestors();
+        if ((double)b.GetModifiedFee() * bSize < bFees * b.GetTxSize()) {
+            bFees = b.GetModifiedFee();
+            bSize = b.GetTxSize();
+        }
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aFees * bSize;
+        double f2 = aSize * bFees;
+
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+// Multi_index tag names
+struct descendant_score {};
+struct entry_time {};
+struct mining_score {};
+struct ancestor_score {};
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -85,6 +272,24 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx is a boost::multi_index container with five orderings:
+ * - by txid
+ * - by descendant score, lowest first, used to pick what to evict
+ * - by entry time, used to expire old transactions
+ * - by the entry's own fee rate, highest first
+ * - by ancestor score, highest first, used to pick what to mine
+ *
+ * mapLinks holds the direct in-pool parents and children of each entry.
+ * Every entry also caches the count, size and fees of all its in-pool
+ * ancestors and descendants. Adding a transaction updates its ancestors,
+ * removing one updates the ancestors and, when it was confirmed rather
+ * than dropped with its children, the descendants.
+ *
+ * A reorg is the one case where a transaction enters the pool with
+ * children already in it. Once the disconnected block's transactions are
+ * back in the pool, UpdateTransactionsFromBlock() links them to their
+ * in-pool children and fixes up the cached state.
  */
 class CTxMemPool
 {
@@ -95,10 +300,83 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    /**
+     * Minimum fee rate a transaction must pay to enter the pool after it
+     * has been trimmed. Decays back towards zero while no eviction happens.
+     */
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    //! Half-life of the rolling minimum fee, shortened when the pool is well below its limit
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by own fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByScore
+            >,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorScore
+            >
+        >
+    > indexed_transaction_set;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    const setEntries & GetMemPoolParents(txiter entry) const;
+    const setEntries & GetMemPoolChildren(txiter entry) const;
+
+private:
+    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+
+public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
@@ -114,13 +392,40 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /**
+     * Add to the pool without checking anything. addUnchecked() looks up
+     * the entry's in-pool ancestors itself, the second form takes them
+     * from a preceding CalculateMemPoolAncestors() call.
+     */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
                         std::list<CTransaction>& conflicts);
     void clear();
+
+    /**
+     * Called after a reorg has put the disconnected block's transactions,
+     * in block order, back into the pool. Links them to the children that
+     * were already in the pool and updates the ancestor and descendant
+     * state on both sides.
+     */
+    void UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate);
+
+    /**
+     * Find all in-pool ancestors of entry and check them against the limits.
+     * With fSearchForParents the parents are looked up from entry's inputs,
+     * otherwise entry must be in the pool and mapLinks is used.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string &errString, bool fSearchForParents = true) const;
+
+    /** Add entryit and all its in-pool descendants to setDescendants */
+    void CalculateDescendants(txiter entryit, setEntries &setDescendants) const;
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
@@ -131,6 +436,47 @@ public:
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /** Remove transactions which entered the pool before time, with their descendants. Returns the number removed. */
+    int Expire(int64_t time);
+
+    /**
+     * Evict the lowest fee-rate transactions, together with everything
+     * spending them, until the dynamic memory usage is below sizelimit.
+     */
+    void TrimToSize(size_t sizelimit);
+
+    /**
+     * The minimum fee rate to get into the pool, which rises after
+     * evictions and decays back to zero afterwards.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /** Heap memory used by the pool's entries and indexes */
+    size_t DynamicMemoryUsage() const;
+
+private:
+    /** Add or remove it from the descendant state of setAncestors, and as a child of its parents */
+    void UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors);
+    /** Set the ancestor state of it from setAncestors */
+    void UpdateEntryForAncestors(txiter it, const setEntries &setAncestors);
+    /**
+     * Add the descendants of updateIt that are not in setExclude to its
+     * descendant state, and updateIt to their ancestor state.
+     * cachedDescendants memoizes the walk across calls.
+     */
+    void UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants,
+                              const std::set<uint256> &setExclude);
+    /** Update the state of everything linked to entriesToRemove before they go */
+    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants);
+    /** Drop the parent links that point at it from its children */
+    void UpdateChildrenForRemoval(txiter it);
+    /** Remove a set of transactions whose relatives have not been updated yet */
+    void RemoveStaged(setEntries &stage, bool updateDescendants);
+    /** Remove a single transaction, everything linked to it must have been updated */
+    void removeUnchecked(txiter entry);
+
+public:
+
     unsigned long size()
     {
         LOCK(cs);
@@ -142,7 +488,7 @@ public:
         return totalTxSize;
     }
 
-    bool exists(uint256 hash)
+    bool exists(uint256 hash) const
     {
         LOCK(cs);
         return (mapTx.count(hash) != 0);
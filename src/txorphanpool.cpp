@@ -0,0 +1,205 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanpool.h"
+
+#include "util.h"
+#include "version.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+/** Largest orphan transaction kept, in bytes */
+const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Seconds an orphan transaction is kept waiting for its parents */
+const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+
+COrphanPool::COrphanPool(size_t nMaxCountIn, size_t nMaxSizeIn, size_t nMaxPeerSizeIn) :
+    nTotalSize(0), nMaxCount(nMaxCountIn), nMaxSize(nMaxSizeIn), nMaxPeerSize(nMaxPeerSizeIn)
+{
+}
+
+unsigned int COrphanPool::SetLimits(size_t nMaxCountIn, size_t nMaxSizeIn, size_t nMaxPeerSizeIn)
+{
+    LOCK(cs);
+    nMaxCount = nMaxCountIn;
+    nMaxSize = nMaxSizeIn;
+    nMaxPeerSize = nMaxPeerSizeIn;
+
+    unsigned int nEvicted = 0;
+    for (map<NodeId, COrphanPeer>::iterator itPeer = mapPeers.begin(); itPeer != mapPeers.end(); ) {
+        NodeId peer = (itPeer++)->first;
+        while (mapPeers.count(peer) && mapPeers[peer].nSize > nMaxPeerSize) {
+            EraseTxUnchecked(mapOrphans.find(mapPeers[peer].setOrphans.begin()->second));
+            ++nEvicted;
+        }
+    }
+    return nEvicted + LimitSize();
+}
+
+void COrphanPool::EraseTxUnchecked(map<uint256, COrphanTx>::iterator it)
+{
+    const uint256& hash = it->first;
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+    {
+        map<uint256, set<uint256> >::iterator itPrev = mapOrphansByPrev.find(txin.prevout.hash);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    map<NodeId, COrphanPeer>::iterator itPeer = mapPeers.find(orphan.fromPeer);
+    assert(itPeer != mapPeers.end());
+    itPeer->second.setOrphans.erase(make_pair(orphan.nTimeExpire, hash));
+    itPeer->second.nSize -= orphan.nTxSize;
+    if (itPeer->second.setOrphans.empty())
+        mapPeers.erase(itPeer);
+
+    setByExpiry.erase(make_pair(orphan.nTimeExpire, hash));
+    nTotalSize -= orphan.nTxSize;
+    mapOrphans.erase(it);
+}
+
+unsigned int COrphanPool::LimitSize()
+{
+    unsigned int nEvicted = 0;
+    while (!mapOrphans.empty() && (mapOrphans.size() > nMaxCount || nTotalSize > nMaxSize))
+    {
+        // The oldest orphan of the peer using the most bytes goes first
+        map<NodeId, COrphanPeer>::const_iterator itLargest = mapPeers.begin();
+        for (map<NodeId, COrphanPeer>::const_iterator itPeer = mapPeers.begin(); itPeer != mapPeers.end(); ++itPeer) {
+            if (itPeer->second.nSize > itLargest->second.nSize)
+                itLargest = itPeer;
+        }
+        EraseTxUnchecked(mapOrphans.find(itLargest->second.setOrphans.begin()->second));
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+bool COrphanPool::AddTx(const CTransaction& tx, NodeId peer, int64_t nTime)
+{
+    LOCK(cs);
+    uint256 hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int nTxSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (nTxSize > MAX_ORPHAN_TX_SIZE || nTxSize > nMaxPeerSize || nTxSize > nMaxSize || nMaxCount == 0)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nTxSize, hash.ToString());
+        return false;
+    }
+
+    unsigned int nExpired = Expire(nTime);
+
+    // A peer over its quota makes room from its own orphans
+    unsigned int nEvicted = 0;
+    while (mapPeers.count(peer) && mapPeers[peer].nSize + nTxSize > nMaxPeerSize) {
+        EraseTxUnchecked(mapOrphans.find(mapPeers[peer].setOrphans.begin()->second));
+        ++nEvicted;
+    }
+
+    COrphanTx& orphan = mapOrphans[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = nTime + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = nTxSize;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapOrphansByPrev[txin.prevout.hash].insert(hash);
+    COrphanPeer& orphanPeer = mapPeers[peer];
+    orphanPeer.setOrphans.insert(make_pair(orphan.nTimeExpire, hash));
+    orphanPeer.nSize += nTxSize;
+    setByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
+    nTotalSize += nTxSize;
+
+    nEvicted += LimitSize();
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u, %u expired, %u evicted)\n", hash.ToString(),
+             mapOrphans.size(), mapOrphansByPrev.size(), nTotalSize, nExpired, nEvicted);
+    return mapOrphans.count(hash) != 0;
+}
+
+bool COrphanPool::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) != 0;
+}
+
+bool COrphanPool::GetTx(const uint256& hash, COrphanTx& orphan) const
+{
+    LOCK(cs);
+    map<uint256, COrphanTx>::const_iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    orphan = it->second;
+    return true;
+}
+
+void COrphanPool::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, COrphanTx>::iterator it = mapOrphans.find(hash);
+    if (it != mapOrphans.end())
+        EraseTxUnchecked(it);
+}
+
+unsigned int COrphanPool::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    unsigned int nErased = 0;
+    while (mapPeers.count(peer)) {
+        EraseTxUnchecked(mapOrphans.find(mapPeers[peer].setOrphans.begin()->second));
+        ++nErased;
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    return nErased;
+}
+
+unsigned int COrphanPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    unsigned int nExpired = 0;
+    while (!setByExpiry.empty() && setByExpiry.begin()->first <= nTime) {
+        EraseTxUnchecked(mapOrphans.find(setByExpiry.begin()->second));
+        ++nExpired;
+    }
+    return nExpired;
+}
+
+void COrphanPool::GetChildren(const uint256& hashParent, vector<uint256>& vOrphans) const
+{
+    LOCK(cs);
+    map<uint256, set<uint256> >::const_iterator itByPrev = mapOrphansByPrev.find(hashParent);
+    if (itByPrev != mapOrphansByPrev.end())
+        vOrphans.insert(vOrphans.end(), itByPrev->second.begin(), itByPrev->second.end());
+}
+
+size_t COrphanPool::PeerSize(NodeId peer) const
+{
+    LOCK(cs);
+    map<NodeId, COrphanPeer>::const_iterator itPeer = mapPeers.find(peer);
+    return itPeer == mapPeers.end() ? 0 : itPeer->second.nSize;
+}
+
+void COrphanPool::clear()
+{
+    LOCK(cs);
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    mapPeers.clear();
+    setByExpiry.clear();
+    nTotalSize = 0;
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2015 The Bitcoin developers
+// Copyright (c) 2013-2017 The Anoncoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ANONCOIN_TXORPHANPOOL_H
+#define ANONCOIN_TXORPHANPOOL_H
+
+#include "net.h"
+#include "sync.h"
+#include "transaction.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+/** Largest orphan transaction kept, in bytes */
+extern const unsigned int MAX_ORPHAN_TX_SIZE;
+/** Seconds an orphan transaction is kept waiting for its parents */
+extern const int64_t ORPHAN_TX_EXPIRE_TIME;
+
+/** A transaction with inputs we do not know yet, and the peer it came from */
+struct COrphanTx
+{
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+};
+
+/**
+ * Transactions whose parents have not arrived yet. The pool is bounded by
+ * count and by bytes, and each peer by a byte quota of its own, so a peer
+ * flooding orphans only pushes out its own. Orphans expire after
+ * ORPHAN_TX_EXPIRE_TIME; otherwise the orphans of the peer using the most
+ * bytes are evicted oldest first.
+ */
+class COrphanPool
+{
+private:
+    /** What one peer has in the pool */
+    struct COrphanPeer
+    {
+        size_t nSize;
+        //! Expiry time and hash of the peer's orphans, the oldest first
+        std::set<std::pair<int64_t, uint256> > setOrphans;
+
+        COrphanPeer() : nSize(0) {}
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, COrphanTx> mapOrphans;
+    //! Orphans by the hash of a transaction they spend
+    std::map<uint256, std::set<uint256> > mapOrphansByPrev;
+    std::map<NodeId, COrphanPeer> mapPeers;
+    //! Expiry time and hash of all orphans, the oldest first
+    std::set<std::pair<int64_t, uint256> > setByExpiry;
+    size_t nTotalSize;
+
+    size_t nMaxCount;
+    size_t nMaxSize;
+    size_t nMaxPeerSize;
+
+    void EraseTxUnchecked(std::map<uint256, COrphanTx>::iterator it);
+    //! Evict orphans until count and size are within the limits, returns the number evicted
+    unsigned int LimitSize();
+
+public:
+    COrphanPool(size_t nMaxCountIn, size_t nMaxSizeIn, size_t nMaxPeerSizeIn);
+
+    /** Change the limits, evicting what no longer fits */
+    unsigned int SetLimits(size_t nMaxCountIn, size_t nMaxSizeIn, size_t nMaxPeerSizeIn);
+
+    /**
+     * Add tx received from peer at nTime. Fails if it is known or too large.
+     * Room is made first from what expired, then from the peer's own orphans
+     * if it would exceed its quota, then from the largest peer.
+     */
+    bool AddTx(const CTransaction& tx, NodeId peer, int64_t nTime);
+    bool HaveTx(const uint256& hash) const;
+    bool GetTx(const uint256& hash, COrphanTx& orphan) const;
+    void EraseTx(const uint256& hash);
+    /** Erase the orphans received from peer, returns the number erased */
+    unsigned int EraseForPeer(NodeId peer);
+    /** Erase the orphans expired at nTime, returns the number erased */
+    unsigned int Expire(int64_t nTime);
+    /** Append the orphans spending an output of hashParent to vOrphans */
+    void GetChildren(const uint256& hashParent, std::vector<uint256>& vOrphans) const;
+
+    size_t size() const
+    {
+        LOCK(cs);
+        return mapOrphans.size();
+    }
+    /** Serialized size of all orphans */
+    size_t TotalSize() const
+    {
+        LOCK(cs);
+        return nTotalSize;
+    }
+    /** Serialized size of the orphans received from peer */
+    size_t PeerSize(NodeId peer) const;
+    void clear();
+};
+
+#endif // ANONCOIN_TXORPHANPOOL_H
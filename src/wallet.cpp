@@ -9,6 +9,7 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
+#include "init.h"
 #include "net.h"
 #include "random.h"
 #include "sign.h"
@@ -564,6 +565,99 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+//! Whether a transaction, or one it spends from, might have changed which of
+//! its outputs are spent. The transactions it spends can only come back into
+//! setUnspentTxs this way: a spend leaves the main chain by being disconnected
+//! or conflicted, and either way the wallet gets the spending transaction again.
+void CWallet::QueueUnspentTx(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    setUnspentTxsQueued.insert(tx.GetHash());
+    if (!tx.IsCoinBase()) {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            setUnspentTxsQueued.insert(txin.prevout.hash);
+    }
+    fBalancesCached = false;
+}
+
+//! True if every output of ours is spent by a wallet transaction in the main
+//! chain. Immature coinbases are kept, their credit counts as immature.
+bool CWallet::IsSpentInMainChain(const CWalletTx& wtx) const
+{
+    if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
+        return false;
+
+    const uint256& wtxid = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        bool fSpent = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(wtxid, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpent; ++it)
+        {
+            map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            fSpent = mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 1;
+        }
+        if (!fSpent)
+            return false;
+    }
+    return true;
+}
+
+void CWallet::UpdateUnspentTxs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    BOOST_FOREACH(const uint256& hash, setUnspentTxsQueued)
+    {
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(hash);
+        if (mit == mapWallet.end() || IsSpentInMainChain(mit->second))
+            setUnspentTxs.erase(hash);
+        else
+            setUnspentTxs.insert(hash);
+    }
+    setUnspentTxsQueued.clear();
+}
+
+//! Sum all the balances in one pass over setUnspentTxs. The sums depend on
+//! the depth of each transaction, so they are redone when the tip or the
+//! mempool changes, and on every call while a transaction is not final yet,
+//! since that can change with the time alone.
+const CWalletBalances& CWallet::GetBalances() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    if (fBalancesCached && pindexBalances == chainActive.Tip() && nBalancesMempoolUpdated == nMempoolUpdated)
+        return cachedBalances;
+
+    UpdateUnspentTxs();
+    CWalletBalances balances;
+    bool fAllFinal = true;
+    BOOST_FOREACH(const uint256& hash, setUnspentTxs)
+    {
+        const CWalletTx& wtx = mapWallet.find(hash)->second;
+        bool fFinal = IsFinalTx(wtx);
+        fAllFinal &= fFinal;
+        if (wtx.IsTrusted()) {
+            balances.nTrusted += wtx.GetAvailableCredit();
+            balances.nWatchOnlyTrusted += wtx.GetAvailableWatchOnlyCredit();
+        } else if (!fFinal || wtx.GetDepthInMainChain() == 0) {
+            balances.nUnconfirmed += wtx.GetAvailableCredit();
+            balances.nWatchOnlyUnconfirmed += wtx.GetAvailableWatchOnlyCredit();
+        }
+        balances.nImmature += wtx.GetImmatureCredit();
+        balances.nWatchOnlyImmature += wtx.GetImmatureWatchOnlyCredit();
+    }
+
+    cachedBalances = balances;
+    fBalancesCached = fAllFinal;
+    pindexBalances = chainActive.Tip();
+    nBalancesMempoolUpdated = nMempoolUpdated;
+    return cachedBalances;
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -686,7 +780,12 @@ void CWallet::MarkDirty()
     {
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
             item.second.MarkDirty();
+            // Which outputs are ours may have changed, check them all again
+            setUnspentTxsQueued.insert(item.first);
+        }
+        fBalancesCached = false;
     }
 }
 
@@ -699,6 +798,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        QueueUnspentTx(wtxIn);
     }
     else
     {
@@ -791,6 +891,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        QueueUnspentTx(wtx);
 
         // Notify UI of new or updated transaction
         // LogPrintf( "%s : signal NotifyTransactionChanged(%s) sent.\n", __func__, fInsertedNew ? "CT_NEW" : "CT_UPDATED" );
@@ -951,44 +1052,333 @@ int64_t CWallet::GetChange(const CTransaction& tx) const
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+namespace {
+
+/** How many blocks the rescan readers may get ahead of the block being scanned */
+const unsigned int RESCAN_READ_AHEAD = 32;
+/** Most threads reading blocks for a rescan */
+const unsigned int RESCAN_MAX_READERS = 4;
+
+/**
+ * The key ids, script ids and watch-only scripts of a wallet, to tell without
+ * the wallet lock which outputs might be ours. It matches at least every
+ * output IsMine() does, and a few more (multisig with only some of the keys).
+ */
+struct CRescanFilter
+{
+    std::set<uint160> setIds;
+    std::set<CScript> setWatchOnly;
+
+    bool MayBeMine(const CTxOut& txout) const
+    {
+        vector<vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (Solver(txout.scriptPubKey, whichType, vSolutions))
+        {
+            switch (whichType)
+            {
+            case TX_PUBKEY:
+                if (setIds.count(CPubKey(vSolutions[0]).GetID()))
+                    return true;
+                break;
+            case TX_PUBKEYHASH:
+            case TX_SCRIPTHASH:
+                if (setIds.count(uint160(vSolutions[0])))
+                    return true;
+                break;
+            case TX_MULTISIG:
+                for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                    if (setIds.count(CPubKey(vSolutions[i]).GetID()))
+                        return true;
+                break;
+            default:
+                break;
+            }
+        }
+        return setWatchOnly.count(txout.scriptPubKey) != 0;
+    }
+};
+
+/** A block read for a rescan, with the positions of its transactions that have outputs that may be ours */
+struct CRescanBlock
+{
+    CBlock block;
+    std::vector<unsigned int> vMayBeMine;
+};
+
+/**
+ * Reads and filters the blocks of a rescan on a few threads, and hands them
+ * out in chain order. Reading is most of the work of a rescan, the proof of
+ * work of each block is checked again, and it needs no locks.
+ */
+class CRescanReader
+{
+private:
+    const std::vector<CBlockIndex*>& vIndex;
+    const CRescanFilter& filter;
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    size_t nNextRead;
+    size_t nNextScan;
+    bool fStop;
+    std::map<size_t, boost::shared_ptr<CRescanBlock> > mapRead;
+    boost::thread_group threadGroup;
+
+    void Thread()
+    {
+        while (true)
+        {
+            size_t nPos;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && nNextRead < vIndex.size() && nNextRead >= nNextScan + RESCAN_READ_AHEAD)
+                    cond.wait(lock);
+                if (fStop || nNextRead >= vIndex.size())
+                    return;
+                nPos = nNextRead++;
+            }
+
+            boost::shared_ptr<CRescanBlock> pread(new CRescanBlock());
+            if (!ReadBlockFromDisk(pread->block, vIndex[nPos]))
+                LogPrintf("%s : could not read block %d, skipping it\n", __func__, vIndex[nPos]->nHeight);
+            for (unsigned int i = 0; i < pread->block.vtx.size(); i++)
+            {
+                BOOST_FOREACH(const CTxOut& txout, pread->block.vtx[i].vout)
+                {
+                    if (filter.MayBeMine(txout)) {
+                        pread->vMayBeMine.push_back(i);
+                        break;
+                    }
+                }
+            }
+
+            boost::lock_guard<boost::mutex> lock(cs);
+            mapRead[nPos] = pread;
+            cond.notify_all();
+        }
+    }
+
+public:
+    CRescanReader(const std::vector<CBlockIndex*>& vIndexIn, const CRescanFilter& filterIn, unsigned int nThreads)
+        : vIndex(vIndexIn), filter(filterIn), nNextRead(0), nNextScan(0), fStop(false)
+    {
+        for (unsigned int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRescanReader::Thread, this));
+    }
+
+    ~CRescanReader()
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(cs);
+            fStop = true;
+            cond.notify_all();
+        }
+        threadGroup.join_all();
+    }
+
+    //! Wait for the next block in chain order
+    boost::shared_ptr<CRescanBlock> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<size_t, boost::shared_ptr<CRescanBlock> >::iterator it;
+        while ((it = mapRead.find(nNextScan)) == mapRead.end())
+            cond.wait(lock);
+        boost::shared_ptr<CRescanBlock> pread = it->second;
+        mapRead.erase(it);
+        nNextScan++;
+        cond.notify_all();
+        return pread;
+    }
+};
+
+/** Clears the rescan flag of a wallet however the rescan ends */
+class CRescanGuard
+{
+private:
+    CCriticalSection& cs;
+    bool& fScanning;
+
+public:
+    CRescanGuard(CCriticalSection& csIn, bool& fScanningIn) : cs(csIn), fScanning(fScanningIn) {}
+
+    ~CRescanGuard()
+    {
+        LOCK(cs);
+        fScanning = false;
+    }
+};
+
+} // anon namespace
+
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    bool fComplete = true;
     int64_t nNow = GetTime();
 
-    CBlockIndex* pindex = pindexStart;
+    // Take the blocks to scan and what to look for in them, then let go of the
+    // locks. Blocks are read and filtered without them, they are only taken
+    // again to add the transactions that matched.
+    std::vector<CBlockIndex*> vIndex;
+    CRescanFilter filter;
+    std::set<uint256> setWalletTxs;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
+        if (rescanStatus.fScanning) {
+            LogPrintf("%s : a rescan is already running\n", __func__);
+            return -1;
+        }
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
+        CBlockIndex* pindex = pindexStart;
         while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
+        for (; pindex; pindex = chainActive.Next(pindex))
+            vIndex.push_back(pindex);
+        if (vIndex.empty())
+            return 0;
+
+        {
+            LOCK(cs_KeyStore);
+            std::set<CKeyID> setKeyIds;
+            GetKeys(setKeyIds);
+            filter.setIds.insert(setKeyIds.begin(), setKeyIds.end());
+            for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+                filter.setIds.insert(it->first);
+            filter.setWatchOnly = setWatchOnly;
+        }
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setWalletTxs.insert(it->first);
+
+        dProgressStart = Checkpoints::GuessVerificationProgress(vIndex.front(), false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(vIndex.back(), false);
+
+        rescanStatus.fScanning = true;
+        rescanStatus.nStartHeight = vIndex.front()->nHeight;
+        rescanStatus.nHeight = vIndex.front()->nHeight;
+        rescanStatus.nStopHeight = vIndex.back()->nHeight;
+        rescanStatus.nFound = 0;
+        rescanStatus.nStartTime = GetTime();
+        fAbortRescan = false;
+    }
+    CRescanGuard guard(cs_wallet, rescanStatus.fScanning);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    {
+        unsigned int nReaders = std::max(2U, std::min(RESCAN_MAX_READERS, boost::thread::hardware_concurrency()));
+        CRescanReader reader(vIndex, filter, nReaders);
+        for (size_t i = 0; i < vIndex.size(); i++)
         {
+            CBlockIndex* pindex = vIndex[i];
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), max(1, min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            // Besides the outputs the readers found, a transaction is ours
+            // if it spends from the wallet, or is already in it and updated
+            boost::shared_ptr<CRescanBlock> pread = reader.Next();
+            const CBlock& block = pread->block;
+            std::vector<const CTransaction*> vMatches;
+            std::vector<unsigned int>::const_iterator itMayBeMine = pread->vMayBeMine.begin();
+            for (unsigned int j = 0; j < block.vtx.size(); j++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                const CTransaction& tx = block.vtx[j];
+                bool fMatch = false;
+                if (itMayBeMine != pread->vMayBeMine.end() && *itMayBeMine == j) {
+                    fMatch = true;
+                    ++itMayBeMine;
+                }
+                if (!fMatch && fUpdate)
+                    fMatch = setWalletTxs.count(tx.GetHash()) != 0;
+                if (!fMatch && !tx.IsCoinBase()) {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                        if ((fMatch = setWalletTxs.count(txin.prevout.hash) != 0))
+                            break;
+                    }
+                }
+                if (fMatch) {
+                    // Later transactions in the block may spend from this one
+                    setWalletTxs.insert(tx.GetHash());
+                    vMatches.push_back(&tx);
+                }
             }
-            pindex = chainActive.Next(pindex);
+
+            bool fAbort;
+            if (!vMatches.empty())
+            {
+                LOCK2(cs_main, cs_wallet);
+                // A block disconnected since the scan began had its transactions synced then
+                if (chainActive.Contains(pindex))
+                {
+                    CDBBatch batch(strWalletFile);
+                    BOOST_FOREACH(const CTransaction* ptx, vMatches)
+                    {
+                        if (AddToWalletIfInvolvingMe(*ptx, &block, fUpdate))
+                            ret++;
+                    }
+                }
+                rescanStatus.nHeight = pindex->nHeight;
+                rescanStatus.nFound = ret;
+                fAbort = fAbortRescan;
+            }
+            else
+            {
+                LOCK(cs_wallet);
+                rescanStatus.nHeight = pindex->nHeight;
+                fAbort = fAbortRescan;
+            }
+            if (fAbort || ShutdownRequested()) {
+                LogPrintf("%s : Rescan stopped at block %d\n", __func__, pindex->nHeight);
+                fComplete = false;
+                break;
+            }
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf( "%s : Still rescanning. At block %d. Progress=%f\n", __func__, pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex) );
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
-    return ret;
+    if (fComplete)
+    {
+        // The blocks connected since the scan began are scanned under the
+        // locks, so that the wallet is up to date with the tip on return
+        LOCK2(cs_main, cs_wallet);
+        rescanStatus.nStopHeight = chainActive.Height();
+        CDBBatch batch(strWalletFile);
+        for (CBlockIndex* pindex = chainActive.Next(chainActive.FindFork(vIndex.back())); pindex; pindex = chainActive.Next(pindex))
+        {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindex))
+                LogPrintf("%s : could not read block %d, skipping it\n", __func__, pindex->nHeight);
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            {
+                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                    ret++;
+            }
+            rescanStatus.nHeight = pindex->nHeight;
+            rescanStatus.nFound = ret;
+        }
+    }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    return fComplete ? ret : -1;
+}
+
+CRescanStatus CWallet::GetRescanStatus() const
+{
+    LOCK(cs_wallet);
+    return rescanStatus;
+}
+
+bool CWallet::AbortRescan()
+{
+    LOCK(cs_wallet);
+    if (!rescanStatus.fScanning)
+        return false;
+    fAbortRescan = true;
+    return true;
 }
 
 void CWallet::ReacceptWalletTransactions()
@@ -1037,92 +1427,38 @@ vector<uint256> CWallet::ResendWalletTransactionsBefore(int64_t nTime)
 
 CAmount CWallet::GetBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyImmature;
 }
 
 //! populate vCoins with vector of available COutputs.
@@ -1132,10 +1468,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspentTxs();
+        BOOST_FOREACH(const uint256& wtxid, setUnspentTxs)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1153,8 +1489,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
@@ -1162,7 +1498,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 }
 
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1202,6 +1538,88 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
+/**
+ * Depth first search for a subset of vValue, sorted by descending value,
+ * that adds up to between nTargetValue and nTargetValue + nMaxWaste. Each
+ * coin is first included, then excluded; a branch is cut as soon as the
+ * coins left cannot reach the target, coins that would overshoot the window
+ * are skipped with a binary search, and after excluding a coin the next ones
+ * of the same value are skipped too, as they would only repeat the same sums. Stops at an exact match, otherwise
+ * returns the smallest sum found within nMaxTries steps. Unlike
+ * ApproximateBestSubset it is deterministic for a given order of vValue.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue, const CAmount& nMaxWaste,
+                           vector<char>& vfBest, CAmount& nBest, int nMaxTries = 100000)
+{
+    const size_t nCoins = vValue.size();
+    vector<CAmount> vRemaining(nCoins + 1, 0);
+    for (size_t i = nCoins; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<size_t> vSelected;
+    vector<size_t> vBestSelected;
+    nBest = numeric_limits<CAmount>::max();
+    CAmount nTotal = 0;
+    size_t i = 0;
+
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal > nTargetValue + nMaxWaste)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue) {
+            if (nTotal < nBest) {
+                nBest = nTotal;
+                vBestSelected = vSelected;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (!fBacktrack) {
+            // Coins too big for what is left of the window would only
+            // overshoot it, go straight to the first one that fits
+            CAmount nRoom = nTargetValue + nMaxWaste - nTotal;
+            if (vValue[i].first > nRoom) {
+                size_t nLow = i, nHigh = nCoins;
+                while (nLow < nHigh) {
+                    size_t nMid = nLow + (nHigh - nLow) / 2;
+                    if (vValue[nMid].first > nRoom)
+                        nLow = nMid + 1;
+                    else
+                        nHigh = nMid;
+                }
+                i = nLow;
+                continue;
+            }
+
+            // Include coin i, the remaining coins can still reach the target
+            vSelected.push_back(i);
+            nTotal += vValue[i].first;
+            i++;
+            continue;
+        }
+
+        // Exclude the last coin included, and go on with the next smaller one
+        if (vSelected.empty())
+            break;
+        size_t nLast = vSelected.back();
+        vSelected.pop_back();
+        nTotal -= vValue[nLast].first;
+        i = nLast + 1;
+        while (i < nCoins && vValue[i].first == vValue[nLast].first)
+            i++;
+    }
+
+    if (vBestSelected.empty())
+        return false;
+    vfBest.assign(nCoins, false);
+    BOOST_FOREACH(size_t nSelected, vBestSelected)
+        vfBest[nSelected] = true;
+    return true;
+}
+
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
@@ -1267,9 +1685,30 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         fSolutionFound = true;
     }
 
+    if( !fSolutionFound ) {
+        // Coins of the same value stay in their shuffled order
+        stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+        vector<char> vfBest;
+        CAmount nBest;
+
+        // Change worth less than this would be dust, which CreateTransaction
+        // adds to the fee, so a subset overshooting by less needs no change
+        CTxOut txoutChange(0, GetScriptForDestination(CKeyID()));
+        CAmount nMaxWaste = 3 * minRelayTxFee.GetFee(txoutChange.GetSerializeSize(SER_DISK, 0) + 148u) - 1;
+        if (SelectCoinsBnB(vValue, nTargetValue, nMaxWaste, vfBest, nBest))
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+                if (vfBest[i]) {
+                    setCoinsRet.insert(vValue[i].second);
+                    nValueRet += vValue[i].first;
+                }
+            fResult = true;
+            fSolutionFound = true;
+        }
+    }
+
     if( !fSolutionFound ) {
         // Solve subset sum by stochastic approximation
-        sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
         vector<char> vfBest;
         CAmount nBest;
 
@@ -1693,6 +2132,7 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
+        CDBBatch batch(strWalletFile);
         CWalletDB walletdb(strWalletFile);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
@@ -1721,6 +2161,8 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
+        // One transaction for all the keys and pool entries, instead of a flush to disk for each key
+        CDBBatch batch(strWalletFile);
         CWalletDB walletdb(strWalletFile);
 
         // Top up key pool
@@ -1746,6 +2188,65 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
     return true;
 }
 
+void CWallet::RequestKeyPoolTopUp()
+{
+    {
+        LOCK(cs_wallet);
+        if (IsLocked())
+            return;
+        if (!fKeyPoolThread) {
+            TopUpKeyPool();
+            return;
+        }
+    }
+
+    boost::lock_guard<boost::mutex> lock(csKeyPoolThread);
+    fKeyPoolThreadWake = true;
+    condKeyPoolThread.notify_one();
+}
+
+void CWallet::ThreadTopUpKeyPool()
+{
+    RenameThread("anoncoin-keypool");
+    {
+        LOCK(cs_wallet);
+        fKeyPoolThread = true;
+    }
+
+    while (true)
+    {
+        // Refill in steps, so that a key request never waits behind more than a few new keys
+        bool fFailed = false;
+        try {
+            while (true)
+            {
+                boost::this_thread::interruption_point();
+                LOCK(cs_wallet);
+                unsigned int nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+                if (IsLocked() || setKeyPool.size() >= nTargetSize + 1)
+                    break;
+                TopUpKeyPool(min(nTargetSize, (unsigned int)setKeyPool.size() + 9));
+            }
+        }
+        catch (const std::exception& e) {
+            // A key that failed to write used to be an RPC error, here it must not end the node
+            PrintExceptionContinue(&e, "keypool");
+            fFailed = true;
+        }
+
+        // After a failure try again in a minute, unless a key request comes first
+        boost::unique_lock<boost::mutex> lock(csKeyPoolThread);
+        if (fFailed) {
+            if (!fKeyPoolThreadWake)
+                condKeyPoolThread.timed_wait(lock, boost::posix_time::seconds(60));
+        } else {
+            while (!fKeyPoolThreadWake)
+                condKeyPoolThread.wait(lock);
+        }
+        fKeyPoolThreadWake = false;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1753,8 +2254,11 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // With the keypool thread running, only make a key here if the pool is empty
+        if (!IsLocked() && (!fKeyPoolThread || setKeyPool.empty()))
+            TopUpKeyPool(fKeyPoolThread ? 1 : 0);
+        if (fKeyPoolThread)
+            RequestKeyPoolTopUp();
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -570,6 +570,32 @@ public:
     }
 };
 
+/** The wallet balances, spendable and watch-only */
+struct CWalletBalances
+{
+    CAmount nTrusted;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyUnconfirmed;
+    CAmount nWatchOnlyImmature;
+
+    CWalletBalances() : nTrusted(0), nUnconfirmed(0), nImmature(0), nWatchOnlyTrusted(0), nWatchOnlyUnconfirmed(0), nWatchOnlyImmature(0) {}
+};
+
+/** Where a wallet rescan is, as reported by getrescaninfo */
+struct CRescanStatus
+{
+    bool fScanning;
+    int nStartHeight;
+    int nHeight;
+    int nStopHeight;
+    int nFound;
+    int64_t nStartTime;
+
+    CRescanStatus() : fScanning(false), nStartHeight(0), nHeight(0), nStopHeight(0), nFound(0), nStartTime(0) {}
+};
+
 /**
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -602,6 +628,36 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    //! Wallet transactions that may still have an output of ours unspent. A transaction is dropped
+    //! once every output of ours is spent by a wallet transaction in the main chain, and comes back
+    //! when it is queued again, which happens whenever it or a transaction spending it is added or
+    //! updated. The balances and AvailableCoins only look at these transactions, not all of mapWallet.
+    mutable std::set<uint256> setUnspentTxs;
+    //! Transactions to add to or drop from setUnspentTxs when it is next used
+    mutable std::set<uint256> setUnspentTxsQueued;
+
+    //! Balance totals summed over setUnspentTxs, good for as long as neither the wallet, the tip nor
+    //! the mempool changes
+    mutable CWalletBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalances;
+    mutable unsigned int nBalancesMempoolUpdated;
+
+    //! Whether ThreadTopUpKeyPool runs, and what wakes it up when a key was taken from the pool
+    bool fKeyPoolThread;
+    CWaitableCriticalSection csKeyPoolThread;
+    CConditionVariable condKeyPoolThread;
+    bool fKeyPoolThreadWake;
+
+    //! The rescan in progress, and whether it was asked to stop
+    CRescanStatus rescanStatus;
+    bool fAbortRescan;
+
+    void QueueUnspentTx(const CTransaction& tx);
+    bool IsSpentInMainChain(const CWalletTx& wtx) const;
+    void UpdateUnspentTxs() const;
+    const CWalletBalances& GetBalances() const;
+
     //! check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
     //! Look up a destination data tuple in the store, return true if found false otherwise
@@ -682,6 +738,12 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        nBalancesMempoolUpdated = 0;
+        fAbortRescan = false;
+        fKeyPoolThread = false;
+        fKeyPoolThreadWake = false;
     }
 
     //!
@@ -754,8 +816,15 @@ public:
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     //!
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
-    //!
+    //! Scan the main chain from pindexStart for wallet transactions. Takes cs_main and cs_wallet only
+    //! briefly per block, so call it without holding them or the node stalls for the whole rescan.
+    //! Returns the number of transactions added, or -1 if another rescan was running or this one was
+    //! stopped by abortrescan or a shutdown before reaching the tip.
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    //! Progress of the running rescan, if any
+    CRescanStatus GetRescanStatus() const;
+    //! Ask the running rescan to stop after its current block, false if none is running
+    bool AbortRescan();
     //!
     void ReacceptWalletTransactions();
     //!
@@ -782,6 +851,10 @@ public:
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
     //!
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    //! Have ThreadTopUpKeyPool refill the keypool, or refill it here if that thread is not running
+    void RequestKeyPoolTopUp();
+    //! Keep the keypool full while the wallet is unlocked, a few keys per cs_wallet lock, until interrupted
+    void ThreadTopUpKeyPool();
     //!
     int64_t AddReserveKey(const CKeyPool& keypool);
     //!
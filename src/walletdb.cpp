@@ -783,11 +783,18 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet, vector<CWalletTx>& vWtx)
     if (err != DB_LOAD_OK)
         return err;
 
-    // erase each wallet TX
+    // erase each wallet TX, all of them or none; inside a CDBBatch that is
+    // up to the batch, whose owner aborts it on failure
+    bool fTxn = TxnBegin();
     BOOST_FOREACH (uint256& hash, vTxHash) {
-        if (!EraseTx(hash))
+        if (!EraseTx(hash)) {
+            if (fTxn)
+                TxnAbort();
             return DB_CORRUPT;
+        }
     }
+    if (fTxn && !TxnCommit())
+        return DB_CORRUPT;
 
     return DB_LOAD_OK;
 }